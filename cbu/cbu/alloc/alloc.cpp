@@ -30,6 +30,8 @@
 
 #include <string.h>
 
+#include <algorithm>
+
 #include "cbu/alloc/private.h"
 
 namespace cbu {
@@ -45,11 +47,18 @@ void* allocate(size_t size, AllocateOptions options) noexcept {
     // alignment.
   }
 
+  if (should_sample(size)) {
+    if (void* ptr = alloc_sampled(size, options)) return ptr;
+  }
+
   void* ptr = nullptr;
 
-  if (size > category_to_size(kMaxCategory)) {
+  if (size > kMediumAllocLimit) {
     ptr = alloc_large(size, options.zero);
     if (false_no_fail(ptr == nullptr)) return nomem();
+  } else if (size > kSmallAllocLimit) {
+    ptr = alloc_medium(size, options.zero);
+    if (false_no_fail(ptr == nullptr)) return nomem();
   } else if (size != 0) {
     if (options.zero) {
       ptr = alloc_small(size);
@@ -74,8 +83,39 @@ void* reallocate(void* ptr, size_t new_size, AllocateOptions options) noexcept {
   if (new_size == 0) {
     reclaim(ptr);
     return nullptr;
+  } else if (is_medium(ptr)) {  // Was medium block.
+    size_t old_size = medium_allocated_size(ptr);
+    void* nptr;
+    if (new_size <= kSmallAllocLimit) {
+      // Medium to small
+      nptr = alloc_small(new_size);
+    } else if (new_size <= kMediumAllocLimit) {
+      // Medium to medium
+      if (medium_category_to_size(size_to_medium_category(new_size)) ==
+          old_size)
+        return ptr;
+      nptr = alloc_medium(new_size, false);
+    } else {
+      // Medium to large
+      nptr = alloc_large(new_size, false);
+    }
+    if (true_no_fail(nptr)) {
+      nptr = memcpy(nptr, ptr, std::min(old_size, new_size));
+      free_medium(ptr);
+    }
+    return nptr;
   } else if (uintptr_t(ptr) % kPageSize) {  // Was small block.
     unsigned old_cat = small_allocated_category(ptr);
+    if (old_cat > kMaxCategory) {
+      if (old_cat != kGuardedCategory || !is_guarded(ptr)) memory_corrupt();
+      size_t old_size = guarded_allocated_size(ptr);
+      void* nptr = allocate(new_size);
+      if (true_no_fail(nptr)) {
+        nptr = memcpy(nptr, ptr, std::min(old_size, new_size));
+        free_guarded(ptr);
+      }
+      return nptr;
+    }
     size_t old_size = category_to_size(old_cat);
     size_t copy_size;
     void* nptr;
@@ -85,6 +125,10 @@ void* reallocate(void* ptr, size_t new_size, AllocateOptions options) noexcept {
       if (old_cat == new_cat) return ptr;
       nptr = alloc_small_category(new_cat);
       copy_size = std::min(old_size, new_size);
+    } else if (new_size <= kMediumAllocLimit) {
+      // Small to medium
+      nptr = alloc_medium(new_size, false);
+      copy_size = old_size;
     } else {
       // Small to large
       nptr = alloc_large(new_size, false);
@@ -99,6 +143,7 @@ void* reallocate(void* ptr, size_t new_size, AllocateOptions options) noexcept {
   } else if (ptr == nullptr) {
     return allocate(new_size, options);
   } else {  // Was large block.
+    maybe_free_sampled(ptr);
     if (new_size <= kSmallAllocLimit) {
       void* nptr = alloc_small(new_size);
       if (true_no_fail(nptr)) {
@@ -113,24 +158,77 @@ void* reallocate(void* ptr, size_t new_size, AllocateOptions options) noexcept {
 }
 
 void reclaim(void* ptr) noexcept {
-  if (uintptr_t(ptr) % kPageSize)  // Not aligned. Small blocks.
+  if (is_medium(ptr))
+    free_medium(ptr);
+  else if (uintptr_t(ptr) % kPageSize)  // Not aligned. Small blocks.
     free_small(ptr);
-  else if (ptr)  // Aligned. Large block.
+  else if (ptr) {  // Aligned. Large block.
+    maybe_free_sampled(ptr);
     free_large(ptr);
+  }
 }
 
 void reclaim(void* ptr, size_t size) noexcept {
-  // We must be very careful:
-  // size might be much smaller than our actually allocated size
-  // if the memory block was allocated with an alignment option
-  if (uintptr_t(ptr) % kPageSize)
+  if (is_medium(ptr))
+    free_medium(ptr, size);
+  else if (uintptr_t(ptr) % kPageSize)
     free_small(ptr, size);
-  else if (ptr)
+  else if (ptr) {
+    maybe_free_sampled(ptr);
     free_large(ptr, size);
+  }
+}
+
+size_t allocate_batch(size_t size, size_t n, void** out,
+                      AllocateOptions options) noexcept {
+  size_t boundary = options.align;
+  if (boundary) {
+    if (boundary > kPageSize) return 0;
+    if (boundary & (boundary - 1)) return 0;
+    size = (size + boundary - 1) & ~(boundary - 1);
+  }
+
+  size_t done = 0;
+  if (size == 0) {
+    std::fill_n(out, n, nullptr);
+    return n;
+  } else if (size <= kSmallAllocLimit) {
+    done = alloc_small_batch(size, n, out);
+  } else if (size <= kMediumAllocLimit) {
+    done = alloc_medium_batch(size, n, out);
+  }
+  if (options.zero)
+    for (size_t i = 0; i < done; ++i) memset(out[i], 0, size);
+
+  // Large blocks, or medium blocks if the medium region is unavailable
+  for (; done < n; ++done) {
+    void* ptr = size > kSmallAllocLimit ? alloc_large(size, options.zero)
+                                        : nullptr;
+    if (false_no_fail(ptr == nullptr)) {
+      nomem();
+      break;
+    }
+    out[done] = ptr;
+  }
+  return done;
+}
+
+void reclaim_batch(void** ptrs, size_t n) noexcept {
+  free_small_batch(ptrs, n);
+  free_medium_batch(ptrs, n);
+  for (size_t i = 0; i < n; ++i) {
+    void* ptr = ptrs[i];
+    if (ptr && !is_medium(ptr) && uintptr_t(ptr) % kPageSize == 0) {
+      maybe_free_sampled(ptr);
+      free_large(ptr);
+    }
+  }
 }
 
 size_t allocated_size(void* ptr) noexcept {
-  if (uintptr_t(ptr) % kPageSize)
+  if (is_medium(ptr))
+    return medium_allocated_size(ptr);
+  else if (uintptr_t(ptr) % kPageSize)
     return small_allocated_size(ptr);
   else if (ptr == nullptr)
     return 0;
@@ -140,8 +238,37 @@ size_t allocated_size(void* ptr) noexcept {
 
 void trim(size_t pad) noexcept {
   small_trim(pad);
+  medium_trim(pad);
   large_trim(pad);
 }
 
+// Small and medium caches may be held while taking page caches and arenas
+void fork_prepare() noexcept {
+  small_fork(ForkStage::PREPARE);
+  medium_fork(ForkStage::PREPARE);
+  profile_fork(ForkStage::PREPARE);
+  guard_fork(ForkStage::PREPARE);
+  large_fork(ForkStage::PREPARE);
+  thread_cache_fork(ForkStage::PREPARE);
+}
+
+void fork_parent() noexcept {
+  thread_cache_fork(ForkStage::PARENT);
+  large_fork(ForkStage::PARENT);
+  guard_fork(ForkStage::PARENT);
+  profile_fork(ForkStage::PARENT);
+  medium_fork(ForkStage::PARENT);
+  small_fork(ForkStage::PARENT);
+}
+
+void fork_child() noexcept {
+  thread_cache_fork(ForkStage::CHILD);
+  large_fork(ForkStage::CHILD);
+  guard_fork(ForkStage::CHILD);
+  profile_fork(ForkStage::CHILD);
+  medium_fork(ForkStage::CHILD);
+  small_fork(ForkStage::CHILD);
+}
+
 }  // namespace alloc
 }  // namespace cbu
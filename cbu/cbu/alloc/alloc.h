@@ -74,10 +74,161 @@ void* allocate(size_t size, AllocateOptions options = {}) noexcept;
 [[gnu::noinline]] void* reallocate(void* ptr, size_t new_size,
                  AllocateOptions options = {}) noexcept;
 [[gnu::noinline]] void reclaim(void* ptr) noexcept;
+// size must be the size requested from allocate or reallocate (rounded up
+// to the alignment if options.align was given).  The size class is derived
+// from it, without looking up the block; define CBU_ALLOC_CHECK_SIZED_FREE
+// to check it against the block.
 [[gnu::noinline]] void reclaim(void* ptr, size_t size) noexcept;
 [[gnu::noinline]] size_t allocated_size(void* ptr) noexcept;
+// Batch interfaces, which take the thread cache only once.
+// allocate_batch allocates n blocks of size bytes to out, and returns the
+// number allocated, which is less than n only if memory is exhausted.
+// Supported options: align; zero.  Batch allocations are not sampled.
+size_t allocate_batch(size_t size, size_t n, void** out,
+                      AllocateOptions options = {}) noexcept;
+// Blocks may be of different sizes, and may be nullptr
+void reclaim_batch(void** ptrs, size_t n) noexcept;
 void trim(size_t pad) noexcept;
 
+// Fork handlers, to be registered with pthread_atfork by whoever uses this
+// allocator as the process-wide allocator (e.g. cbu/malloc).  They make it
+// safe to allocate in the child of a multi-threaded process.
+void fork_prepare() noexcept;
+void fork_parent() noexcept;
+void fork_child() noexcept;
+
+// Decay of free pages
+// Free pages not reused in about decay_ms milliseconds are gradually returned
+// to the kernel.  0 returns them immediately; negative disables decay.
+// The default is 10 seconds.
+void set_decay_time(int decay_ms) noexcept;
+// Decay is done whenever pages are reclaimed.  An otherwise idle process
+// should call this periodically, or start the background thread.
+// This also shrinks thread caches that have been idle since the last call.
+void decay() noexcept;
+// Starts a thread that calls decay periodically.  Returns false on failure.
+// The thread doesn't survive fork; the child must call this again if it
+// wants one.
+bool start_background_decay() noexcept;
+
+// Thread caches of small and medium blocks adapt their limits, in bytes, per
+// size class.  They grow when freed blocks are flushed only to be allocated again, and
+// shrink when idle, about once per decay interval (checked as the thread
+// refills or flushes its cache, and by decay).  This caps the sum of all
+// limits, except that each size class always gets a few KiB (or one block).
+// The default is 64 MiB.
+void set_thread_cache_limit(size_t bytes) noexcept;
+
+// NUMA awareness, which is enabled by default on NUMA systems.  Memory is
+// preferably placed on the node of the allocating thread.  Disabling it only
+// affects memory mapped afterwards.
+// A thread's node is that of the CPU it runs on when it first allocates, and
+// is kept even if the thread moves, so pin threads before they allocate.
+void set_numa_aware(bool enable) noexcept;
+
+// Statistics
+// Counters are kept in thread caches and arenas, and are only updated when
+// a cache refills from or flushes to the shared structures, so allocation is
+// not slowed down; get_stats aggregates them by walking all caches.
+struct SizeClassStats {
+  uint32_t size;
+  // Blocks moved from runs to thread caches, and back (cumulative)
+  uint64_t allocated;
+  uint64_t freed;
+  // Blocks currently in thread caches.
+  // Blocks in use = allocated - freed - cached
+  uint64_t cached;
+  // Runs (small) or chunks (medium) currently held by this size class
+  uint64_t runs;
+};
+
+struct ArenaStats {
+  // Bytes handed out by the arena.  Pages may be freed to another arena, so
+  // this may be negative; only the sum over all arenas is accurate.
+  int64_t allocated;
+  // Free bytes that may be populated, and free bytes known to be zero
+  uint64_t dirty;
+  uint64_t clean;
+  // Arenas that allow THP only: hugepages with pages in use, and those with
+  // all pages in use.  Likewise, only the sums are accurate.
+  int64_t hugepages;
+  int64_t hugepages_full;
+};
+
+constexpr unsigned kStatsSmallClasses = 20;
+constexpr unsigned kStatsMediumClasses = 20;
+// The second half are the arenas that don't use transparent huge pages
+constexpr unsigned kStatsArenas = 32;
+
+struct Stats {
+  SizeClassStats small[kStatsSmallClasses];
+  SizeClassStats medium[kStatsMediumClasses];
+  ArenaStats arena[kStatsArenas];
+  // Bytes of medium chunks carved from the medium region, and those free
+  uint64_t medium_mapped;
+  uint64_t medium_free;
+  // Bytes of pages in thread caches
+  uint64_t page_cached;
+  // Bytes of large blocks in their own mappings
+  uint64_t large_mapped;
+  // Bytes mapped for arenas
+  uint64_t arena_mapped;
+  // Bytes of the large block trie, and of all metadata (including the trie)
+  uint64_t trie;
+  uint64_t metadata;
+  // Bytes of guarded blocks in use (see set_guard_rate)
+  uint64_t guarded;
+
+  // Bytes in use by the application (small and medium blocks are counted
+  // by their size classes)
+  uint64_t small_in_use() const noexcept;
+  uint64_t medium_in_use() const noexcept;
+  uint64_t large_in_use() const noexcept;
+  uint64_t in_use() const noexcept {
+    return small_in_use() + medium_in_use() + large_in_use() + guarded;
+  }
+  // Bytes mapped from the kernel
+  uint64_t mapped() const noexcept {
+    return medium_mapped + large_mapped + arena_mapped + metadata;
+  }
+  // Of the bytes handed out by arenas that allow THP, the fraction on
+  // hugepages that are completely in use, which are most likely backed by
+  // THP.  Fragmentation lowers it.
+  double thp_coverage() const noexcept;
+};
+
+void get_stats(Stats* stats) noexcept;
+
+enum class StatsFormat {
+  TEXT,
+  JSON,
+};
+
+// Like snprintf, returns the length of the full output, which may be larger
+// than size.  No memory is allocated.
+size_t format_stats(const Stats& stats, char* buf, size_t size,
+                    StatsFormat format) noexcept;
+
+// Heap profiling
+// Allocations are sampled about once every rate bytes; 0 (the default)
+// disables sampling.  Sampled blocks are recorded with their stack traces
+// until freed.  Reallocating a sampled block drops the sample.
+void set_sample_rate(size_t rate) noexcept;
+// Writes live samples to fd in the legacy gperftools heap profile format,
+// which pprof understands.  With try_lock, this is async-signal-safe, and
+// returns false if the samples are being modified.
+bool dump_heap_profile(int fd, bool try_lock = false) noexcept;
+
+// Guarded allocation, to catch memory errors in production
+// About once every rate bytes, a block no larger than pagesize - 16 bytes is
+// placed at the end of a page followed by an inaccessible page, and made
+// inaccessible when freed.  Up to 512 blocks are guarded at a time, and
+// freed ones are reused last.  Overflows, use after free and double free
+// crash with a report of where the block was allocated and freed (on
+// stderr, with /proc/self/maps for symbolization).  0 (the default)
+// disables it.
+void set_guard_rate(size_t rate) noexcept;
+
 // Low-level interface -- page allocation
 // Allocating pages is like anonymous mmap (however, if you prefer the memory
 // to be zero'd you need to set options.zero to true).
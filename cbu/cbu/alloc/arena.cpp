@@ -0,0 +1,126 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2021, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "cbu/alloc/arena.h"
+
+#include <algorithm>
+#include <new>
+#include <utility>
+
+#include "cbu/alloc/private.h"
+
+namespace cbu {
+namespace alloc {
+
+struct MonotonicArena::Block {
+  Block* next;
+  size_t size;
+};
+
+MonotonicArena::MonotonicArena(size_t block_size) noexcept
+    : block_size_(pagesize_ceil(std::max<size_t>(block_size, kPageSize))) {}
+
+void MonotonicArena::use_block(Block* block) noexcept {
+  current_ = block;
+  ptr_ = uintptr_t(block + 1);
+  end_ = uintptr_t(block) + block->size;
+}
+
+void* MonotonicArena::allocate_slow(size_t size, size_t align) noexcept {
+  if (align > kPageSize || (align & (align - 1))) return nullptr;
+
+  // Also if it doesn't fit in a regular block because of alignment, or we'd
+  // keep taking new blocks
+  if (size > block_size_ / 4 ||
+      pow2_ceil(sizeof(Block), align) + size > block_size_) {
+    size_t bytes = pagesize_ceil(sizeof(Block) + align - 1 + size);
+    if (bytes < size) return nomem();
+    Block* block = reinterpret_cast<Block*>(allocate_page(bytes));
+    if (false_no_fail(block == nullptr)) return nomem();
+    block->next = large_blocks_;
+    block->size = bytes;
+    large_blocks_ = block;
+    mapped_ += bytes;
+    return reinterpret_cast<void*>(pow2_ceil(uintptr_t(block + 1), align));
+  }
+
+  // Reuse blocks kept by reset before allocating new ones
+  Block* next = current_ ? current_->next : blocks_;
+  if (next == nullptr) {
+    next = reinterpret_cast<Block*>(allocate_page(block_size_));
+    if (false_no_fail(next == nullptr)) return nomem();
+    next->next = nullptr;
+    next->size = block_size_;
+    mapped_ += block_size_;
+    if (current_)
+      current_->next = next;
+    else
+      blocks_ = next;
+  }
+  use_block(next);
+  return allocate(size, align);
+}
+
+void MonotonicArena::reset() noexcept {
+  for (Block* block = std::exchange(large_blocks_, nullptr); block;) {
+    Block* next = block->next;
+    mapped_ -= block->size;
+    reclaim_page(reinterpret_cast<Page*>(block), block->size);
+    block = next;
+  }
+  current_ = nullptr;
+  ptr_ = end_ = 0;
+}
+
+void MonotonicArena::release() noexcept {
+  reset();
+  for (Block* block = std::exchange(blocks_, nullptr); block;) {
+    Block* next = block->next;
+    reclaim_page(reinterpret_cast<Page*>(block), block->size);
+    block = next;
+  }
+  mapped_ = 0;
+}
+
+void* MonotonicArenaResource::do_allocate(size_t bytes, size_t alignment) {
+  // Zero-sized allocations must still return distinct pointers
+  void* p = arena_->allocate(bytes ? bytes : 1, alignment);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+bool MonotonicArenaResource::do_is_equal(
+    const std::pmr::memory_resource& other) const noexcept {
+  if (this == &other) return true;
+  auto* o = dynamic_cast<const MonotonicArenaResource*>(&other);
+  return o && o->arena_ == arena_;
+}
+
+}  // namespace alloc
+}  // namespace cbu
@@ -0,0 +1,126 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2021, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+#include <utility>
+
+#include "cbu/alloc/alloc.h"
+#include "cbu/alloc/pagesize.h"
+
+namespace cbu {
+namespace alloc {
+
+// Bump-pointer allocation in blocks of pages.  Memory is never freed
+// individually, but all at once by reset or release, which takes time
+// proportional to the number of blocks.
+// Blocks are kept by reset for reuse.  Allocations larger than a quarter
+// of the block size get blocks of their own, which reset releases.
+// Not thread-safe.
+class MonotonicArena {
+ public:
+  // Blocks of this size are served by the thread caches of pages
+  static constexpr size_t kDefaultBlockSize = 8 * kPageSize;
+
+  explicit MonotonicArena(size_t block_size = kDefaultBlockSize) noexcept;
+  MonotonicArena(const MonotonicArena&) = delete;
+  MonotonicArena& operator=(const MonotonicArena&) = delete;
+  ~MonotonicArena() noexcept { release(); }
+
+  // Alignment must be a power of 2.  Returns nullptr on failure, which may
+  // also be due to alignment larger than pagesize.
+  void* allocate(size_t size,
+                 size_t align = alignof(std::max_align_t)) noexcept {
+    uintptr_t p = (ptr_ + align - 1) & ~(align - 1);
+    if (p < end_ && size <= end_ - p) [[likely]] {
+      ptr_ = p + size;
+      return reinterpret_cast<void*>(p);
+    }
+    return allocate_slow(size, align);
+  }
+
+  template <typename T, typename... Args>
+  T* create(Args&&... args) {
+    void* p = allocate(sizeof(T), alignof(T));
+    if (p == nullptr) return nullptr;
+    return new (p) T(std::forward<Args>(args)...);
+  }
+
+  // Forgets all allocations, keeping the regular blocks for reuse
+  void reset() noexcept;
+  // Forgets all allocations, and returns all blocks
+  void release() noexcept;
+
+  // Bytes of all blocks
+  size_t mapped() const noexcept { return mapped_; }
+
+ private:
+  struct Block;
+
+  void* allocate_slow(size_t size, size_t align) noexcept;
+  void use_block(Block* block) noexcept;
+
+ private:
+  uintptr_t ptr_ = 0;
+  uintptr_t end_ = 0;
+  size_t block_size_;
+  size_t mapped_ = 0;
+  // Regular blocks, and the one in use (nullptr before the first)
+  Block* blocks_ = nullptr;
+  Block* current_ = nullptr;
+  // Blocks of large allocations
+  Block* large_blocks_ = nullptr;
+};
+
+// Adapts MonotonicArena for std::pmr containers.  Deallocation does nothing.
+class MonotonicArenaResource : public std::pmr::memory_resource {
+ public:
+  explicit MonotonicArenaResource(MonotonicArena* arena) noexcept
+      : arena_(arena) {}
+
+  MonotonicArena* arena() const noexcept { return arena_; }
+
+ private:
+  void* do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void*, size_t, size_t) noexcept override {}
+  bool do_is_equal(
+      const std::pmr::memory_resource& other) const noexcept override;
+
+ private:
+  MonotonicArena* arena_;
+};
+
+}  // namespace alloc
+}  // namespace cbu
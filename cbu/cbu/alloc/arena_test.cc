@@ -0,0 +1,101 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2021, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "cbu/alloc/arena.h"
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+namespace cbu {
+namespace alloc {
+
+TEST(MonotonicArenaTest, Allocate) {
+  MonotonicArena arena;
+  EXPECT_EQ(0, arena.mapped());
+
+  char* prev = nullptr;
+  for (size_t i = 1; i < 10000; ++i) {
+    char* p = static_cast<char*>(arena.allocate(i % 100 + 1, 8));
+    ASSERT_NE(nullptr, p);
+    EXPECT_EQ(0, uintptr_t(p) % 8);
+    memset(p, 0xcc, i % 100 + 1);
+    EXPECT_NE(prev, p);
+    prev = p;
+  }
+  size_t mapped = arena.mapped();
+  EXPECT_GT(mapped, 0);
+
+  // Large allocations get their own blocks
+  void* large = arena.allocate(MonotonicArena::kDefaultBlockSize, 4096);
+  ASSERT_NE(nullptr, large);
+  EXPECT_EQ(0, uintptr_t(large) % 4096);
+  memset(large, 0, MonotonicArena::kDefaultBlockSize);
+  EXPECT_GT(arena.mapped(), mapped);
+
+  // Regular blocks are reused after reset
+  arena.reset();
+  EXPECT_EQ(mapped, arena.mapped());
+  for (size_t i = 1; i < 10000; ++i)
+    ASSERT_NE(nullptr, arena.allocate(i % 100 + 1, 8));
+  EXPECT_EQ(mapped, arena.mapped());
+
+  arena.release();
+  EXPECT_EQ(0, arena.mapped());
+  EXPECT_NE(nullptr, arena.create<int>(5));
+}
+
+TEST(MonotonicArenaTest, PageAlign) {
+  // A page-aligned block never fits in a regular one-page block
+  MonotonicArena arena(kPageSize);
+  for (size_t size : {1u, kPageSize / 4, kPageSize}) {
+    void* p = arena.allocate(size, kPageSize);
+    ASSERT_NE(nullptr, p);
+    EXPECT_EQ(0, uintptr_t(p) % kPageSize);
+    memset(p, 0xcc, size);
+  }
+  EXPECT_LE(arena.mapped(), 8 * kPageSize);
+}
+
+TEST(MonotonicArenaTest, MemoryResource) {
+  MonotonicArena arena;
+  MonotonicArenaResource resource(&arena);
+  MonotonicArenaResource other(&arena);
+  EXPECT_TRUE(resource.is_equal(other));
+
+  std::pmr::vector<int> v(&resource);
+  for (int i = 0; i < 100000; ++i) v.push_back(i);
+  for (int i = 0; i < 100000; ++i) ASSERT_EQ(i, v[i]);
+  EXPECT_GT(arena.mapped(), 100000 * sizeof(int));
+}
+
+}  // namespace alloc
+}  // namespace cbu
@@ -0,0 +1,286 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2021, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "cbu/alloc/alloc.h"
+#include "cbu/alloc/private.h"
+#include "cbu/alloc/report.h"
+#include "cbu/fsyscall/fsyscall.h"
+#include "cbu/sys/low_level_mutex.h"
+
+namespace cbu {
+namespace alloc {
+namespace {
+
+// Region layout: a guard page, then a data page and a guard page per slot
+constexpr unsigned kGuardSlots = 512;
+constexpr size_t kGuardRegionSize = (2 * kGuardSlots + 1) * kPageSize;
+// Blocks are aligned to this, so there may be slack before the guard page
+constexpr size_t kGuardAlign = 16;
+constexpr size_t kMaxGuardedSize = kPageSize - kGuardAlign;
+constexpr unsigned char kSlackByte = 0xab;
+constexpr unsigned kGuardFrames = 16;
+
+enum class SlotState : unsigned char {
+  UNUSED,
+  ALLOCATED,
+  FREED,
+};
+
+struct Slot {
+  void* ptr;
+  size_t size;
+  SlotState state;
+  unsigned char alloc_depth;
+  unsigned char free_depth;
+  void* alloc_frames[kGuardFrames];
+  void* free_frames[kGuardFrames];
+};
+
+// Slots are reused in FIFO order, so that freed blocks stay inaccessible
+// (quarantined) as long as possible.
+struct GuardPool {
+  LowLevelMutex lock{};
+  bool init_failed = false;
+  Slot* slots = nullptr;
+  unsigned head = 0;
+  unsigned count = 0;
+  unsigned short queue[kGuardSlots] = {};
+};
+
+constinit GuardPool guard_pool;
+constinit std::atomic<size_t> guard_rate{0};
+constinit std::atomic<size_t> guarded_bytes{0};
+struct sigaction old_segv_action;
+
+inline Page* slot_page(unsigned idx) noexcept {
+  return reinterpret_cast<Page*>(
+      guard_region.base.load(std::memory_order_relaxed) +
+      (2 * idx + 1) * kPageSize);
+}
+
+void report(const char* what, const void* addr, const Slot* slot) noexcept {
+  FdWriter w(2);
+  w << "cbu malloc: " << what << " at " << addr << "\n";
+  if (slot && slot->state != SlotState::UNUSED) {
+    w << uint64_t(slot->size) << "-byte block at " << slot->ptr
+      << " allocated by:\n";
+    for (unsigned i = 0; i < slot->alloc_depth; ++i)
+      w << "  #" << uint64_t(i) << " " << slot->alloc_frames[i] << "\n";
+    if (slot->state == SlotState::FREED) {
+      w << "freed by:\n";
+      for (unsigned i = 0; i < slot->free_depth; ++i)
+        w << "  #" << uint64_t(i) << " " << slot->free_frames[i] << "\n";
+    }
+  }
+  w.write_maps();
+}
+
+[[noreturn]] void report_fatal(const char* what, const void* addr,
+                               const Slot* slot) noexcept {
+  report(what, addr, slot);
+  fatal("Memory corrupt\n");
+}
+
+void segv_handler(int signo, siginfo_t* info, void* ctx) noexcept {
+  void* addr = info->si_addr;
+  uintptr_t offset =
+      uintptr_t(addr) - guard_region.base.load(std::memory_order_relaxed);
+  if (offset < guard_region.size.load(std::memory_order_relaxed)) {
+    size_t page = offset / kPageSize;
+    const Slot* slot = nullptr;
+    const char* what;
+    if (page % 2) {
+      slot = &guard_pool.slots[page / 2];
+      if (slot->state != SlotState::FREED)
+        what = "invalid access";
+      else if (offset % kPageSize < kGuardAlign)
+        what = "double free";  // free and realloc read the header
+      else
+        what = "use after free";
+    } else if (page && guard_pool.slots[page / 2 - 1].state ==
+                           SlotState::ALLOCATED) {
+      // Blocks are at the end of their pages, so this is more likely
+      slot = &guard_pool.slots[page / 2 - 1];
+      what = "buffer overflow";
+    } else if (page / 2 < kGuardSlots) {
+      slot = &guard_pool.slots[page / 2];
+      what = "buffer underflow or overflow";
+    } else {
+      what = "invalid access";
+    }
+    report(what, addr, slot);
+  } else if (old_segv_action.sa_flags & SA_SIGINFO) {
+    if (old_segv_action.sa_sigaction) {
+      old_segv_action.sa_sigaction(signo, info, ctx);
+      return;
+    }
+  } else if (old_segv_action.sa_handler != SIG_DFL &&
+             old_segv_action.sa_handler != SIG_IGN) {
+    old_segv_action.sa_handler(signo);
+    return;
+  }
+  // Returning retries the access, which then crashes
+  signal(SIGSEGV, SIG_DFL);
+}
+
+bool init_unlocked() noexcept {
+  if (guard_pool.init_failed) return false;
+  guard_pool.init_failed = true;
+
+  void* region = fsys_mmap(nullptr, kGuardRegionSize, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (fsys_mmap_failed(region)) return false;
+  void* slots =
+      fsys_mmap(nullptr, pagesize_ceil(sizeof(Slot) * kGuardSlots),
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (fsys_mmap_failed(slots)) {
+    fsys_munmap(region, kGuardRegionSize);
+    return false;
+  }
+
+  struct sigaction sa {};
+  sa.sa_sigaction = segv_handler;
+  sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGSEGV, &sa, &old_segv_action);
+
+  for (unsigned i = 0; i < kGuardSlots; ++i) guard_pool.queue[i] = i;
+  guard_pool.count = kGuardSlots;
+  guard_pool.slots = static_cast<Slot*>(slots);
+  guard_region.base.store(uintptr_t(region), std::memory_order_relaxed);
+  guard_region.size.store(kGuardRegionSize, std::memory_order_release);
+  guard_pool.init_failed = false;
+  return true;
+}
+
+void push_slot_unlocked(unsigned idx) noexcept {
+  guard_pool.queue[(guard_pool.head + guard_pool.count++) % kGuardSlots] =
+      idx;
+}
+
+// Finds the slot of a block, or crashes
+Slot* lookup_slot(void* ptr) noexcept {
+  uintptr_t offset =
+      uintptr_t(ptr) - guard_region.base.load(std::memory_order_relaxed);
+  size_t page = offset / kPageSize;
+  Slot* slot = &guard_pool.slots[page / 2];
+  if (page % 2 == 0 || page / 2 >= kGuardSlots)
+    report_fatal("invalid free", ptr, nullptr);
+  if (slot->state != SlotState::ALLOCATED)
+    report_fatal("double free", ptr, slot);
+  if (slot->ptr != ptr) report_fatal("invalid free", ptr, slot);
+  return slot;
+}
+
+}  // namespace
+
+size_t guard_sample_rate() noexcept {
+  return guard_rate.load(std::memory_order_relaxed);
+}
+
+void* alloc_guarded(size_t size) noexcept {
+  size_t rounded = pow2_ceil(size, kGuardAlign);
+  if (rounded > kMaxGuardedSize) return nullptr;
+
+  unsigned idx;
+  {
+    std::lock_guard locker(guard_pool.lock);
+    if (guard_pool.slots == nullptr && !init_unlocked()) return nullptr;
+    if (guard_pool.count == 0) return nullptr;
+    idx = guard_pool.queue[guard_pool.head];
+    guard_pool.head = (guard_pool.head + 1) % kGuardSlots;
+    guard_pool.count--;
+  }
+
+  Page* page = slot_page(idx);
+  if (fsys_mprotect(page, kPageSize, PROT_READ | PROT_WRITE) != 0) {
+    std::lock_guard locker(guard_pool.lock);
+    push_slot_unlocked(idx);
+    return nullptr;
+  }
+  *reinterpret_cast<unsigned*>(page) = kGuardedCategory;
+  char* ptr = page->b + kPageSize - rounded;
+  memset(ptr + size, kSlackByte, rounded - size);
+
+  Slot* slot = &guard_pool.slots[idx];
+  slot->ptr = ptr;
+  slot->size = size;
+  // Skip capture_backtrace, alloc_guarded and alloc_sampled
+  slot->alloc_depth = capture_backtrace(slot->alloc_frames, kGuardFrames, 3);
+  slot->state = SlotState::ALLOCATED;
+  guarded_bytes.fetch_add(size, std::memory_order_relaxed);
+  return ptr;
+}
+
+void free_guarded(void* ptr) noexcept {
+  Slot* slot = lookup_slot(ptr);
+  const unsigned char* p = static_cast<unsigned char*>(ptr);
+  for (size_t i = slot->size; i < pow2_ceil(slot->size, kGuardAlign); ++i)
+    if (p[i] != kSlackByte) report_fatal("buffer overflow", p + i, slot);
+
+  // Skip capture_backtrace and free_guarded
+  slot->free_depth = capture_backtrace(slot->free_frames, kGuardFrames, 2);
+  slot->state = SlotState::FREED;
+  guarded_bytes.fetch_sub(slot->size, std::memory_order_relaxed);
+
+  // Accessing the block crashes from now on, until the slot is reused
+  Page* page = reinterpret_cast<Page*>(pagesize_floor(uintptr_t(ptr)));
+  fsys_madvise(page, kPageSize, MADV_DONTNEED);
+  fsys_mprotect(page, kPageSize, PROT_NONE);
+  std::lock_guard locker(guard_pool.lock);
+  push_slot_unlocked(slot - guard_pool.slots);
+}
+
+size_t guarded_allocated_size(void* ptr) noexcept {
+  return lookup_slot(ptr)->size;
+}
+
+void guard_stats(Stats* stats) noexcept {
+  stats->guarded = guarded_bytes.load(std::memory_order_relaxed);
+}
+
+void guard_fork(ForkStage stage) noexcept {
+  fork_lock(&guard_pool.lock, stage);
+}
+
+void set_guard_rate(size_t rate) noexcept {
+  guard_rate.store(rate, std::memory_order_relaxed);
+  // Let the current thread notice it immediately
+  rearm_sampling();
+}
+
+}  // namespace alloc
+}  // namespace cbu
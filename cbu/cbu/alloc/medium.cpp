@@ -0,0 +1,573 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2021, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <utility>
+
+#include "cbu/alloc/alloc.h"
+#include "cbu/alloc/private.h"
+#include "cbu/alloc/tc.h"
+#include "cbu/common/byte_size.h"
+#include "cbu/compat/atomic_ref.h"
+#include "cbu/fsyscall/fsyscall.h"
+#include "cbu/sys/low_level_mutex.h"
+#include "cbu/tweak/tweak.h"
+
+namespace cbu {
+namespace alloc {
+namespace {
+
+// Medium blocks live in chunks of kMediumChunkSize bytes, carved from a
+// reserved address range.  Like small runs, the chunk header is at the
+// beginning, and blocks are packed toward the end of the chunk.
+// Chunks are aligned, so the header is found by rounding down the address.
+constexpr size_t kMediumChunkSize = 256 * 1024;
+constexpr size_t kMediumRegionSize =
+    sizeof(void*) > 4 ? size_t(64) * 1024 * 1024 * 1024 : 256 * 1024 * 1024;
+
+struct Block {
+  Block* next;  // In free list
+  unsigned count;
+};
+
+struct ThreadCategory {
+  Block* free;
+  unsigned count_free;
+  // Maximum of count_free (0 until the first free), adapted by
+  // adapt_limit and scavenge, like those of small caches
+  unsigned limit;
+  // Minimum of count_free since the last scavenge
+  unsigned low_water;
+  // Allocations not served by free since the last overflow
+  unsigned misses;
+  // Blocks of the last chunk taken that were never allocated.  They're not
+  // resident, so they don't count toward the limit.  fresh->count blocks
+  // from fresh.
+  Block* fresh;
+};
+
+// Statistics, only updated in slow paths
+struct CategoryStats {
+  uint64_t allocated;
+  uint64_t freed;
+  // Chunks may be freed through other caches, so only the sum is meaningful
+  uint64_t chunks;
+};
+
+struct MediumCache {
+  ThreadCategory category[kNumMediumCategories] = {};
+  CategoryStats stats[kNumMediumCategories] = {};
+  uint64_t scavenged_ms = 0;  // When scavenge last ran
+
+  void clear() noexcept;
+};
+
+CachePool<MediumCache> medium_cache_pool;
+
+struct Chunk {
+  unsigned cat;
+  unsigned allocated;
+  Chunk* next;  // In free chunk list
+};
+
+inline constexpr auto kMediumCategoryBlocks = [] {
+  std::array<uint16_t, kNumMediumCategories> res{};
+  for (unsigned cat = 0; cat < kNumMediumCategories; ++cat)
+    res[cat] =
+        (kMediumChunkSize - sizeof(Chunk)) / medium_category_to_size(cat);
+  return res;
+}();
+
+inline constexpr unsigned medium_category_blocks(unsigned cat) {
+  return kMediumCategoryBlocks[cat];
+}
+
+inline constexpr size_t medium_category_first_block_offset(unsigned cat) {
+  return kMediumChunkSize -
+         medium_category_blocks(cat) * medium_category_to_size(cat);
+}
+
+inline constexpr auto kMediumCategoryMagic = [] {
+  std::array<uint64_t, kNumMediumCategories> res{};
+  for (unsigned cat = 0; cat < kNumMediumCategories; ++cat)
+    res[cat] = divisibility_magic(medium_category_to_size(cat));
+  return res;
+}();
+
+// Whether offset (in the chunk) is that of a block of the category
+inline constexpr bool is_medium_category_block_offset(size_t offset,
+                                                      unsigned cat) {
+  return offset >= medium_category_first_block_offset(cat) &&
+         is_multiple_of(kMediumChunkSize - offset, kMediumCategoryMagic[cat]);
+}
+
+inline Chunk* block2chunk(void* ptr) {
+  return (Chunk*)pow2_floor(ptr, kMediumChunkSize);
+}
+
+// Limits of each category of a cache, in bytes, charged to the budget shared
+// with small caches.  Every category may keep at least one block.
+constexpr size_t kMinMediumCacheBytes = 4096;
+constexpr size_t kInitialMediumCacheBytes = 16384;
+constexpr size_t kMaxMediumCacheBytes = 2 * kMediumChunkSize;
+
+inline constexpr unsigned medium_cache_blocks(size_t bytes, unsigned cat) {
+  return std::max<size_t>(bytes / medium_category_to_size(cat), 1);
+}
+
+class ChunkAllocator {
+ public:
+  constexpr ChunkAllocator() noexcept = default;
+  ChunkAllocator(const ChunkAllocator&) = delete;
+  ChunkAllocator& operator=(const ChunkAllocator&) = delete;
+
+  Chunk* allocate() noexcept;
+  void reclaim(Chunk*) noexcept;
+
+  // Bytes carved from the region, and bytes in the free list
+  std::pair<size_t, size_t> stats() noexcept;
+
+  void fork(ForkStage stage) noexcept { fork_lock(&lock_, stage); }
+
+ private:
+  bool reserve_unlocked() noexcept;
+
+ private:
+  LowLevelMutex lock_{};
+  bool reserve_failed_ = false;
+  uintptr_t bump_ = 0;
+  uintptr_t end_ = 0;
+  Chunk* free_list_ = nullptr;
+  size_t free_count_ = 0;
+};
+
+constinit ChunkAllocator chunk_allocator;
+
+bool ChunkAllocator::reserve_unlocked() noexcept {
+  if (reserve_failed_) return false;
+
+  // Reserve one more chunk so that we can align it
+  size_t size = kMediumRegionSize + kMediumChunkSize;
+  void* p = fsys_mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (fsys_mmap_failed(p)) {
+    reserve_failed_ = true;
+    return false;
+  }
+
+  uintptr_t base = pow2_ceil(uintptr_t(p), kMediumChunkSize);
+  bump_ = base;
+  end_ = base + kMediumRegionSize;
+  medium_region.base.store(base, std::memory_order_relaxed);
+  medium_region.size.store(kMediumRegionSize, std::memory_order_release);
+  return true;
+}
+
+Chunk* ChunkAllocator::allocate() noexcept {
+  std::lock_guard locker(lock_);
+  if (Chunk* chunk = free_list_) {
+    free_list_ = chunk->next;
+    free_count_--;
+    return chunk;
+  }
+  if (bump_ == 0 && !reserve_unlocked()) return nullptr;
+  if (bump_ == end_) return nullptr;
+  Chunk* chunk = reinterpret_cast<Chunk*>(bump_);
+  bump_ += kMediumChunkSize;
+  return chunk;
+}
+
+void ChunkAllocator::reclaim(Chunk* chunk) noexcept {
+  fsys_madvise(chunk, kMediumChunkSize, MADV_DONTNEED);
+  std::lock_guard locker(lock_);
+  chunk->next = free_list_;
+  free_list_ = chunk;
+  free_count_++;
+}
+
+std::pair<size_t, size_t> ChunkAllocator::stats() noexcept {
+  std::lock_guard locker(lock_);
+  size_t base = medium_region.base.load(std::memory_order_relaxed);
+  return {bump_ ? bump_ - base : 0, free_count_ * kMediumChunkSize};
+}
+
+void free_medium_list(Block* ptr, CategoryStats* stats) {
+  while (ptr) {
+    Block* p = std::exchange(ptr, ptr->next);
+
+    Chunk* chunk = block2chunk(p);
+    auto count = p->count;
+    int remain = cbu::tweak::SINGLE_THREADED
+                     ? (chunk->allocated -= count)
+                     : std::atomic_ref(chunk->allocated)
+                               .fetch_sub(count, std::memory_order_release) -
+                           count;
+    if (remain <= 0) {
+      if (remain < 0) memory_corrupt();
+      stats->chunks--;
+      chunk_allocator.reclaim(chunk);
+    }
+  }
+}
+
+// Detaches n blocks from the head of the free list, like that of small caches
+Block* detach_blocks(ThreadCategory* catp, size_t size, unsigned n) {
+  Block* res = nullptr;
+  catp->count_free -= n;
+  while (n) {
+    Block* free = catp->free;
+    unsigned count = free->count;
+    if (count <= n) {
+      catp->free = free->next;
+      free->next = res;
+      res = free;
+      n -= count;
+    } else {
+      Block* p = byte_advance(free, (count - n) * size);
+      free->count = count - n;
+      p->next = res;
+      p->count = n;
+      res = p;
+      n = 0;
+    }
+  }
+  if (catp->count_free < catp->low_water) catp->low_water = catp->count_free;
+  return res;
+}
+
+// Like scavenge of small caches.  Fresh blocks are kept.
+void scavenge(MediumCache* cache, uint64_t now) noexcept {
+  cache->scavenged_ms = now;
+  for (unsigned cat = 0; cat < kNumMediumCategories; ++cat) {
+    ThreadCategory* catp = &cache->category[cat];
+    size_t size = medium_category_to_size(cat);
+    unsigned idle = catp->low_water;
+    if (idle && catp->limit) {
+      unsigned limit = std::max(catp->limit / 2,
+                                medium_cache_blocks(kMinMediumCacheBytes, cat));
+      unreserve_cache_bytes((catp->limit - limit) * size);
+      catp->limit = limit;
+      unsigned n = std::max(idle - idle / 2,
+                            catp->count_free - std::min(catp->count_free,
+                                                        limit));
+      cache->stats[cat].freed += n;
+      free_medium_list(detach_blocks(catp, size, n), &cache->stats[cat]);
+    }
+    catp->low_water = catp->count_free;
+  }
+}
+
+void scavenge_if_due(MediumCache* cache) noexcept {
+  uint64_t now = now_ms();
+  if (now - cache->scavenged_ms >= decay_interval_ms()) scavenge(cache, now);
+}
+
+// Use fallback_cache when thread_cache is unusable
+constinit MediumCache fallback_cache{};
+constinit LowLevelMutex fallback_cache_lock{};
+
+// Takes a chunk, and returns its first block.  The rest become fresh.
+void* alloc_medium_chunk(MediumCache* cache, unsigned cat) {
+  Chunk* chunk = chunk_allocator.allocate();
+  if (chunk == nullptr) return nullptr;
+  unsigned cap = medium_category_blocks(cat);
+  chunk->cat = cat;
+  chunk->allocated = cap;
+  cache->stats[cat].allocated += cap;
+  cache->stats[cat].chunks++;
+
+  Block* p =
+      byte_advance((Block*)chunk, medium_category_first_block_offset(cat));
+  Block* np = byte_advance(p, medium_category_to_size(cat));
+  np->next = nullptr;
+  np->count = cap - 1;
+  cache->category[cat].fresh = np;
+  return p;
+}
+
+void* alloc_medium_category_with_cache(MediumCache* cache, unsigned cat) {
+  ThreadCategory* catp = &cache->category[cat];
+  size_t size = medium_category_to_size(cat);
+  if (Block* free = catp->free) {
+    if (--catp->count_free < catp->low_water)
+      catp->low_water = catp->count_free;
+    unsigned remaining = --(free->count);
+    Block* p = byte_advance(free, remaining * size);
+    if (remaining == 0) catp->free = free->next;
+    return p;
+  }
+
+  catp->misses++;
+  if (Block* fresh = catp->fresh) {
+    unsigned remaining = --(fresh->count);
+    if (remaining == 0) catp->fresh = nullptr;
+    return byte_advance(fresh, remaining * size);
+  }
+  scavenge_if_due(cache);
+  return alloc_medium_chunk(cache, cat);
+}
+
+// Like adapt_limit of small caches
+void adapt_limit(ThreadCategory* catp, unsigned cat) {
+  size_t size = medium_category_to_size(cat);
+  if (catp->limit == 0) {
+    unsigned limit = medium_cache_blocks(kInitialMediumCacheBytes, cat);
+    if (!reserve_cache_bytes(limit * size)) {
+      limit = medium_cache_blocks(kMinMediumCacheBytes, cat);
+      charge_cache_bytes(limit * size);
+    }
+    catp->limit = limit;
+  } else if (catp->misses) {
+    unsigned limit = std::min(catp->limit * 2,
+                              medium_cache_blocks(kMaxMediumCacheBytes, cat));
+    if (limit > catp->limit &&
+        reserve_cache_bytes((limit - catp->limit) * size))
+      catp->limit = limit;
+  }
+  catp->misses = 0;
+}
+
+void free_medium_with_cache(MediumCache* cache, void* ptr, unsigned cat) {
+  Block* p = static_cast<Block*>(ptr);
+
+  if (!is_medium_category_block_offset(uintptr_t(p) % kMediumChunkSize, cat))
+    memory_corrupt();
+
+  ThreadCategory* catp = &cache->category[cat];
+  if (catp->count_free >= catp->limit) {
+    scavenge_if_due(cache);
+    if (catp->count_free >= catp->limit) adapt_limit(catp, cat);
+    if (catp->count_free >= catp->limit) {
+      // Flush down to half the limit
+      unsigned n = catp->count_free - catp->limit / 2;
+      CategoryStats* stats = &cache->stats[cat];
+      stats->freed += n;
+      free_medium_list(
+          detach_blocks(catp, medium_category_to_size(cat), n), stats);
+    }
+  }
+  p->count = 1;
+  p->next = catp->free;
+  catp->free = p;
+  catp->count_free++;
+}
+
+// Like alloc_small_batch_with_cache
+size_t alloc_medium_batch_with_cache(MediumCache* cache, unsigned cat,
+                                     size_t n, void** out) {
+  ThreadCategory* catp = &cache->category[cat];
+  size_t size = medium_category_to_size(cat);
+  size_t i = 0;
+  while (i < n && catp->free) {
+    Block* free = catp->free;
+    unsigned count = free->count;
+    unsigned take = std::min<size_t>(count, n - i);
+    unsigned remaining = count - take;
+    if (remaining == 0)
+      catp->free = free->next;
+    else
+      free->count = remaining;
+    catp->count_free -= take;
+    for (unsigned k = count; k-- > remaining;)
+      out[i++] = byte_advance(free, k * size);
+  }
+  if (catp->count_free < catp->low_water) catp->low_water = catp->count_free;
+  if (i < n) catp->misses++;
+
+  while (i < n) {
+    Block* fresh = catp->fresh;
+    if (fresh == nullptr) {
+      void* p = alloc_medium_chunk(cache, cat);
+      if (p == nullptr) break;
+      out[i++] = p;
+      continue;
+    }
+    unsigned count = fresh->count;
+    unsigned take = std::min<size_t>(count, n - i);
+    unsigned remaining = count - take;
+    if (remaining == 0)
+      catp->fresh = nullptr;
+    else
+      fresh->count = remaining;
+    for (unsigned k = count; k-- > remaining;)
+      out[i++] = byte_advance(fresh, k * size);
+  }
+  return i;
+}
+
+void free_medium_batch_with_cache(MediumCache* cache, void** ptrs,
+                                  size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    void* ptr = ptrs[i];
+    if (!is_medium(ptr)) continue;
+    unsigned cat = block2chunk(ptr)->cat;
+    if (cat > kMaxMediumCategory) memory_corrupt();
+    free_medium_with_cache(cache, ptr, cat);
+  }
+}
+
+void MediumCache::clear() noexcept {
+  for (unsigned cat = 0; cat < kNumMediumCategories; ++cat) {
+    ThreadCategory& catg = category[cat];
+    stats[cat].freed += std::exchange(catg.count_free, 0);
+    catg.low_water = 0;
+    free_medium_list(std::exchange(catg.free, nullptr), &stats[cat]);
+    if (Block* fresh = std::exchange(catg.fresh, nullptr)) {
+      stats[cat].freed += fresh->count;
+      free_medium_list(fresh, &stats[cat]);
+    }
+  }
+}
+
+void add_stats(Stats* stats, const MediumCache& cache) noexcept {
+  for (unsigned cat = 0; cat < kNumMediumCategories; ++cat) {
+    SizeClassStats& st = stats->medium[cat];
+    st.allocated += cache.stats[cat].allocated;
+    st.freed += cache.stats[cat].freed;
+    st.runs += cache.stats[cat].chunks;
+    st.cached += cache.category[cat].count_free;
+    if (const Block* fresh = cache.category[cat].fresh)
+      st.cached += fresh->count;
+  }
+}
+
+void* alloc_medium_category(unsigned cat) noexcept {
+  if (UniqueCache unique_cache(&medium_cache_pool); unique_cache) {
+    return alloc_medium_category_with_cache(unique_cache.get(), cat);
+  } else {
+    std::lock_guard locker(fallback_cache_lock);
+    return alloc_medium_category_with_cache(&fallback_cache, cat);
+  }
+}
+
+void free_medium_category(void* ptr, unsigned cat) noexcept {
+  if (UniqueCache unique_cache(&medium_cache_pool); unique_cache) {
+    free_medium_with_cache(unique_cache.get(), ptr, cat);
+  } else {
+    std::lock_guard locker(fallback_cache_lock);
+    free_medium_with_cache(&fallback_cache, ptr, cat);
+  }
+}
+
+}  // namespace
+
+void* alloc_medium(size_t size, bool zero) noexcept {
+  void* ptr = alloc_medium_category(size_to_medium_category(size));
+  if (ptr == nullptr) return alloc_large(size, zero);
+  if (zero) ptr = memset(ptr, 0, size);
+  return ptr;
+}
+
+void free_medium(void* ptr) noexcept {
+  unsigned cat = block2chunk(ptr)->cat;
+  if (cat > kMaxMediumCategory) memory_corrupt();
+  free_medium_category(ptr, cat);
+}
+
+void free_medium(void* ptr, size_t size) noexcept {
+  // Like free_small, don't load the chunk header
+  if (size <= kSmallAllocLimit || size > kMediumAllocLimit) memory_corrupt();
+  unsigned cat = size_to_medium_category(size);
+#ifdef CBU_ALLOC_CHECK_SIZED_FREE
+  if (block2chunk(ptr)->cat != cat) memory_corrupt();
+#endif
+  free_medium_category(ptr, cat);
+}
+
+size_t alloc_medium_batch(size_t size, size_t n, void** out) noexcept {
+  unsigned cat = size_to_medium_category(size);
+  if (UniqueCache unique_cache(&medium_cache_pool); unique_cache) {
+    return alloc_medium_batch_with_cache(unique_cache.get(), cat, n, out);
+  } else {
+    std::lock_guard locker(fallback_cache_lock);
+    return alloc_medium_batch_with_cache(&fallback_cache, cat, n, out);
+  }
+}
+
+void free_medium_batch(void** ptrs, size_t n) noexcept {
+  if (UniqueCache unique_cache(&medium_cache_pool); unique_cache) {
+    free_medium_batch_with_cache(unique_cache.get(), ptrs, n);
+  } else {
+    std::lock_guard locker(fallback_cache_lock);
+    free_medium_batch_with_cache(&fallback_cache, ptrs, n);
+  }
+}
+
+size_t medium_allocated_size(void* ptr) noexcept {
+  return medium_category_to_size(block2chunk(ptr)->cat);
+}
+
+void medium_trim(size_t) noexcept {
+  UniqueCache<MediumCache>::visit_all(
+      &medium_cache_pool, [](MediumCache* cache) noexcept { cache->clear(); });
+  {
+    std::lock_guard locker(fallback_cache_lock);
+    fallback_cache.clear();
+  }
+}
+
+void medium_scavenge(uint64_t now) noexcept {
+  UniqueCache<MediumCache>::visit_all(
+      &medium_cache_pool,
+      [now](MediumCache* cache) noexcept { scavenge(cache, now); });
+  {
+    std::lock_guard locker(fallback_cache_lock);
+    scavenge(&fallback_cache, now);
+  }
+}
+
+void medium_fork(ForkStage stage) noexcept {
+  medium_cache_pool.fork(stage);
+  fork_lock(&fallback_cache_lock, stage);
+  chunk_allocator.fork(stage);
+}
+
+void medium_stats(Stats* stats) noexcept {
+  static_assert(kNumMediumCategories == kStatsMediumClasses);
+  for (unsigned cat = 0; cat < kNumMediumCategories; ++cat)
+    stats->medium[cat].size = medium_category_to_size(cat);
+  UniqueCache<MediumCache>::visit_all(
+      &medium_cache_pool,
+      [stats](MediumCache* cache) noexcept { add_stats(stats, *cache); });
+  {
+    std::lock_guard locker(fallback_cache_lock);
+    add_stats(stats, fallback_cache);
+  }
+  auto [mapped, free] = chunk_allocator.stats();
+  stats->medium_mapped = mapped;
+  stats->medium_free = free;
+}
+
+}  // namespace alloc
+}  // namespace cbu
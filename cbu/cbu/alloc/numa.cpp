@@ -0,0 +1,97 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2021, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cbu/alloc/numa.h"
+
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+
+#include <algorithm>
+
+#include "cbu/alloc/alloc.h"
+#include "cbu/fsyscall/fsyscall.h"
+
+namespace cbu {
+namespace alloc {
+namespace {
+
+constinit std::atomic<bool> numa_disabled{false};
+
+// Don't use libnuma or stdio, which may allocate memory
+uint32_t detect_numa_nodes() noexcept {
+  int fd = fsys_open2("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 1;
+  char buf[256];
+  long n = fsys_read(fd, buf, sizeof(buf));
+  fsys_close(fd);
+
+  // Like "0-3" or "0,2"; we just need the greatest number
+  uint32_t max_node = 0;
+  uint32_t cur = 0;
+  for (long i = 0; i < n; ++i) {
+    if (buf[i] >= '0' && buf[i] <= '9') {
+      cur = cur * 10 + (buf[i] - '0');
+      max_node = std::max(max_node, cur);
+    } else {
+      cur = 0;
+    }
+  }
+  return std::min(max_node + 1, kMaxNumaNodes);
+}
+
+}  // namespace
+
+uint32_t numa_init() noexcept {
+  uint32_t n =
+      numa_disabled.load(std::memory_order_relaxed) ? 1 : detect_numa_nodes();
+  g_numa_nodes.store(n, std::memory_order_relaxed);
+  return n;
+}
+
+uint32_t thread_numa_node_init() noexcept {
+  unsigned cpu;
+  unsigned node = 0;
+  if (fsys_getcpu(&cpu, &node, nullptr) != 0) node = 0;
+  node %= numa_nodes();
+  g_thread_numa_node = node;
+  return node;
+}
+
+void numa_bind(void* ptr, size_t size, uint32_t node) noexcept {
+  unsigned long mask = 1ul << node;
+  fsys_mbind(ptr, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+}
+
+void set_numa_aware(bool enable) noexcept {
+  numa_disabled.store(!enable, std::memory_order_relaxed);
+  numa_init();
+  g_thread_numa_node = kNoNumaNode;
+}
+
+}  // namespace alloc
+}  // namespace cbu
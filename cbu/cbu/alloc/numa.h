@@ -0,0 +1,74 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2021, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+namespace cbu {
+namespace alloc {
+
+// NUMA awareness
+// Arenas are partitioned among nodes, and the memory of each arena is
+// preferably placed on its node (MPOL_PREFERRED).  Threads use arenas and
+// mutex-based cache slots of their own nodes.  (Per-CPU caches are local
+// by nature.)
+// Nodes with greater numbers share arenas with lower ones.
+constexpr uint32_t kMaxNumaNodes = 16;
+
+// Number of nodes; 0 if not yet known.  1 if the system is not NUMA, or
+// NUMA awareness is disabled.
+inline constinit std::atomic<uint32_t> g_numa_nodes{0};
+constexpr uint32_t kNoNumaNode = uint32_t(-1);
+inline thread_local uint32_t g_thread_numa_node = kNoNumaNode;
+
+uint32_t numa_init() noexcept;
+uint32_t thread_numa_node_init() noexcept;
+
+inline uint32_t numa_nodes() noexcept {
+  uint32_t n = g_numa_nodes.load(std::memory_order_relaxed);
+  if (__builtin_expect(n == 0, 0)) n = numa_init();
+  return n;
+}
+
+// Node of the thread when it first asks, folded to [0, numa_nodes()).
+// It's not refreshed, which would cost a syscall or an rseq read per call.
+inline uint32_t thread_numa_node() noexcept {
+  uint32_t node = g_thread_numa_node;
+  if (__builtin_expect(node == kNoNumaNode, 0)) node = thread_numa_node_init();
+  return node;
+}
+
+// Prefers placing pages on the node.  Only pages not yet populated move.
+void numa_bind(void* ptr, size_t size, uint32_t node) noexcept;
+
+}  // namespace alloc
+}  // namespace cbu
@@ -28,16 +28,24 @@
 
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <bit>
 #include <compare>
 #include <mutex>
 #include <optional>
+#include <utility>
 
 #include "cbu/alloc/alloc.h"
+#include "cbu/alloc/numa.h"
 #include "cbu/alloc/private.h"
 #include "cbu/alloc/rb.h"
 #include "cbu/alloc/tc.h"
@@ -45,6 +53,7 @@
 #include "cbu/common/byte_size.h"
 #include "cbu/common/hint.h"
 #include "cbu/fsyscall/fsyscall.h"
+#include "cbu/tweak/tweak.h"
 
 namespace cbu {
 namespace alloc {
@@ -159,6 +168,10 @@ class PageTreeAllocator {
   PageTreeAllocator& operator=(const PageTreeAllocator&) = delete;
 
   Page* allocate(size_t size) noexcept;
+  // Like allocate, but picks, among a few ranges that fit, the one whose
+  // start address has the highest score
+  template <typename Score>
+  Page* allocate_best(size_t size, Score score) noexcept;
   bool reclaim(Page* page, size_t size, uint32_t option_bitmask) noexcept;
   bool reclaim_nomerge(Page* page, size_t size) noexcept;
   bool extend_nomove(Page* ptr, size_t old, size_t grow) noexcept;
@@ -168,6 +181,16 @@ class PageTreeAllocator {
   Description* get_deallocate_candidates(size_t threshold,
                                          bool thp_aware) noexcept;
 
+  // Likewise, but removes ranges (larger ones first) until at least the
+  // given bytes are removed or the tree is empty.
+  Description* extract(size_t bytes) noexcept;
+  // Likewise, but only removes whole aligned blocks, leaving the unaligned
+  // parts of ranges in the tree.
+  Description* extract_aligned(size_t bytes, size_t align) noexcept;
+
+  // Total bytes in the tree
+  size_t bytes() const noexcept { return bytes_; }
+
   // Just remove the page from the tree
   void remove_by_range(Page* page, size_t size) noexcept;
   // Likewise, but calls a callback on the removed subrange
@@ -180,6 +203,11 @@ class PageTreeAllocator {
  private:
   Description* remove_from_szad(Description* desc) noexcept;
   Description* insert_to_szad(Description* desc) noexcept;
+  // Takes size bytes from the start of desc, which has been removed from szad
+  Page* take(Description* desc, size_t size) noexcept;
+  // Removes the aligned part of desc (in szad_large_) from the tree, and
+  // returns it; or returns nullptr if desc has no aligned block.
+  Description* remove_aligned(Description* desc, size_t align) noexcept;
 
   static constexpr size_t small_size_to_idx(size_t size) noexcept {
     // This is written in a way that helps x86-64 generate best code
@@ -196,6 +224,8 @@ class PageTreeAllocator {
   static constexpr size_t kSmallMaxSize = kSmallCount * kPageSize;
   Rb<DescriptionAdRbAccessor<2>> szad_small_[kSmallCount];
   Rb<DescriptionSzAdRbAccessor> szad_large_;
+
+  size_t bytes_ = 0;
 };
 
 Description* PageTreeAllocator::remove_from_szad(Description* desc) noexcept {
@@ -212,50 +242,62 @@ Description* PageTreeAllocator::insert_to_szad(Description* desc) noexcept {
     return szad_large_.insert(desc);
 }
 
+Page* PageTreeAllocator::take(Description* desc, size_t size) noexcept {
+  assert(desc->size >= size);
+  Page* ret = desc->addr;
+  if (desc->size == size) {
+    // Perfect size.
+    desc = ad_.remove(desc);
+    free_description(desc);
+  } else {
+    // We always prefer smaller addresses
+    desc->addr = byte_advance(ret, size);
+    desc->size -= size;
+    insert_to_szad(desc);
+  }
+  bytes_ -= size;
+  return ret;
+}
+
 Page* PageTreeAllocator::allocate(size_t size) noexcept {
   if (size <= kSmallMaxSize) {
-    size_t k = small_size_to_idx(size);
-    if (Description* desc = szad_small_[k].first()) {
-      desc = szad_small_[k].remove(desc);
-      desc = ad_.remove(desc);
-      Page* ret = desc->addr;
-      free_description(desc);
-      return ret;
+    for (size_t k = small_size_to_idx(size); k < kSmallCount; ++k) {
+      if (Description* desc = szad_small_[k].first())
+        return take(szad_small_[k].remove(desc), size);
     }
+  }
 
-    while (++k < kSmallCount) {
-      if (Description* desc = szad_small_[k].first()) {
-        desc = szad_small_[k].remove(desc);
-        Page* ret = desc->addr;
-        desc->addr = byte_advance(ret, size);
-        desc->size = small_idx_to_size(k) - size;
-        szad_small_[small_size_to_idx(desc->size)].insert(desc);
-        return ret;
+  Description* desc = szad_large_.nsearch(size);
+  if (desc == nullptr) return nullptr;
+  return take(szad_large_.remove(desc), size);
+}
+
+template <typename Score>
+Page* PageTreeAllocator::allocate_best(size_t size, Score score) noexcept {
+  constexpr unsigned kCandidates = 8;
+
+  auto pick = [&](auto& tree, Description* desc) noexcept {
+    Description* best = desc;
+    auto best_score = score(desc->addr);
+    for (unsigned i = 1; i < kCandidates && (desc = tree.next(desc)); ++i) {
+      if (auto s = score(desc->addr); s > best_score) {
+        best = desc;
+        best_score = s;
       }
     }
-  }
+    return take(tree.remove(best), size);
+  };
 
-  Description* desc = szad_large_.nsearch(size);
-  if (desc) {
-    assert(desc->size >= size);
-    Page* ret;
-    desc = szad_large_.remove(desc);
-    if (desc->size == size) {
-      // Perfect size.
-      desc = ad_.remove(desc);
-      ret = desc->addr;
-      free_description(desc);
-    } else {
-      // We always prefer smaller addresses
-      ret = desc->addr;
-      desc->addr = byte_advance(desc->addr, size);
-      desc->size -= size;
-      insert_to_szad(desc);
+  if (size <= kSmallMaxSize) {
+    for (size_t k = small_size_to_idx(size); k < kSmallCount; ++k) {
+      if (Description* desc = szad_small_[k].first())
+        return pick(szad_small_[k], desc);
     }
-    return ret;
-  } else {
-    return nullptr;
   }
+
+  Description* desc = szad_large_.nsearch(size);
+  if (desc == nullptr) return nullptr;
+  return pick(szad_large_, desc);
 }
 
 bool PageTreeAllocator::reclaim(Page* page, size_t size,
@@ -265,6 +307,7 @@ bool PageTreeAllocator::reclaim(Page* page, size_t size,
   assert(size % kPageSize == 0);
 
   Description* desc;
+  size_t added = size;
 
   // Can we merge right?
   Description* succ = (option_bitmask & RECLAIM_PAGE_NOMERGE_RIGHT)
@@ -302,6 +345,7 @@ bool PageTreeAllocator::reclaim(Page* page, size_t size,
   }
 
   insert_to_szad(desc);
+  bytes_ += added;
   return true;
 }
 
@@ -316,6 +360,7 @@ bool PageTreeAllocator::reclaim_nomerge(Page* page, size_t size) noexcept {
   desc->size = size;
   desc = ad_.insert(desc);
   insert_to_szad(desc);
+  bytes_ += size;
   return true;
 }
 
@@ -333,6 +378,7 @@ bool PageTreeAllocator::extend_nomove(Page* ptr, size_t old,
   Description* succ = ad_.search(target);
   if (succ && (succ->size >= grow)) {
     // Yes
+    bytes_ -= grow;
     succ = remove_from_szad(succ);
     if (succ->size == grow) {
       // Perfect size.
@@ -357,35 +403,16 @@ Description* PageTreeAllocator::get_deallocate_candidates(
 
   Description* p = szad_large_.last();
 
+  // If we assume the kernel has support for transparent huge pages, only
+  // whole hugepages are released, so that those partly in use stay intact
+  size_t align = (kTHPSize && thp_aware) ? kTHPSize : kPageSize;
+
   while (p && (p->size >= threshold)) {
     Description* q = szad_large_.prev(p);
-
-    p = szad_large_.remove(p);
-    p = ad_.remove(p);
-
-    if (kTHPSize && thp_aware && kTHPSize * 2 < threshold) {
-      // If we assume the kernel has support for transparent huge pages,
-      // it's best if we always do allocations on hugepage boundaries
-
-      // Split from right
-      Page* end = byte_advance(p->addr, p->size);
-      if (size_t offset = uintptr_t(end) % kTHPSize) {
-        p->size -= offset;
-        reclaim_nomerge(byte_back(end, offset), offset);
-      }
-
-      // Split from left
-      if (size_t adjust = (-uintptr_t(p->addr)) % kTHPSize) {
-        Page* addr = p->addr;
-        p->addr = byte_advance(p->addr, adjust);
-        p->size -= adjust;
-        reclaim_nomerge(addr, adjust);
-      }
+    if (Description* r = remove_aligned(p, align)) {
+      r->rblink_1.left(list);
+      list = r;
     }
-
-    p->rblink_1.left(list);
-    list = p;
-
     p = q;
   }
 
@@ -395,6 +422,7 @@ Description* PageTreeAllocator::get_deallocate_candidates(
     while (Description* p = tree.first()) {
       p = tree.remove(p);
       p = ad_.remove(p);
+      bytes_ -= p->size;
       p->rblink_1.left(list);
       list = p;
     }
@@ -403,13 +431,90 @@ Description* PageTreeAllocator::get_deallocate_candidates(
   return list;
 }
 
+Description* PageTreeAllocator::extract(size_t bytes) noexcept {
+  Description* list = nullptr;
+  size_t extracted = 0;
+
+  auto take = [&](Description* p) noexcept {
+    p = ad_.remove(p);
+    extracted += p->size;
+    p->rblink_1.left(list);
+    list = p;
+  };
+
+  while (extracted < bytes) {
+    Description* p = szad_large_.last();
+    if (p == nullptr) break;
+    take(szad_large_.remove(p));
+  }
+
+  for (size_t k = kSmallCount; k-- > 0 && extracted < bytes;) {
+    auto& tree = szad_small_[k];
+    while (extracted < bytes) {
+      Description* p = tree.first();
+      if (p == nullptr) break;
+      take(tree.remove(p));
+    }
+  }
+
+  bytes_ -= extracted;
+  return list;
+}
+
+Description* PageTreeAllocator::extract_aligned(size_t bytes,
+                                                size_t align) noexcept {
+  Description* list = nullptr;
+  size_t extracted = 0;
+
+  // Edges put back by remove_aligned are smaller than align, so they're
+  // never visited again
+  Description* p = szad_large_.last();
+  while (p && p->size >= align && extracted < bytes) {
+    Description* q = szad_large_.prev(p);
+    if (Description* r = remove_aligned(p, align)) {
+      extracted += r->size;
+      r->rblink_1.left(list);
+      list = r;
+    }
+    p = q;
+  }
+  return list;
+}
+
+Description* PageTreeAllocator::remove_aligned(Description* p,
+                                               size_t align) noexcept {
+  Page* lo = pow2_ceil(p->addr, align);
+  Page* hi = pow2_floor(byte_advance(p->addr, p->size), align);
+  if (lo >= hi) return nullptr;
+
+  p = szad_large_.remove(p);
+  p = ad_.remove(p);
+  bytes_ -= p->size;
+
+  // Split from right
+  Page* end = byte_advance(p->addr, p->size);
+  if (hi != end) reclaim_nomerge(hi, byte_distance(hi, end));
+
+  // Split from left
+  if (lo != p->addr) reclaim_nomerge(p->addr, byte_distance(p->addr, lo));
+
+  p->addr = lo;
+  p->size = byte_distance(lo, hi);
+  return p;
+}
+
 void PageTreeAllocator::remove_by_range(Page* page, size_t size) noexcept {
   remove_by_range(page, size, [](void*, size_t) noexcept {});
 }
 
 template <typename Callback>
 void PageTreeAllocator::remove_by_range(Page* page, size_t size,
-                                        Callback callback) noexcept {
+                                        Callback user_callback) noexcept {
+  auto callback = [&](Page* subrange, size_t subsize) noexcept {
+    bytes_ -= subsize;
+    user_callback(subrange, subsize);
+  };
+
   Page* end = byte_advance(page, size);
 
   Description* p = ad_.psearch(page);
@@ -490,6 +595,36 @@ void PageTreeAllocator::remove_by_list(const Description* list) noexcept {
   }
 }
 
+#if defined __x86_64__ && defined __LP64__
+constexpr size_t kPointerValidBits = 47;
+#else
+constexpr size_t kPointerValidBits = sizeof(void*) * 8;
+#endif
+
+// Hugepage filler: arenas that allow THP count the pages in use in each
+// hugepage, prefer allocating from dense hugepages, and only return
+// completely free hugepages to the kernel, so that dense hugepages stay
+// backed by THP.
+constexpr unsigned kHugePageBits =
+    kTHPSize ? std::countr_zero(kTHPSize) : kPageSizeBits;
+constexpr uint32_t kPagesPerHugePage = (1u << kHugePageBits) / kPageSize;
+
+// Pages in use in each hugepage
+Trie<kPointerValidBits - kHugePageBits, uint32_t> hugepage_used_trie;
+
+uint32_t* lookup_hugepage(const Page* page) {
+  return hugepage_used_trie.lookup(uintptr_t(page) >> kHugePageBits);
+}
+
+uint32_t hugepage_used_pages(const Page* page) noexcept {
+  uint32_t* used = lookup_hugepage(page);
+  if (false_no_fail(used == nullptr)) return 0;
+  return std::atomic_ref(*used).load(std::memory_order_relaxed);
+}
+
+// Dirty pages decay in kDecaySteps epochs
+constexpr unsigned kDecaySteps = 10;
+
 class alignas(kCacheLineSize) Arena {
  public:
   constexpr Arena(RawPageAllocator* allocator) noexcept
@@ -508,6 +643,8 @@ class alignas(kCacheLineSize) Arena {
   void reclaim_list(Page* page, size_t size) noexcept;
 
   bool extend_nomove(Page*, size_t oldsize, size_t growsize) noexcept;
+  // Pages have been moved out of the arena with mremap
+  void detach(Page*, size_t size) noexcept;
   void do_munmap(Page*, size_t) noexcept;
 
   // Returns a linked list (linked with rblink_1.left)
@@ -519,6 +656,20 @@ class alignas(kCacheLineSize) Arena {
 
   void munmap_description_list(Description*) noexcept;
 
+  // Advances the decay clock, and returns dirty ranges that have decayed
+  // (linked with rblink_1.left).  added is the bytes just reclaimed.
+  Description* decay_extract_unlocked(uint64_t now, size_t added) noexcept;
+  Description* decay_extract(uint64_t now) noexcept;
+
+  // Returns the ranges to the kernel, and puts them in tree_clean_
+  void purge_description_list(Description*) noexcept;
+
+  bool allow_thp() const noexcept { return raw_page_allocator_->allow_thp(); }
+  bool hugepage_aware() const noexcept { return kTHPSize && allow_thp(); }
+
+  void get_stats(ArenaStats*) noexcept;
+  void fork(ForkStage stage) noexcept { fork_lock(&lock_, stage); }
+
   friend struct PageCategoryCache;
 
  private:
@@ -527,23 +678,109 @@ class alignas(kCacheLineSize) Arena {
 
   // Count it so that we can determine when to try to do munmap
   size_t reclaim_count_ = 0;
-  size_t total_bytes_allocated_ = 0;
+  // Pages may be allocated from one arena and reclaimed to another, so this
+  // may be negative.
+  ptrdiff_t total_bytes_allocated_ = 0;
+
+  size_t bytes_allocated() const noexcept {
+    return std::max<ptrdiff_t>(total_bytes_allocated_, 0);
+  }
+
+  // Hugepages with pages in use, and those completely in use.  Likewise,
+  // these may be negative.
+  ptrdiff_t hugepages_ = 0;
+  ptrdiff_t hugepages_full_ = 0;
+
+  // Pages are handed out (positive size) or returned (negative size)
+  void account(Page* page, ptrdiff_t size) noexcept;
 
   // tree_clean holds pages that we know are zero initialized
   PageTreeAllocator tree_clean_{};
   PageTreeAllocator tree_dirty_{};
   PageTreeAllocator tree_all_{};
 
+  // Bytes reclaimed in each of the last kDecaySteps epochs.  Those reclaimed
+  // k epochs ago may stay dirty only up to (kDecaySteps - k) / kDecaySteps.
+  uint64_t decay_epoch_ = 0;
+  size_t decay_reclaimed_[kDecaySteps] = {};
+
   static constexpr size_t kInitialAllocSize =
       kTHPSize ? kTHPSize : kPageSize * 512;
   static constexpr size_t kMaxAllocSize = 128 * 1024 * 1024;
   static_assert((kInitialAllocSize & (kInitialAllocSize - 1)) == 0);
 };
 
-// No additional tag types are given to RawPageAllocator::instance, meaning the
-// "default" allocator.
-constinit Arena arena_default{&RawPageAllocator::instance<true>};
-constinit Arena arena_no_thp{&RawPageAllocator::instance<false>};
+// Threads are spread over up to kMaxArenas arenas to reduce lock contention.
+// arenas[0, kMaxArenas) allow THP; the others don't.
+// On NUMA systems, arenas[i] and arenas[kMaxArenas + i] serve node
+// i % numa_nodes().
+constexpr unsigned kMaxArenas = 16;
+static_assert(kMaxNumaNodes <= kMaxArenas);
+
+template <size_t... I>
+constexpr std::array<Arena, sizeof...(I)> make_arenas(
+    std::index_sequence<I...>) noexcept {
+  // No additional tag types are given to RawPageAllocator::instance, meaning
+  // the "default" allocator.
+  return {Arena(I < kMaxArenas ? &RawPageAllocator::instance<true>
+                               : &RawPageAllocator::instance<false>)...};
+}
+
+// Negative value disables decay
+constinit std::atomic<int> decay_time_ms{10000};
+
+// Whether the background decay thread has been started.  The thread doesn't
+// exist in the child of fork, so the child clears this and may start it again.
+constinit std::atomic<bool> background_decay_started{false};
+
+constinit std::array<Arena, kMaxArenas * 2> arenas =
+    make_arenas(std::make_index_sequence<kMaxArenas * 2>());
+
+thread_local unsigned g_thread_arena_idx = kMaxArenas;
+constinit std::atomic<unsigned> next_arena_idx{0};
+constinit std::atomic<unsigned> num_arenas{0};
+
+unsigned get_num_arenas() noexcept {
+  unsigned n = num_arenas.load(std::memory_order_relaxed);
+  if (n == 0) {
+    // Don't use sysconf, which may call malloc
+    cpu_set_t set;
+    n = 1;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+      n = std::clamp<unsigned>(CPU_COUNT(&set), 1, kMaxArenas);
+    num_arenas.store(n, std::memory_order_relaxed);
+  }
+  return n;
+}
+
+unsigned assign_thread_arena() noexcept {
+  unsigned n = get_num_arenas();
+  unsigned seq = next_arena_idx.fetch_add(1, std::memory_order_relaxed);
+  unsigned idx;
+  if (uint32_t nodes = numa_nodes(); nodes > 1) {
+    // Each node gets at least one arena
+    n = std::max(n, nodes);
+    uint32_t node = thread_numa_node() % nodes;
+    idx = node + seq % ((n - node + nodes - 1) / nodes) * nodes;
+  } else {
+    idx = seq % n;
+  }
+  g_thread_arena_idx = idx;
+  return idx;
+}
+
+Arena* thread_arena(bool use_no_thp) noexcept {
+  unsigned idx = 0;
+  if (!cbu::tweak::SINGLE_THREADED) {
+    idx = g_thread_arena_idx;
+    if (idx >= kMaxArenas) idx = assign_thread_arena();
+  }
+  return &arenas[use_no_thp ? kMaxArenas + idx : idx];
+}
+
+inline unsigned arena_id(const Arena* arena) noexcept {
+  return arena - arenas.data();
+}
 
 Page* Arena::allocate(size_t size, bool zero) noexcept {
   assert(size != 0);
@@ -552,7 +789,10 @@ Page* Arena::allocate(size_t size, bool zero) noexcept {
   std::lock_guard locker(lock_);
 
   // First try allocating from one of tree_clean_ and tree_dirty_,
-  Page* page = (zero ? tree_clean_ : tree_dirty_).allocate(size);
+  PageTreeAllocator& tree = zero ? tree_clean_ : tree_dirty_;
+  Page* page = (hugepage_aware() && size < kTHPSize)
+                   ? tree.allocate_best(size, hugepage_used_pages)
+                   : tree.allocate(size);
 
   if (page) {
     // Remove pages from tree_all as well
@@ -576,18 +816,43 @@ Page* Arena::allocate(size_t size, bool zero) noexcept {
 
   if (!page) {
     size_t alloc_size = cbu::pow2_ceil(
-        std::max(std::min(total_bytes_allocated_, kMaxAllocSize), size),
+        std::max(std::min(bytes_allocated(), kMaxAllocSize), size),
         kInitialAllocSize);
     page = raw_page_allocator_->allocate(alloc_size);
     if (page == nullptr) return nomem();
+    if (uint32_t nodes = numa_nodes(); nodes > 1)
+      numa_bind(page, alloc_size, arena_id(this) % kMaxArenas % nodes);
     if (size < alloc_size)
       reclaim_unlocked(byte_advance(page, size), alloc_size - size,
                        RECLAIM_PAGE_NOMERGE_LEFT | RECLAIM_PAGE_CLEAN);
   }
-  total_bytes_allocated_ += size;
+  account(page, size);
   return page;
 }
 
+void Arena::account(Page* page, ptrdiff_t size) noexcept {
+  total_bytes_allocated_ += size;
+  if (!hugepage_aware()) return;
+
+  uintptr_t addr = uintptr_t(page);
+  uintptr_t end = addr + (size < 0 ? -size : size);
+  while (addr < end) {
+    uintptr_t next = std::min(pow2_floor(addr, kTHPSize) + kTHPSize, end);
+    uint32_t pages = (next - addr) / kPageSize;
+    uint32_t* used = lookup_hugepage(reinterpret_cast<Page*>(addr));
+    addr = next;
+    if (false_no_fail(used == nullptr)) continue;
+
+    std::atomic_ref ref(*used);
+    uint32_t old = (size < 0) ? ref.fetch_sub(pages, std::memory_order_relaxed)
+                              : ref.fetch_add(pages, std::memory_order_relaxed);
+    uint32_t now = (size < 0) ? old - pages : old + pages;
+    hugepages_ += (now != 0) - (old != 0);
+    hugepages_full_ +=
+        (now == kPagesPerHugePage) - (old == kPagesPerHugePage);
+  }
+}
+
 void Arena::reclaim_unlocked(Page* page, size_t size,
                              uint32_t option_bitmask) noexcept {
   // Don't modify total_bytes_allocated_ here -- this function is also
@@ -608,19 +873,27 @@ void Arena::reclaim_unlocked(Page* page, size_t size,
 }
 
 void Arena::reclaim(Page* page, size_t size, uint32_t option_bitmask) noexcept {
+  uint64_t now = now_ms();
   Description* clean;
+  Description* decayed;
   {
     std::lock_guard locker(lock_);
-    total_bytes_allocated_ -= size;
+    account(page, -ptrdiff_t(size));
     reclaim_unlocked(page, size, option_bitmask);
     // Check for whether we can do some clean up work.
     clean = trim_and_extract_unlocked();
+    decayed = decay_extract_unlocked(
+        now, (option_bitmask & RECLAIM_PAGE_CLEAN) ? 0 : size);
   }
   munmap_description_list(clean);
+  purge_description_list(decayed);
 }
 
 void Arena::reclaim_list(Page* page, size_t size) noexcept {
+  uint64_t now = now_ms();
+  size_t reclaimed = 0;
   Description* clean;
+  Description* decayed;
   {
     std::lock_guard locker(lock_);
     while (page) {
@@ -635,17 +908,38 @@ void Arena::reclaim_list(Page* page, size_t size) noexcept {
         next = next->next;
       }
 
-      total_bytes_allocated_ -= this_size;
+      account(page, -ptrdiff_t(this_size));
+      reclaimed += this_size;
       reclaim_unlocked(page, this_size);
       page = next;
     }
     clean = trim_and_extract_unlocked();
+    decayed = decay_extract_unlocked(now, reclaimed);
   }
   munmap_description_list(clean);
+  purge_description_list(decayed);
 }
 
 void Arena::do_munmap(Page* ptr, size_t size) noexcept {
   fsys_munmap(ptr, size);
+  raw_page_allocator_->unmapped(size);
+}
+
+void Arena::detach(Page* page, size_t size) noexcept {
+  {
+    std::lock_guard locker(lock_);
+    account(page, -ptrdiff_t(size));
+  }
+  raw_page_allocator_->unmapped(size);
+}
+
+void Arena::get_stats(ArenaStats* stats) noexcept {
+  std::lock_guard locker(lock_);
+  stats->allocated = total_bytes_allocated_;
+  stats->dirty = tree_dirty_.bytes();
+  stats->clean = tree_clean_.bytes();
+  stats->hugepages = hugepages_;
+  stats->hugepages_full = hugepages_full_;
 }
 
 bool Arena::extend_nomove(Page* ptr, size_t old, size_t grow) noexcept {
@@ -655,6 +949,7 @@ bool Arena::extend_nomove(Page* ptr, size_t old, size_t grow) noexcept {
                !tree_dirty_.extend_nomove(ptr, old, grow))
     return false;
   tree_all_.remove_by_range(byte_advance(ptr, old), grow);
+  account(byte_advance(ptr, old), grow);
   return true;
 }
 
@@ -662,14 +957,14 @@ Description* Arena::trim_and_extract_unlocked(
     std::optional<size_t> threshold_opt) noexcept {
   size_t threshold = threshold_opt
                          ? *threshold_opt
-                         : std::max(total_bytes_allocated_, kInitialAllocSize);
+                         : std::max(bytes_allocated(), kInitialAllocSize);
 
   if (reclaim_count_ < threshold * 2) return nullptr;
   reclaim_count_ = 0;
   // We only check tree_dirty.  This is probably OK.
   // Pages in tree_clean_ are most likely not populated by kernel yet.
-  Description* list = tree_dirty_.get_deallocate_candidates(
-      threshold, kTHPSize && raw_page_allocator_->allow_thp());
+  Description* list =
+      tree_dirty_.get_deallocate_candidates(threshold, hugepage_aware());
   tree_all_.remove_by_list(list);
   return list;
 }
@@ -688,40 +983,122 @@ void Arena::munmap_description_list(Description* clean) noexcept {
   }
 }
 
-#if defined __x86_64__ && defined __LP64__
-constexpr size_t kPointerValidBits = 47;
-#else
-constexpr size_t kPointerValidBits = sizeof(void*) * 8;
-#endif
+Description* Arena::decay_extract_unlocked(uint64_t now,
+                                           size_t added) noexcept {
+  int decay_ms = decay_time_ms.load(std::memory_order_relaxed);
+  if (decay_ms < 0) return nullptr;
+
+  uint64_t epoch = now / std::max(unsigned(decay_ms) / kDecaySteps, 1u);
+  bool advanced = (epoch != decay_epoch_);
+  if (advanced) {
+    uint64_t passed = std::min<uint64_t>(epoch - decay_epoch_, kDecaySteps);
+    for (uint64_t i = 0; i < passed; ++i)
+      decay_reclaimed_[(epoch - i) % kDecaySteps] = 0;
+    decay_epoch_ = epoch;
+  }
+  decay_reclaimed_[epoch % kDecaySteps] += added;
+  // Nothing has decayed since we last checked
+  if (!advanced && decay_ms != 0) return nullptr;
+
+  size_t limit = 0;
+  if (decay_ms != 0) {
+    for (unsigned age = 0; age < kDecaySteps; ++age)
+      limit += decay_reclaimed_[(epoch - age) % kDecaySteps] / kDecaySteps *
+               (kDecaySteps - age);
+  }
+
+  size_t dirty = tree_dirty_.bytes();
+  if (dirty <= limit) return nullptr;
+  Description* list = hugepage_aware()
+                          ? tree_dirty_.extract_aligned(dirty - limit, kTHPSize)
+                          : tree_dirty_.extract(dirty - limit);
+  tree_all_.remove_by_list(list);
+  return list;
+}
+
+Description* Arena::decay_extract(uint64_t now) noexcept {
+  std::lock_guard locker(lock_);
+  return decay_extract_unlocked(now, 0);
+}
+
+void Arena::purge_description_list(Description* list) noexcept {
+  if (list == nullptr) return;
+  for (Description* p = list; p; p = p->rblink_1.left())
+    fsys_madvise(p->addr, p->size, MADV_DONTNEED);
+
+  std::lock_guard locker(lock_);
+  while (list) {
+    Description* cur = list;
+    list = cur->rblink_1.left();
+    reclaim_unlocked(cur->addr, cur->size, RECLAIM_PAGE_CLEAN);
+    free_description(cur);
+  }
+}
 
-// uint32_t is absolutely sufficient (4G * 4K is 16384 Gigabytes)
-Trie<kPointerValidBits - kPageSizeBits, uint32_t> large_block_trie;
+// Each entry holds the block size, which is a multiple of kPageSize, and the
+// ID of the owning arena in the lower bits.
+// This is a PageMap rather than a Trie, because freeing large blocks looks it
+// up every time.
+PageMap<kPointerValidBits - kPageSizeBits, size_t> large_block_map;
 
-uint32_t* lookup_large_block(const Page* page) {
-  return large_block_trie.lookup(reinterpret_cast<uintptr_t>(page) >>
-                                 kPageSizeBits);
+// Total size of blocks in their own mappings
+constinit std::atomic<size_t> large_mapped_bytes{0};
+
+constexpr size_t kLargeBlockArenaMask = kPageSize - 1;
+// Blocks in their own mappings (huge blocks, and see realloc_large) don't
+// belong to an arena
+constexpr size_t kMappedBlockId = kLargeBlockArenaMask;
+static_assert(kMaxArenas * 2 <= kMappedBlockId);
+
+// Growing a block of at least this size by realloc moves it to its own
+// mapping, so that it can be grown again with mremap instead of copying.
+constexpr size_t kMremapThreshold = 1024 * 1024;
+
+// Blocks of at least this size are directly mapped
+constexpr size_t kHugeAllocThreshold = 128 * 1024 * 1024;
+
+struct LargeBlock {
+  size_t size;
+  Arena* arena;  // nullptr if in its own mapping
+};
+
+inline size_t encode_large_block(size_t size, const Arena* arena) {
+  return size | (arena ? arena_id(arena) : kMappedBlockId);
+}
+
+inline LargeBlock decode_large_block(size_t v) {
+  size_t id = v & kLargeBlockArenaMask;
+  return {v & ~kLargeBlockArenaMask,
+          id == kMappedBlockId ? nullptr : &arenas[id]};
+}
+
+size_t* lookup_large_block(const Page* page) {
+  return large_block_map.lookup(reinterpret_cast<uintptr_t>(page) >>
+                                kPageSizeBits);
 }
 
-uint32_t* lookup_large_block_fail_crash(const Page* page) {
-  return large_block_trie.lookup_fail_crash(reinterpret_cast<uintptr_t>(page) >>
-                                            kPageSizeBits);
+size_t* lookup_large_block_fail_crash(const Page* page) {
+  return large_block_map.lookup_fail_crash(
+      reinterpret_cast<uintptr_t>(page) >> kPageSizeBits);
 }
 
-bool add_large_block_size(Page* page, size_t n) {
-  uint32_t* ptr = lookup_large_block(page);
+bool add_large_block(Page* page, size_t n, const Arena* arena) {
+  size_t* ptr = lookup_large_block(page);
   if (false_no_fail(ptr == nullptr)) return false;
-  std::atomic_ref(*ptr).store(n, std::memory_order_release);
+  std::atomic_ref(*ptr).store(encode_large_block(n, arena),
+                              std::memory_order_release);
   return true;
 }
 
-size_t lookup_large_block_size_fail_crash(Page* page) {
-  uint32_t* ptr = lookup_large_block_fail_crash(page);
-  return std::atomic_ref(*ptr).load(std::memory_order_acquire);
+LargeBlock lookup_large_block_fail_crash_decoded(Page* page) {
+  size_t* ptr = lookup_large_block_fail_crash(page);
+  return decode_large_block(
+      std::atomic_ref(*ptr).load(std::memory_order_acquire));
 }
 
 Page* allocate_page_uncached(size_t size, AllocateOptions options) {
-  return (kTHPSize && !options.allow_thp ? arena_no_thp : arena_default)
-      .allocate(size, options.zero);
+  return thread_arena(kTHPSize && !options.allow_thp)
+      ->allocate(size, options.zero);
 }
 
 struct PageCategoryCache {
@@ -761,20 +1138,24 @@ void PageCategoryCache::clear(Arena* arena) noexcept {
     page_count[i] = 0;
     while (page) {
       Page* next = page->next;
+      arena->account(page, -ptrdiff_t(page_category_to_size(i)));
       arena->reclaim_unlocked(page, page_category_to_size(i));
       page = next;
     }
   }
 }
 
-void reclaim_page(Page* page, size_t size, uint32_t option_bitmask) noexcept {
+namespace {
+
+// Pages small enough go to the thread cache, and are then reclaimed to the
+// arena of whichever thread overflows the cache; others go to arena.
+void reclaim_page_to_arena(Arena* arena, Page* page, size_t size,
+                           uint32_t option_bitmask) noexcept {
   CBU_HINT_ASSERT(page != nullptr);
   assert(size != 0);
   assert(size % kPageSize == 0);
 
-  bool use_no_thp = kTHPSize && (option_bitmask & RECLAIM_PAGE_NO_THP);
-
-  Arena* arena = use_no_thp ? &arena_no_thp : &arena_default;
+  bool use_no_thp = kTHPSize && !arena->allow_thp();
 
   if (size <= PageCategoryCache::page_category_to_size(
                   PageCategoryCache::kPageMaxCategory)) {
@@ -802,7 +1183,7 @@ void reclaim_page(Page* page, size_t size, uint32_t option_bitmask) noexcept {
           check = check->next;
         page_cache.page_list[cat] = std::exchange(check->next, nullptr);
 
-        arena->reclaim_list(page, size);
+        thread_arena(use_no_thp)->reclaim_list(page, size);
       }
       return;
     }
@@ -811,6 +1192,13 @@ void reclaim_page(Page* page, size_t size, uint32_t option_bitmask) noexcept {
   arena->reclaim(page, size, option_bitmask);
 }
 
+}  // namespace
+
+void reclaim_page(Page* page, size_t size, uint32_t option_bitmask) noexcept {
+  bool use_no_thp = kTHPSize && (option_bitmask & RECLAIM_PAGE_NO_THP);
+  reclaim_page_to_arena(thread_arena(use_no_thp), page, size, option_bitmask);
+}
+
 void reclaim_page(Page* ptr, size_t size, AllocateOptions options) noexcept {
   reclaim_page(ptr, size, options.allow_thp ? 0 : RECLAIM_PAGE_NO_THP);
 }
@@ -842,60 +1230,157 @@ Page* allocate_page(size_t size, AllocateOptions options) noexcept {
   return allocate_page_uncached(size, options);
 }
 
+namespace {
+
+// Don't let rounding up overflow
+constexpr size_t kMaxLargeAllocSize = PTRDIFF_MAX / 2;
+
+// Maps a huge block directly, aligned to kTHPSize if THP is supported
+void* alloc_huge(size_t n) noexcept {
+  constexpr size_t kAlign = kTHPSize ? kTHPSize : kPageSize;
+  size_t map_size = n + kAlign - kPageSize;
+  void* p = fsys_mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (fsys_mmap_failed(p)) return nomem();
+
+  size_t head = pow2_ceil(uintptr_t(p), kAlign) - uintptr_t(p);
+  Page* page = static_cast<Page*>(byte_advance(p, head));
+  if (head) fsys_munmap(p, head);
+  if (size_t tail = map_size - head - n)
+    fsys_munmap(byte_advance(page, n), tail);
+
+  if (!add_large_block(page, n, nullptr)) {
+    fsys_munmap(page, n);
+    return nomem();
+  }
+  large_mapped_bytes.fetch_add(n, std::memory_order_relaxed);
+  return page;
+}
+
+}  // namespace
+
 void* alloc_large(size_t n, bool zero) noexcept {
+  if (n > kMaxLargeAllocSize) return nomem();
   n = pagesize_ceil(n);
-  if constexpr (sizeof(void*) > 4) {
-    // We don't support allocating more than 4 gigabytes at one time
-    if (n != uint32_t(n)) return nomem();
-    n = uint32_t(n);
-  }
+  // Directly mapped pages are always zero
+  if (n >= kHugeAllocThreshold) return alloc_huge(n);
   Page* page = allocate_page(n, alloc::AllocateOptions().with_zero(zero));
   if (false_no_fail(!page)) return nullptr;
-  if (!add_large_block_size(page, n)) {
+  // Pages from the thread cache don't belong to any specific arena, so just
+  // use that of the current thread
+  if (!add_large_block(page, n, thread_arena(false))) {
     reclaim_page(page, n);
     return nullptr;
   }
   return page;
 }
 
+namespace {
+
+void unmap_large(Page* page, size_t size) noexcept {
+  large_mapped_bytes.fetch_sub(size, std::memory_order_relaxed);
+  fsys_munmap(page, size);
+}
+
+}  // namespace
+
 void free_large(void* ptr) noexcept {
   Page* page = static_cast<Page*>(ptr);
-  size_t size = lookup_large_block_size_fail_crash(page);
-  reclaim_page(page, size);
+  LargeBlock block = lookup_large_block_fail_crash_decoded(page);
+  if (block.arena == nullptr)
+    unmap_large(page, block.size);
+  else
+    reclaim_page_to_arena(block.arena, page, block.size, 0);
 }
 
 void free_large(void* ptr, size_t size) noexcept {
   Page* page = static_cast<Page*>(ptr);
   size = pagesize_ceil(size);
-  reclaim_page(page, size);
+  // Still look up the trie to find the owning arena
+  LargeBlock block = lookup_large_block_fail_crash_decoded(page);
+  if (block.arena == nullptr)
+    unmap_large(page, block.size);
+  else
+    reclaim_page_to_arena(block.arena, page, size, 0);
 }
 
+namespace {
+
+// Resizes a block in its own mapping
+void* realloc_mapped(Page* page, size_t* desc, size_t oldsize,
+                     size_t newsize) noexcept {
+  void* nptr = fsys_mremap(page, oldsize, newsize, MREMAP_MAYMOVE);
+  if (fsys_mmap_failed(nptr)) return nomem();
+  if (nptr == page) {
+    std::atomic_ref(*desc).store(encode_large_block(newsize, nullptr),
+                                 std::memory_order_release);
+  } else if (!add_large_block(static_cast<Page*>(nptr), newsize, nullptr)) {
+    // Move it back, so that the original block is still valid
+    fsys_mremap5(nptr, newsize, oldsize, MREMAP_MAYMOVE | MREMAP_FIXED, page);
+    return nomem();
+  }
+  large_mapped_bytes.fetch_add(newsize - oldsize, std::memory_order_relaxed);
+  return nptr;
+}
+
+// Moves a block out of its arena to its own mapping, growing it.
+// Returns nullptr on failure, e.g. if the block spans multiple mappings.
+void* move_to_mapping(Arena* arena, Page* page, size_t oldsize,
+                      size_t newsize) noexcept {
+  void* nptr = fsys_mremap(page, oldsize, newsize, MREMAP_MAYMOVE);
+  if (fsys_mmap_failed(nptr)) return nullptr;
+  if (!add_large_block(static_cast<Page*>(nptr), newsize, nullptr)) {
+    if (nptr == page)
+      fsys_mremap(page, newsize, oldsize, 0);
+    else
+      fsys_mremap5(nptr, newsize, oldsize, MREMAP_MAYMOVE | MREMAP_FIXED,
+                   page);
+    return nullptr;
+  }
+  // The arena never sees these addresses again.  If the block is moved, it
+  // leaves a hole in the arena's mapping, which is never reused.
+  arena->detach(page, oldsize);
+  large_mapped_bytes.fetch_add(newsize, std::memory_order_relaxed);
+  return nptr;
+}
+
+}  // namespace
+
 void* realloc_large(void* ptr, size_t newsize) noexcept {
   // Caller guarantees newsize is not 0
+  if (newsize > kMaxLargeAllocSize) return nomem();
   newsize = pagesize_ceil(newsize);
   Page* page = (Page*)ptr;
-  uint32_t* desc = lookup_large_block_fail_crash((Page*)ptr);
-  size_t oldsize = std::atomic_ref(*desc).load(std::memory_order_acquire);
+  size_t* desc = lookup_large_block_fail_crash((Page*)ptr);
+  auto [oldsize, arena] =
+      decode_large_block(std::atomic_ref(*desc).load(std::memory_order_acquire));
   if (oldsize == newsize) {
     return ptr;
+  } else if (arena == nullptr) {
+    return realloc_mapped(page, desc, oldsize, newsize);
   } else if (oldsize > newsize) {
     // Shrink
-    std::atomic_ref(*desc).store(newsize, std::memory_order_release);
-    reclaim_page(byte_advance(page, newsize), oldsize - newsize,
-                 RECLAIM_PAGE_NOMERGE_LEFT);
+    std::atomic_ref(*desc).store(encode_large_block(newsize, arena),
+                                 std::memory_order_release);
+    reclaim_page_to_arena(arena, byte_advance(page, newsize),
+                          oldsize - newsize, RECLAIM_PAGE_NOMERGE_LEFT);
     return ptr;
   } else {
     // Extend
-    Arena* arena = &arena_default;
     if (arena->extend_nomove((Page*)ptr, oldsize, newsize - oldsize)) {
-      std::atomic_ref(*desc).store(newsize, std::memory_order_release);
+      std::atomic_ref(*desc).store(encode_large_block(newsize, arena),
+                                   std::memory_order_release);
       return ptr;
     } else {
+      if (newsize >= kMremapThreshold) {
+        if (void* nptr = move_to_mapping(arena, page, oldsize, newsize))
+          return nptr;
+      }
       void* nptr = alloc_large(newsize, false);
       if (true_no_fail(nptr)) {
         // std::atomic_ref(*desc).store(0, std::memory_order_release);
         nptr = memcpy(nptr, ptr, oldsize);
-        reclaim_page(page, oldsize);
+        reclaim_page_to_arena(arena, page, oldsize, 0);
       }
       return nptr;
     }
@@ -903,34 +1388,135 @@ void* realloc_large(void* ptr, size_t newsize) noexcept {
 }
 
 size_t large_allocated_size(const void* ptr) noexcept {
-  return *lookup_large_block((const Page*)ptr);
+  return *lookup_large_block((const Page*)ptr) & ~kLargeBlockArenaMask;
 }
 
 void large_trim(size_t pad) noexcept {
   UniqueCache<PageCategoryCache>::visit_all(
-      &page_category_cache_pool,
-      [](PageCategoryCache* tc) noexcept { tc->clear(&arena_default); });
+      &page_category_cache_pool, [arena = thread_arena(false)](
+                                     PageCategoryCache* tc) noexcept {
+        tc->clear(arena);
+      });
   if constexpr (kTHPSize > 0)
     UniqueCache<PageCategoryCache>::visit_all(
         &page_category_cache_pool_no_thp,
-        [](PageCategoryCache* tc) noexcept { tc->clear(&arena_no_thp); });
-
-  {
-    Arena* arena = &arena_default;
-    Description* clean_list = arena->trim_and_extract(pad);
-    arena->munmap_description_list(clean_list);
-  }
+        [arena = thread_arena(true)](PageCategoryCache* tc) noexcept {
+          tc->clear(arena);
+        });
 
-  if constexpr (kTHPSize > 0) {
-    Arena* arena = &arena_no_thp;
-    Description* clean_list = arena->trim_and_extract(pad);
-    arena->munmap_description_list(clean_list);
+  for (Arena& arena : arenas) {
+    Description* clean_list = arena.trim_and_extract(pad);
+    arena.munmap_description_list(clean_list);
   }
 
   // Doesn't make much sense to free description_cache - that's allocated from
   // PermaAlloc and never returned to system
 }
 
+// Caches must be taken before arenas, which must be taken before
+// description caches; PermaAlloc and RawPageAllocator don't take other locks
+void large_fork(ForkStage stage) noexcept {
+  if (stage == ForkStage::CHILD)
+    background_decay_started.store(false, std::memory_order_relaxed);
+  page_category_cache_pool.fork(stage);
+  page_category_cache_pool_no_thp.fork(stage);
+  for (Arena& arena : arenas) arena.fork(stage);
+  description_cache_pool.fork(stage);
+  hugepage_used_trie.fork(stage);
+  description_allocator.fork(stage);
+  large_block_map.fork(stage);
+  RawPageAllocator::instance<true>.fork(stage);
+  RawPageAllocator::instance<false>.fork(stage);
+  RawPageAllocator::instance<true, PermaAllocTag>.fork(stage);
+  RawPageAllocator::instance<false, PermaAllocTag>.fork(stage);
+}
+
+void large_stats(Stats* stats) noexcept {
+  static_assert(arenas.size() == kStatsArenas);
+  for (size_t i = 0; i < arenas.size(); ++i)
+    arenas[i].get_stats(&stats->arena[i]);
+
+  auto count_cached = [stats](PageCategoryCache* tc) noexcept {
+    for (unsigned i = 0; i < PageCategoryCache::kPageCategories; ++i)
+      stats->page_cached +=
+          tc->page_count[i] * PageCategoryCache::page_category_to_size(i);
+  };
+  UniqueCache<PageCategoryCache>::visit_all(&page_category_cache_pool,
+                                            count_cached);
+  if constexpr (kTHPSize > 0)
+    UniqueCache<PageCategoryCache>::visit_all(&page_category_cache_pool_no_thp,
+                                              count_cached);
+
+  stats->large_mapped = large_mapped_bytes.load(std::memory_order_relaxed);
+  stats->arena_mapped = RawPageAllocator::instance<true>.mapped() +
+                        RawPageAllocator::instance<false>.mapped();
+  stats->trie = large_block_map.bytes() + hugepage_used_trie.bytes();
+  stats->metadata = RawPageAllocator::instance<true, PermaAllocTag>.mapped() +
+                    RawPageAllocator::instance<false, PermaAllocTag>.mapped();
+}
+
+void set_decay_time(int decay_ms) noexcept {
+  decay_time_ms.store(decay_ms, std::memory_order_relaxed);
+}
+
+uint64_t now_ms() noexcept {
+  struct timespec ts;
+  fsys_clock_gettime_auto(CLOCK_MONOTONIC_COARSE, &ts);
+  return uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+unsigned decay_interval_ms() noexcept {
+  int decay_ms = decay_time_ms.load(std::memory_order_relaxed);
+  return decay_ms < 0 ? 1000
+                      : std::max(unsigned(decay_ms) / kDecaySteps, 10u);
+}
+
+void decay() noexcept {
+  uint64_t now = now_ms();
+  small_scavenge(now);
+  medium_scavenge(now);
+  for (Arena& arena : arenas)
+    arena.purge_description_list(arena.decay_extract(now));
+}
+
+namespace {
+
+void* background_decay_thread(void*) noexcept {
+  for (;;) {
+    unsigned interval_ms = decay_interval_ms();
+    struct timespec ts = {time_t(interval_ms / 1000),
+                          long(interval_ms % 1000 * 1000000)};
+    fsys_nanosleep(&ts, nullptr);
+    decay();
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+bool start_background_decay() noexcept {
+  if (background_decay_started.exchange(true, std::memory_order_relaxed))
+    return true;
+
+  // Don't let the thread handle any signal
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t thread;
+  int err = pthread_create(&thread, &attr, background_decay_thread, nullptr);
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+  if (err != 0) {
+    background_decay_started.store(false, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
 }  // namespace alloc
 }  // namespace cbu
 // vim: fdm=marker:
@@ -0,0 +1,133 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2021, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cbu/alloc/percpu.h"
+
+#if CBU_ALLOC_PER_CPU
+
+#include <linux/membarrier.h>
+#include <linux/rseq.h>
+#include <stddef.h>
+
+#include "cbu/fsyscall/fsyscall.h"
+
+// Provided by glibc 2.35 or later, which registers rseq for every thread
+extern "C" {
+extern const ptrdiff_t __rseq_offset [[gnu::weak]];
+extern const unsigned int __rseq_size [[gnu::weak]];
+}
+
+namespace cbu {
+namespace alloc {
+namespace {
+
+static_assert(offsetof(RseqArea, cpu_id) == offsetof(struct rseq, cpu_id));
+static_assert(offsetof(RseqArea, rseq_cs) == offsetof(struct rseq, rseq_cs));
+
+constexpr unsigned kRseqSig = 0x53053053;
+
+constinit RseqArea rseq_unavailable{
+    0, uint32_t(RSEQ_CPU_ID_REGISTRATION_FAILED)};
+constinit thread_local RseqArea own_rseq_area{};
+
+// 0 = unknown, 1 = usable, 2 = unusable
+constinit std::atomic<int> percpu_state{0};
+
+// Remote owners rely on membarrier to abort critical sections on other CPUs,
+// so don't use per-CPU caches at all if it's unavailable.
+bool percpu_usable() noexcept {
+  int state = percpu_state.load(std::memory_order_acquire);
+  if (state == 0) {
+    state = fsys_membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0,
+                            0) == 0
+                ? 1
+                : 2;
+    percpu_state.store(state, std::memory_order_release);
+  }
+  return state == 1;
+}
+
+// Restarts rseq critical sections running on the CPU
+bool percpu_fence(uint32_t cpu) noexcept {
+  if (fsys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ,
+                      MEMBARRIER_CMD_FLAG_CPU, cpu) == 0)
+    return true;
+  // Kernels before 5.10 don't support MEMBARRIER_CMD_FLAG_CPU
+  if (fsys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0) == 0)
+    return true;
+  // Registration is not inherited by child processes
+  return fsys_membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0,
+                         0) == 0 &&
+         fsys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0) == 0;
+}
+
+}  // namespace
+
+RseqArea* rseq_init() noexcept {
+  RseqArea* rs = &rseq_unavailable;
+  if (percpu_usable()) {
+    // __rseq_size is 20 in glibc 2.35, 2.36.  It's 0 if glibc doesn't
+    // register rseq.
+    if (&__rseq_size != nullptr && __rseq_size != 0) {
+      rs = reinterpret_cast<RseqArea*>(
+          static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+    } else if (fsys_rseq(&own_rseq_area, sizeof(RseqArea), 0, kRseqSig) ==
+               0) {
+      rs = &own_rseq_area;
+    }
+  }
+  g_rseq_area = rs;
+  return rs;
+}
+
+bool percpu_acquire_remote(uint32_t* owner, uint32_t cpu) noexcept {
+  std::atomic_ref ref(*owner);
+  for (;;) {
+    uint32_t expected = kPerCpuFree;
+    if (ref.compare_exchange_weak(expected, kPerCpuRemote,
+                                  std::memory_order_acquire,
+                                  std::memory_order_relaxed)) {
+      // A thread running on that CPU may have seen kPerCpuFree, and be
+      // about to store kPerCpuOwned.  Either it's aborted by the fence,
+      // or we see its store after the fence.
+      if (!percpu_fence(cpu)) {
+        expected = kPerCpuRemote;
+        ref.compare_exchange_strong(expected, kPerCpuFree,
+                                    std::memory_order_relaxed);
+        return false;
+      }
+      if (ref.load(std::memory_order_acquire) == kPerCpuRemote) return true;
+    }
+    fsys_sched_yield();
+  }
+}
+
+}  // namespace alloc
+}  // namespace cbu
+
+#endif  // CBU_ALLOC_PER_CPU
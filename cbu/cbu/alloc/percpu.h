@@ -0,0 +1,145 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2021, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "cbu/compat/atomic_ref.h"
+
+// Per-CPU caches, built on restartable sequences (rseq).
+// Define CBU_ALLOC_USE_RSEQ to enable them.  Only x86-64 is supported.
+#if defined CBU_ALLOC_USE_RSEQ && defined __x86_64__
+# define CBU_ALLOC_PER_CPU 1
+#else
+# define CBU_ALLOC_PER_CPU 0
+#endif
+
+namespace cbu {
+namespace alloc {
+
+#if CBU_ALLOC_PER_CPU
+
+// CPUs with greater numbers fall back to the mutex-based caches
+constexpr uint32_t kMaxPerCpuCaches = 256;
+constexpr uint32_t kNoCpu = uint32_t(-1);
+
+// Same layout as struct rseq in linux/rseq.h (the original 32-byte version)
+struct alignas(32) RseqArea {
+  uint32_t cpu_id_start;
+  uint32_t cpu_id;
+  uint64_t rseq_cs;
+  uint32_t flags;
+  uint32_t pad[3];
+};
+
+// Registered rseq area of the current thread.  nullptr if not yet known.
+// If rseq is unavailable, this points to a dummy area, whose cpu_id is
+// never valid.
+inline thread_local RseqArea* g_rseq_area = nullptr;
+
+RseqArea* rseq_init() noexcept;
+
+inline RseqArea* rseq_area() noexcept {
+  RseqArea* rs = g_rseq_area;
+  if (__builtin_expect(rs == nullptr, 0)) rs = rseq_init();
+  return rs;
+}
+
+// Values of owner words
+constexpr uint32_t kPerCpuFree = 0;
+constexpr uint32_t kPerCpuOwned = 1;  // Taken by percpu_try_acquire
+constexpr uint32_t kPerCpuRemote = 2;  // Taken by percpu_acquire_remote
+
+// Takes the owner word of the current CPU, which is at base + cpu * stride,
+// and returns the CPU number; or returns kNoCpu if it is already taken.
+//
+// The check and the store are done in an rseq critical section, which is
+// restarted if the thread is preempted or migrated, so no atomic
+// instruction is needed.  The owner may later release the word from any
+// CPU.
+inline uint32_t percpu_try_acquire(RseqArea* rs, uintptr_t base,
+                                   uintptr_t stride) noexcept {
+  uint32_t cpu;
+  uint64_t addr;
+  __asm__ __volatile__(
+      // struct rseq_cs {version, flags, start_ip, post_commit_offset,
+      //                 abort_ip}
+      ".pushsection __rseq_cs, \"aw\"\n\t"
+      ".balign 32\n"
+      "3:\n\t"
+      ".long 0, 0\n\t"
+      ".quad 1f, 2f - 1f, 4f\n\t"
+      ".popsection\n"
+      "0:\n\t"
+      "leaq 3b(%%rip), %[addr]\n\t"
+      "movq %[addr], %[rseq_cs]\n"
+      "1:\n\t"
+      "movl %[cpu_id], %[cpu]\n\t"
+      "cmpl %[max], %[cpu]\n\t"
+      "jae 5f\n\t"
+      "movl %[cpu], %k[addr]\n\t"
+      "imulq %q[stride], %[addr]\n\t"
+      "addq %q[base], %[addr]\n\t"
+      "cmpl %[free], (%[addr])\n\t"
+      "jne 5f\n\t"
+      "movl %[owned], (%[addr])\n"  // Commit
+      "2:\n\t"
+      // The abort handler must be preceded by the signature, which is the
+      // same as glibc's.
+      ".pushsection __rseq_failure, \"ax\"\n\t"
+      ".long 0x53053053\n"
+      "4:\n\t"
+      "jmp 0b\n\t"
+      ".popsection\n\t"
+      "jmp 6f\n"
+      "5:\n\t"
+      "movl %[none], %[cpu]\n"
+      "6:"
+      : [cpu] "=&r"(cpu), [addr] "=&r"(addr), [rseq_cs] "=m"(rs->rseq_cs)
+      : [cpu_id] "m"(rs->cpu_id), [max] "i"(kMaxPerCpuCaches),
+        [base] "r"(base), [stride] "r"(stride), [free] "i"(kPerCpuFree),
+        [owned] "i"(kPerCpuOwned), [none] "i"(kNoCpu)
+      : "memory", "cc");
+  return cpu;
+}
+
+inline void percpu_release(uint32_t* owner) noexcept {
+  std::atomic_ref(*owner).store(kPerCpuFree, std::memory_order_release);
+}
+
+// Takes the owner word of any CPU, waiting if it's busy.
+// Returns false if this is impossible, in which case the word is not taken.
+bool percpu_acquire_remote(uint32_t* owner, uint32_t cpu) noexcept;
+
+#endif  // CBU_ALLOC_PER_CPU
+
+}  // namespace alloc
+}  // namespace cbu
@@ -29,6 +29,7 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <mutex>
 
 #include "cbu/alloc/alloc.h"
@@ -54,9 +55,17 @@ class PermaAlloc {
   T* alloc_list(unsigned preferred_count);
   void free_list(T* ptr) noexcept;
 
+  // Total bytes ever allocated.  They are never returned.
+  size_t bytes() const noexcept {
+    return bytes_.load(std::memory_order_relaxed);
+  }
+
+  void fork(ForkStage stage) noexcept { fork_lock(&lock_, stage); }
+
  private:
   LowLevelMutex lock_;
   T* list_ = nullptr;
+  std::atomic<size_t> bytes_{0};
 
   static inline constexpr auto* raw_page_allocator_ =
       &RawPageAllocator::instance<true, PermaAllocTag>;
@@ -83,6 +92,7 @@ T* PermaAlloc<T>::alloc() {
   constexpr size_t alloc_size = pagesize_ceil(4 * sizeof(T));
   void* np = raw_page_allocator_->allocate(alloc_size);
   if (false_no_fail(np == nullptr)) return NULL;
+  bytes_.fetch_add(alloc_size, std::memory_order_relaxed);
 
   T* node = static_cast<T*>(np);
   T* rnode = node + 1;
@@ -136,6 +146,7 @@ T* PermaAlloc<T>::alloc_list(unsigned preferred_count) {
       }
       return nullptr;
     }
+    bytes_.fetch_add(alloc_size, std::memory_order_relaxed);
     T* node = static_cast<T*>(np);
     unsigned allocated_count = alloc_size / sizeof(T);
     *tail = node;
@@ -190,6 +201,8 @@ class SizedPermaAlloc {
  public:
   inline void* alloc() { return allocator_.alloc(); }
   inline void free(void* ptr) { allocator_.free(static_cast<Node*>(ptr)); }
+  size_t bytes() const noexcept { return allocator_.bytes(); }
+  void fork(ForkStage stage) noexcept { allocator_.fork(stage); }
 };
 
 // This class allocates with a given typewithout requiring proper next and count
@@ -32,6 +32,12 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <array>
+#include <atomic>
+#include <iterator>
+#include <memory>
+
+#include "cbu/alloc/alloc.h"
 #include "cbu/alloc/pagesize.h"
 #include "cbu/common/bit.h"
 #include "cbu/sys/low_level_mutex.h"
@@ -49,29 +55,133 @@ inline constexpr bool false_no_fail(bool r) { return r; }
 inline constexpr bool never_fails() { return false; }
 #endif
 
-constexpr unsigned kMaxCategory = 6;
-constexpr unsigned kNumCategories = kMaxCategory + 1;
+// Fork handlers take all locks in PREPARE, and release them in PARENT or
+// reinitialize them in CHILD.
+enum class ForkStage {
+  PREPARE,
+  PARENT,
+  CHILD,
+};
 
-inline constexpr size_t category_to_size(unsigned n) { return (16u << n); }
-inline unsigned size_to_category(size_t m) {
-  assert(m != 0);
-  assert(m <= category_to_size(kMaxCategory));
-  unsigned n = (m - 1) | 15;
-  unsigned cat = bsr(n);
-  return (cat - 3);
+inline void fork_lock(LowLevelMutex* lock, ForkStage stage) noexcept {
+  switch (stage) {
+    case ForkStage::PREPARE:
+      lock->lock();
+      break;
+    case ForkStage::PARENT:
+      lock->unlock();
+      break;
+    case ForkStage::CHILD:
+      std::construct_at(lock);
+      break;
+  }
 }
 
-inline constexpr size_t divide_by_category_size(size_t m, unsigned n) {
-  return (m >> (4 + n));
+// Size classes of the small allocator:
+// 16-byte steps up to 128 bytes, then quarter-power steps (four classes
+// between adjacent powers of 2) up to 1 KiB.
+inline constexpr uint16_t kCategorySizes[] = {
+    16,  32,  48,  64,  80,  96,  112, 128, 160, 192,
+    224, 256, 320, 384, 448, 512, 640, 768, 896, 1024,
+};
+
+constexpr unsigned kNumCategories = std::size(kCategorySizes);
+constexpr unsigned kMaxCategory = kNumCategories - 1;
+
+inline constexpr size_t category_to_size(unsigned n) {
+  return kCategorySizes[n];
 }
-inline constexpr size_t multiply_by_category_size(size_t m, unsigned n) {
-  return (m << (4 + n));
+
+constexpr unsigned kCategoryGranularity = 16;
+
+// Indexed by ceil(size / kCategoryGranularity)
+inline constexpr auto kSizeToCategory = [] {
+  constexpr size_t kEntries =
+      kCategorySizes[kMaxCategory] / kCategoryGranularity + 1;
+  std::array<uint8_t, kEntries> res{};
+  unsigned cat = 0;
+  for (size_t i = 1; i < kEntries; ++i) {
+    if (i * kCategoryGranularity > kCategorySizes[cat]) ++cat;
+    res[i] = cat;
+  }
+  return res;
+}();
+
+inline constexpr unsigned size_to_category(size_t m) {
+  assert(m != 0);
+  assert(m <= category_to_size(kMaxCategory));
+  return kSizeToCategory[(m + kCategoryGranularity - 1) /
+                         kCategoryGranularity];
 }
 
+static_assert(size_to_category(1) == 0);
+static_assert(size_to_category(16) == 0);
+static_assert(size_to_category(17) == 1);
+static_assert(size_to_category(129) == 8);
+static_assert(size_to_category(520) == 16);
+static_assert(size_to_category(1024) == kMaxCategory);
+
 static_assert(kPageSize == category_to_size(kMaxCategory) * 4,
               "kPageSize/kMaxCategory");
 constexpr size_t kSmallAllocLimit = kPageSize / 4;
 
+// Size classes of the medium allocator, continuing the quarter-power steps
+// up to 32 KiB.
+inline constexpr uint16_t kMediumCategorySizes[] = {
+    1280,  1536,  1792,  2048,  2560,  3072,  3584,  4096,  5120,  6144,
+    7168,  8192,  10240, 12288, 14336, 16384, 20480, 24576, 28672, 32768,
+};
+
+constexpr unsigned kNumMediumCategories = std::size(kMediumCategorySizes);
+constexpr unsigned kMaxMediumCategory = kNumMediumCategories - 1;
+
+inline constexpr size_t medium_category_to_size(unsigned n) {
+  return kMediumCategorySizes[n];
+}
+
+constexpr unsigned kMediumCategoryGranularity = 256;
+
+// Indexed by ceil(size / kMediumCategoryGranularity)
+inline constexpr auto kSizeToMediumCategory = [] {
+  constexpr size_t kEntries =
+      kMediumCategorySizes[kMaxMediumCategory] / kMediumCategoryGranularity +
+      1;
+  std::array<uint8_t, kEntries> res{};
+  unsigned cat = 0;
+  for (size_t i = 1; i < kEntries; ++i) {
+    if (i * kMediumCategoryGranularity > kMediumCategorySizes[cat]) ++cat;
+    res[i] = cat;
+  }
+  return res;
+}();
+
+inline constexpr unsigned size_to_medium_category(size_t m) {
+  assert(m > kSmallAllocLimit);
+  assert(m <= medium_category_to_size(kMaxMediumCategory));
+  return kSizeToMediumCategory[(m + kMediumCategoryGranularity - 1) /
+                               kMediumCategoryGranularity];
+}
+
+static_assert(size_to_medium_category(kSmallAllocLimit + 1) == 0);
+static_assert(size_to_medium_category(2049) == 4);
+static_assert(size_to_medium_category(32768) == kMaxMediumCategory);
+
+constexpr size_t kMediumAllocLimit =
+    medium_category_to_size(kMaxMediumCategory);
+
+// Checks whether n is a multiple of size without dividing ("Faster Remainder
+// by Direct Computation", Lemire et al.).  magic is divisibility_magic(size).
+inline constexpr uint64_t divisibility_magic(size_t size) {
+  return UINT64_MAX / size + 1;
+}
+
+inline constexpr bool is_multiple_of(uint32_t n, uint64_t magic) {
+  return n * magic <= magic - 1;
+}
+
+static_assert(is_multiple_of(48 * 85, divisibility_magic(48)));
+static_assert(!is_multiple_of(48 * 85 - 16, divisibility_magic(48)));
+
 template <typename T>
 inline constexpr T pagesize_floor(T size) {
   return pow2_floor(size, kPageSize);
@@ -82,6 +192,11 @@ inline constexpr T pagesize_ceil(T size) {
   return pow2_ceil(size, kPageSize);
 }
 
+// Coarse monotonic clock for decay
+uint64_t now_ms() noexcept;
+// Interval between two decay steps, per set_decay_time
+unsigned decay_interval_ms() noexcept;
+
 // Page allocators
 struct Page {
   union {
@@ -107,9 +222,54 @@ void* alloc_small_category(unsigned) noexcept;
 void* alloc_small(size_t) noexcept;
 void free_small(void*) noexcept;
 void free_small(void*, size_t) noexcept;
+void free_small_category(void*, unsigned) noexcept;
+// Batch interfaces.  alloc_small_batch returns the number of blocks
+// allocated; free_small_batch skips blocks that are not small.
+size_t alloc_small_batch(size_t, size_t, void**) noexcept;
+void free_small_batch(void**, size_t) noexcept;
 unsigned small_allocated_category(void*) noexcept;
 size_t small_allocated_size(void*) noexcept;
 void small_trim(size_t) noexcept;
+// Shrinks the limits of idle thread caches
+void small_scavenge(uint64_t now_ms) noexcept;
+void small_stats(Stats*) noexcept;
+void small_fork(ForkStage) noexcept;
+// Limits of small and medium thread caches share a global budget, capped by
+// set_thread_cache_limit.  reserve_cache_bytes fails if the cap would be
+// exceeded; charge_cache_bytes doesn't, and is for the minimum limits.
+bool reserve_cache_bytes(size_t bytes) noexcept;
+void charge_cache_bytes(size_t bytes) noexcept;
+void unreserve_cache_bytes(size_t bytes) noexcept;
+
+// Medium allocator (with thread cache)
+// Medium blocks are carved from chunks in a dedicated address range, so
+// that they can be recognized without looking at the memory.
+struct MediumRegion {
+  std::atomic<uintptr_t> base{0};
+  std::atomic<uintptr_t> size{0};
+};
+inline constinit MediumRegion medium_region;
+
+inline bool is_medium(const void* ptr) noexcept {
+  // size is stored last (release), so a nonzero size comes with its base
+  uintptr_t size = medium_region.size.load(std::memory_order_acquire);
+  return uintptr_t(ptr) - medium_region.base.load(std::memory_order_relaxed) <
+         size;
+}
+
+// Falls back to alloc_large if the medium region is unavailable
+void* alloc_medium(size_t size, bool zero) noexcept;
+void free_medium(void*) noexcept;
+void free_medium(void*, size_t) noexcept;
+// Unlike alloc_medium, doesn't fall back to alloc_large
+size_t alloc_medium_batch(size_t, size_t, void**) noexcept;
+void free_medium_batch(void**, size_t) noexcept;
+size_t medium_allocated_size(void*) noexcept;
+void medium_trim(size_t) noexcept;
+// Like small_scavenge
+void medium_scavenge(uint64_t now_ms) noexcept;
+void medium_stats(Stats*) noexcept;
+void medium_fork(ForkStage) noexcept;
 
 // Large allocator
 void* alloc_large(size_t size, bool zero) noexcept;
@@ -118,6 +278,64 @@ void free_large(void* ptr, size_t size) noexcept;
 void* realloc_large(void* ptr, size_t newsize) noexcept;
 size_t large_allocated_size(const void*) noexcept;
 void large_trim(size_t) noexcept;
+void large_stats(Stats*) noexcept;
+// Also handles page allocators and metadata
+void large_fork(ForkStage) noexcept;
+
+// Thread cache registry (tc.cpp).  Its lock is a leaf, so fork takes it last.
+void thread_cache_fork(ForkStage) noexcept;
+
+// Heap profiler
+// Bytes to allocate before the next sample.  Even when sampling is disabled,
+// this occasionally expires so that threads notice when it's enabled.
+inline thread_local size_t g_bytes_until_sample = 0;
+inline constinit std::atomic<size_t> g_live_samples{0};
+
+inline bool should_sample(size_t size) noexcept {
+  return __builtin_expect(
+      __builtin_sub_overflow(g_bytes_until_sample, size, &g_bytes_until_sample),
+      0);
+}
+
+// Returns nullptr if this allocation isn't sampled after all.
+// Sampled blocks are always large blocks, except guarded ones.
+void* alloc_sampled(size_t size, AllocateOptions options) noexcept;
+// Makes the next allocation of the current thread take a heap profile
+// sample or a guarded block, whichever is enabled
+void rearm_sampling() noexcept;
+// Forgets the sample of a large block, if any
+void free_sampled(void* ptr) noexcept;
+void profile_fork(ForkStage) noexcept;
+
+inline void maybe_free_sampled(void* ptr) noexcept {
+  if (g_live_samples.load(std::memory_order_relaxed)) free_sampled(ptr);
+}
+
+// Guarded allocation
+// A guarded block is at the end of a page followed by an inaccessible page,
+// in a dedicated address range.  The page starts with kGuardedCategory in
+// place of the category of a small run, so free_small recognizes it.
+struct GuardRegion {
+  std::atomic<uintptr_t> base{0};
+  std::atomic<uintptr_t> size{0};
+};
+inline constinit GuardRegion guard_region;
+
+constexpr unsigned kGuardedCategory = 0xff;
+static_assert(kGuardedCategory > kMaxCategory);
+
+inline bool is_guarded(const void* ptr) noexcept {
+  return uintptr_t(ptr) - guard_region.base.load(std::memory_order_relaxed) <
+         guard_region.size.load(std::memory_order_relaxed);
+}
+
+size_t guard_sample_rate() noexcept;
+// Returns nullptr if the block can't be guarded.  Memory is zeroed.
+void* alloc_guarded(size_t size) noexcept;
+void free_guarded(void* ptr) noexcept;
+size_t guarded_allocated_size(void* ptr) noexcept;
+void guard_stats(Stats*) noexcept;
+void guard_fork(ForkStage) noexcept;
 
 // Raw page allocation
 // No corresponding deallocation is provided.  Caller should either keep
@@ -133,6 +351,18 @@ class RawPageAllocator {
   Page* allocate(size_t size) noexcept;
 
   constexpr bool allow_thp() const noexcept { return allow_thp_; }
+  // Total bytes mapped, less those reported by unmapped.  Pages may be
+  // unmapped by an arena of another allocator, so only the sum over
+  // allocators is accurate (modulo 2^64).
+  size_t mapped() const noexcept {
+    return mapped_.load(std::memory_order_relaxed);
+  }
+  // To be called by whoever unmaps pages, or moves them away with mremap
+  void unmapped(size_t size) noexcept {
+    mapped_.fetch_sub(size, std::memory_order_relaxed);
+  }
+
+  void fork(ForkStage stage) noexcept { fork_lock(&lock_, stage); }
 
   template <bool AllowThp, typename... Tags>
   static RawPageAllocator instance;
@@ -142,6 +372,7 @@ class RawPageAllocator {
 
   CachedPage* cached_page_ = nullptr;
   LowLevelMutex lock_;
+  std::atomic<size_t> mapped_{0};
   bool allow_thp_;
 };
 
@@ -0,0 +1,238 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2021, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+#include "cbu/alloc/alloc.h"
+#include "cbu/alloc/permanent.h"
+#include "cbu/alloc/private.h"
+#include "cbu/alloc/report.h"
+#include "cbu/sys/low_level_mutex.h"
+
+namespace cbu {
+namespace alloc {
+namespace {
+
+constexpr unsigned kMaxFrames = 32;
+// When sampling is disabled, check again after this many bytes
+constexpr size_t kDisabledRecheckBytes = 16 * 1024 * 1024;
+
+constinit std::atomic<size_t> sample_rate{0};
+
+struct Sample {
+  Sample* next;  // In hash chain or PermaAlloc free list
+  unsigned count;  // Used by PermaAlloc
+  unsigned depth;
+  void* ptr;
+  size_t size;
+  void* frames[kMaxFrames];
+};
+
+constexpr unsigned kSampleBuckets = 4096;
+
+struct SampleTable {
+  LowLevelMutex lock{};
+  Sample* buckets[kSampleBuckets] = {};
+  PermaAlloc<Sample> allocator{};
+
+  static unsigned bucket(const void* ptr) noexcept {
+    return (uintptr_t(ptr) >> kPageSizeBits) % kSampleBuckets;
+  }
+};
+
+constinit SampleTable sample_table;
+
+thread_local uint64_t sample_rng = 0;
+thread_local bool in_sampling = false;
+
+// g_bytes_until_sample counts down to whichever comes first, the next heap
+// profile sample or the next guarded allocation.  These are the bytes left
+// to each when it was last set to armed_bytes.
+thread_local size_t profile_bytes_left = 0;
+thread_local size_t guard_bytes_left = 0;
+thread_local size_t armed_bytes = 0;
+
+// Exponentially distributed, so that samples are a Poisson process over
+// allocated bytes
+size_t next_sample_interval(size_t rate) noexcept {
+  uint64_t x = sample_rng;
+  if (x == 0) x = uintptr_t(&sample_rng) * 0x9e3779b97f4a7c15;
+  // xorshift64
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  sample_rng = x;
+  double u = double((x >> 11) + 1) / double(uint64_t(1) << 53);
+  return size_t(-log(u) * rate) + 1;
+}
+
+[[gnu::noinline]] void record_sample(void* ptr, size_t size) noexcept {
+  Sample* sample = sample_table.allocator.alloc();
+  if (false_no_fail(sample == nullptr)) return;
+  sample->ptr = ptr;
+  sample->size = size;
+  // Skip capture_backtrace, record_sample and alloc_sampled
+  sample->depth = capture_backtrace(sample->frames, kMaxFrames, 3);
+
+  std::lock_guard locker(sample_table.lock);
+  Sample** head = &sample_table.buckets[SampleTable::bucket(ptr)];
+  sample->next = *head;
+  *head = sample;
+  g_live_samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+void write_profile_unlocked(FdWriter& w) noexcept {
+  uint64_t count = 0;
+  uint64_t bytes = 0;
+  for (const Sample* head : sample_table.buckets) {
+    for (const Sample* s = head; s; s = s->next) {
+      ++count;
+      bytes += s->size;
+    }
+  }
+
+  w << "heap profile: " << count << ": " << bytes << " [" << count << ": "
+    << bytes << "] @ heap_v2/"
+    << uint64_t(sample_rate.load(std::memory_order_relaxed)) << "\n";
+  for (const Sample* head : sample_table.buckets) {
+    for (const Sample* s = head; s; s = s->next) {
+      w << "1: " << uint64_t(s->size) << " [1: " << uint64_t(s->size)
+        << "] @";
+      for (unsigned i = 0; i < s->depth; ++i) w << " " << s->frames[i];
+      w << "\n";
+    }
+  }
+}
+
+// Subtracts passed bytes from *left, and returns true (rescheduling it) if
+// it's due
+bool advance_countdown(size_t* left, size_t passed, size_t rate) noexcept {
+  if (rate == 0) {
+    // Due as soon as it's enabled
+    *left = 0;
+    return false;
+  }
+  if (*left > passed) {
+    *left -= passed;
+    return false;
+  }
+  *left = next_sample_interval(rate);
+  return true;
+}
+
+}  // namespace
+
+void* alloc_sampled(size_t size, AllocateOptions options) noexcept {
+  size_t rate = sample_rate.load(std::memory_order_relaxed);
+  size_t guard_rate = guard_sample_rate();
+  bool profile = advance_countdown(&profile_bytes_left, armed_bytes, rate);
+  bool guard = advance_countdown(&guard_bytes_left, armed_bytes, guard_rate);
+  size_t next = kDisabledRecheckBytes;
+  if (rate) next = std::min(next, profile_bytes_left);
+  if (guard_rate) next = std::min(next, guard_bytes_left);
+  armed_bytes = g_bytes_until_sample = next;
+  if (size == 0 || in_sampling) return nullptr;
+
+  // The unwinder may allocate
+  void* ptr = nullptr;
+  in_sampling = true;
+  if (guard) {
+    ptr = alloc_guarded(size);
+    // If both are due, the heap profile sample is taken next time
+    if (ptr && profile) {
+      profile_bytes_left = 0;
+      armed_bytes = g_bytes_until_sample = 0;
+    }
+  }
+  if (ptr == nullptr && profile) {
+    ptr = alloc_large(size, options.zero);
+    if (true_no_fail(ptr)) record_sample(ptr, size);
+  }
+  in_sampling = false;
+  return ptr;
+}
+
+void rearm_sampling() noexcept {
+  profile_bytes_left = guard_bytes_left = 0;
+  g_bytes_until_sample = 0;
+}
+
+void free_sampled(void* ptr) noexcept {
+  Sample* sample = nullptr;
+  {
+    std::lock_guard locker(sample_table.lock);
+    for (Sample** p = &sample_table.buckets[SampleTable::bucket(ptr)]; *p;
+         p = &(*p)->next) {
+      if ((*p)->ptr == ptr) {
+        sample = *p;
+        *p = sample->next;
+        break;
+      }
+    }
+  }
+  if (sample) {
+    g_live_samples.fetch_sub(1, std::memory_order_relaxed);
+    sample_table.allocator.free(sample);
+  }
+}
+
+void profile_fork(ForkStage stage) noexcept {
+  fork_lock(&sample_table.lock, stage);
+  sample_table.allocator.fork(stage);
+}
+
+void set_sample_rate(size_t rate) noexcept {
+  sample_rate.store(rate, std::memory_order_relaxed);
+  // Let the current thread notice it immediately
+  rearm_sampling();
+}
+
+bool dump_heap_profile(int fd, bool try_lock) noexcept {
+  FdWriter w(fd);
+  {
+    std::unique_lock locker(sample_table.lock, std::defer_lock);
+    if (try_lock) {
+      if (!locker.try_lock()) return false;
+    } else {
+      locker.lock();
+    }
+    write_profile_unlocked(w);
+    w.flush();
+  }
+  w.write_maps();
+  return true;
+}
+
+}  // namespace alloc
+}  // namespace cbu
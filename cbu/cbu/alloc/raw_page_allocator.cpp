@@ -43,10 +43,19 @@ namespace alloc {
 namespace {
 
 void* raw_mmap_pages(size_t size, bool allow_thp) noexcept {
-  void* p = fsys_mmap(nullptr, size, PROT_READ | PROT_WRITE,
+  // Mappings that allow THP are aligned to hugepages, so that the arenas
+  // can fill hugepages one by one
+  size_t extra = (kTHPSize && allow_thp) ? kTHPSize - kPageSize : 0;
+  void* p = fsys_mmap(nullptr, size + extra, PROT_READ | PROT_WRITE,
                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
   if (false_no_fail(fsys_mmap_failed(p))) {
     p = nullptr;
+  } else if (extra) {
+    char* aligned = pow2_ceil(static_cast<char*>(p), kTHPSize);
+    size_t head = aligned - static_cast<char*>(p);
+    if (head) fsys_munmap(p, head);
+    if (head != extra) fsys_munmap(aligned + size, extra - head);
+    p = aligned;
   } else {
 #ifdef MADV_NOHUGEPAGE
     if (kTHPSize && !allow_thp) fsys_madvise(p, size, MADV_NOHUGEPAGE);
@@ -98,6 +107,7 @@ Page* RawPageAllocator::allocate(size_t size) noexcept {
 
   void* np = raw_mmap_pages(alloc_size, use_thp);
   if (false_no_fail(np == nullptr)) return nullptr;
+  mapped_.fetch_add(alloc_size, std::memory_order_relaxed);
 
   if (alloc_size > size) {
     CachedPage* remaining = static_cast<CachedPage*>(byte_advance(np, size));
@@ -0,0 +1,140 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2021, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+// Output for heap profiles and crash reports, usable in signal handlers
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unwind.h>
+
+#include "cbu/fsyscall/fsyscall.h"
+
+namespace cbu {
+namespace alloc {
+
+// Buffered output
+class FdWriter {
+ public:
+  explicit FdWriter(int fd) noexcept : fd_(fd) {}
+  ~FdWriter() noexcept { flush(); }
+
+  FdWriter& operator<<(const char* s) noexcept {
+    while (*s) put(*s++);
+    return *this;
+  }
+
+  FdWriter& operator<<(uint64_t v) noexcept {
+    char tmp[24];
+    char* p = tmp + sizeof(tmp);
+    do *--p = '0' + v % 10; while (v /= 10);
+    write(p, tmp + sizeof(tmp) - p);
+    return *this;
+  }
+
+  FdWriter& operator<<(const void* ptr) noexcept {
+    char tmp[24];
+    char* p = tmp + sizeof(tmp);
+    uintptr_t v = uintptr_t(ptr);
+    do *--p = "0123456789abcdef"[v % 16]; while (v /= 16);
+    *this << "0x";
+    write(p, tmp + sizeof(tmp) - p);
+    return *this;
+  }
+
+  void write(const char* s, size_t n) noexcept {
+    while (n--) put(*s++);
+  }
+
+  void flush() noexcept {
+    const char* p = buf_;
+    while (len_) {
+      ssize_t n = fsys_write(fd_, p, len_);
+      if (n <= 0) break;
+      p += n;
+      len_ -= n;
+    }
+    len_ = 0;
+  }
+
+  // Copies /proc/self/maps, so that addresses can be symbolized
+  void write_maps() noexcept {
+    *this << "\nMAPPED_LIBRARIES:\n";
+    flush();
+    int fd = fsys_open2("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    char buf[1024];
+    ssize_t n;
+    while ((n = fsys_read(fd, buf, sizeof(buf))) > 0) write(buf, n);
+    fsys_close(fd);
+  }
+
+ private:
+  void put(char c) noexcept {
+    if (len_ == sizeof(buf_)) flush();
+    buf_[len_++] = c;
+  }
+
+ private:
+  int fd_;
+  size_t len_ = 0;
+  char buf_[1024];
+};
+
+// Stores up to max_depth return addresses, skipping the innermost skip
+// frames (including this function), and returns the number stored.
+// The unwinder may allocate, so callers must guard against recursion.
+[[gnu::noinline]] inline unsigned capture_backtrace(void** frames,
+                                                    unsigned max_depth,
+                                                    unsigned skip) noexcept {
+  struct Backtrace {
+    void** frames;
+    unsigned depth;
+    unsigned max_depth;
+    unsigned skip;
+  } bt{frames, 0, max_depth, skip};
+  auto callback = [](_Unwind_Context* ctx, void* arg) {
+    Backtrace* bt = static_cast<Backtrace*>(arg);
+    if (bt->skip) {
+      --bt->skip;
+      return _URC_NO_REASON;
+    }
+    void* ip = reinterpret_cast<void*>(_Unwind_GetIP(ctx));
+    if (ip == nullptr) return _URC_END_OF_STACK;
+    bt->frames[bt->depth++] = ip;
+    return bt->depth < bt->max_depth ? _URC_NO_REASON : _URC_END_OF_STACK;
+  };
+  _Unwind_Backtrace(callback, &bt);
+  return bt.depth;
+}
+
+}  // namespace alloc
+}  // namespace cbu
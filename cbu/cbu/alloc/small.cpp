@@ -27,8 +27,10 @@
  */
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <mutex>
+#include <utility>
 
 #include "cbu/alloc/alloc.h"
 #include "cbu/alloc/private.h"
@@ -50,10 +52,37 @@ struct Block {
 struct ThreadCategory {
   Block* free;
   unsigned count_free;
+  // Maximum of count_free (0 until the first free), adapted by
+  // adapt_limit and scavenge
+  unsigned limit;
+  // Minimum of count_free since the last scavenge
+  unsigned low_water;
+  // Refills from runs since the last overflow
+  unsigned misses;
+};
+
+// Limits of each category of a cache, in bytes.  The sum of all limits is
+// kept under a global cap, except that every category gets kMinCacheBytes.
+constexpr size_t kMinCacheBytes = 4096;
+constexpr size_t kInitialCacheBytes = 16384;
+constexpr size_t kMaxCacheBytes = 1024 * 1024;
+
+// Shared with medium caches
+constinit std::atomic<size_t> cache_bytes_total{0};
+constinit std::atomic<size_t> cache_bytes_cap{64 * 1024 * 1024};
+
+// Statistics, only updated in slow paths
+struct CategoryStats {
+  uint64_t allocated;
+  uint64_t freed;
+  // Runs may be freed through other caches, so only the sum is meaningful
+  uint64_t runs;
 };
 
 struct SmallCache {
   ThreadCategory category[kNumCategories] = {};
+  CategoryStats stats[kNumCategories] = {};
+  uint64_t scavenged_ms = 0;  // When scavenge last ran
 
   void clear() noexcept;
 };
@@ -66,29 +95,159 @@ struct Run {
   unsigned allocated;
 };
 
+constexpr size_t kRunHeaderSize = category_to_size(0);
+
 static_assert(sizeof(Block) <= category_to_size(0), "Block too large");
-static_assert(sizeof(Run) <= category_to_size(0), "Run too large");
+static_assert(sizeof(Run) <= kRunHeaderSize, "Run too large");
+
+// Run layout: The run header is at the beginning of the page, and blocks are
+// packed toward the end of the page, so that sizes that don't divide the page
+// can use the slack for the header instead of wasting a whole block.
+// A block is at offset (kPageSize - k * size), which has the same alignment
+// as size (up to kPageSize), and is never page aligned.
+inline constexpr auto kCategoryBlocks = [] {
+  std::array<uint16_t, kNumCategories> res{};
+  for (unsigned cat = 0; cat < kNumCategories; ++cat)
+    res[cat] = (kPageSize - kRunHeaderSize) / category_to_size(cat);
+  return res;
+}();
+
+inline constexpr unsigned category_blocks(unsigned cat) {
+  return kCategoryBlocks[cat];
+}
+
+inline constexpr size_t category_first_block_offset(unsigned cat) {
+  return kPageSize - category_blocks(cat) * category_to_size(cat);
+}
+
+inline constexpr auto kCategoryMagic = [] {
+  std::array<uint64_t, kNumCategories> res{};
+  for (unsigned cat = 0; cat < kNumCategories; ++cat)
+    res[cat] = divisibility_magic(category_to_size(cat));
+  return res;
+}();
+
+// Whether offset (in the page) is that of a block of the category
+inline constexpr bool is_category_block_offset(size_t offset, unsigned cat) {
+  return offset >= category_first_block_offset(cat) &&
+         is_multiple_of(kPageSize - offset, kCategoryMagic[cat]);
+}
+
+static_assert([] {
+  for (unsigned cat = 0; cat < kNumCategories; ++cat) {
+    size_t size = category_to_size(cat);
+    for (size_t offset = 0; offset < kPageSize; ++offset) {
+      if (is_category_block_offset(offset, cat) !=
+          (offset >= category_first_block_offset(cat) &&
+           (kPageSize - offset) % size == 0))
+        return false;
+    }
+  }
+  return true;
+}());
+static_assert(category_blocks(0) == 255);
+static_assert(category_blocks(kMaxCategory) == 3);
 
 inline Run* block2run(Block* ptr) { return (Run*)pagesize_floor(ptr); }
 
-void free_small_list(Block* ptr) {
+void release_run_blocks(Run* run, unsigned count, CategoryStats* stats) {
+  int remain = cbu::tweak::SINGLE_THREADED
+                   ? (run->allocated -= count)
+                   : std::atomic_ref(run->allocated)
+                             .fetch_sub(count, std::memory_order_release) -
+                         count;
+  if (remain <= 0) {
+    if (remain < 0) memory_corrupt();
+    stats->runs--;
+    reclaim_page((Page*)run, kPageSize);
+  }
+}
+
+// Blocks in a free list tend to come from a few runs, particularly when
+// they're allocated by one thread and freed by another.  Counts are added
+// up per run, so that the (possibly contended) run header is updated once
+// per run rather than once per block.
+void free_small_list(Block* ptr, CategoryStats* stats) {
+  constexpr unsigned kSlots = 16;
+  struct Pending {
+    Run* run;
+    unsigned count;
+  } pending[kSlots] = {};
+
   while (ptr) {
     Block* p = std::exchange(ptr, ptr->next);
-
     Run* run = block2run(p);
-    auto count = p->count;
-    int remain = cbu::tweak::SINGLE_THREADED
-                     ? (run->allocated -= count)
-                     : std::atomic_ref(run->allocated)
-                               .fetch_sub(count, std::memory_order_release) -
-                           count;
-    if (remain <= 0) {
-      if (remain < 0) memory_corrupt();
-      reclaim_page((Page*)run, kPageSize);
+    // A run can't be reclaimed while any of its blocks remain in the list,
+    // so it's safe to release a run before its last block is seen.
+    Pending& slot = pending[uintptr_t(run) / kPageSize % kSlots];
+    if (slot.run != run) {
+      if (slot.run) release_run_blocks(slot.run, slot.count, stats);
+      slot.run = run;
+      slot.count = 0;
+    }
+    slot.count += p->count;
+  }
+
+  for (const Pending& slot : pending)
+    if (slot.run) release_run_blocks(slot.run, slot.count, stats);
+}
+
+// Detaches n blocks from the head of the free list
+Block* detach_blocks(ThreadCategory* catp, size_t size, unsigned n) {
+  Block* res = nullptr;
+  catp->count_free -= n;
+  while (n) {
+    Block* free = catp->free;
+    unsigned count = free->count;
+    if (count <= n) {
+      catp->free = free->next;
+      free->next = res;
+      res = free;
+      n -= count;
+    } else {
+      Block* p = byte_advance(free, (count - n) * size);
+      free->count = count - n;
+      p->next = res;
+      p->count = n;
+      res = p;
+      n = 0;
+    }
+  }
+  if (catp->count_free < catp->low_water) catp->low_water = catp->count_free;
+  return res;
+}
+
+// Called periodically.  Blocks that stayed in the cache since the last call
+// are idle, so the limit is halved, and half of them are flushed.
+void scavenge(SmallCache* cache, uint64_t now) noexcept {
+  cache->scavenged_ms = now;
+  for (unsigned cat = 0; cat < kNumCategories; ++cat) {
+    ThreadCategory* catp = &cache->category[cat];
+    size_t size = category_to_size(cat);
+    unsigned idle = catp->low_water;
+    if (idle && catp->limit) {
+      unsigned limit =
+          std::max<size_t>(catp->limit / 2, kMinCacheBytes / size);
+      unreserve_cache_bytes((catp->limit - limit) * size);
+      catp->limit = limit;
+      unsigned n = std::max(idle - idle / 2,
+                            catp->count_free - std::min(catp->count_free,
+                                                        limit));
+      cache->stats[cat].freed += n;
+      free_small_list(detach_blocks(catp, size, n), &cache->stats[cat]);
     }
+    catp->low_water = catp->count_free;
   }
 }
 
+// Scavenges the cache if the decay interval has passed since it was last
+// scavenged, so that limits shrink without the background decay thread.
+// Called in slow paths.
+void scavenge_if_due(SmallCache* cache) noexcept {
+  uint64_t now = now_ms();
+  if (now - cache->scavenged_ms >= decay_interval_ms()) scavenge(cache, now);
+}
+
 // Use fallback_cache when thread_cache is unusable
 constinit SmallCache fallback_cache{};
 constinit LowLevelMutex fallback_cache_lock{};
@@ -96,20 +255,25 @@ constinit LowLevelMutex fallback_cache_lock{};
 void* alloc_small_category_with_cache(SmallCache* cache, unsigned cat) {
   ThreadCategory* catp = &cache->category[cat];
   if (Block* free = catp->free) {
-    catp->count_free--;
+    if (--catp->count_free < catp->low_water)
+      catp->low_water = catp->count_free;
     unsigned remaining = --(free->count);
-    Block* p = byte_advance(free, multiply_by_category_size(remaining, cat));
+    Block* p = byte_advance(free, remaining * category_to_size(cat));
     if (remaining == 0) catp->free = free->next;
     return p;
   }
 
+  scavenge_if_due(cache);
   Run* run = (Run*)allocate_page(kPageSize);
   if (false_no_fail(run == nullptr)) return nullptr;
-  unsigned cap = divide_by_category_size(kPageSize, cat) - 1;
+  unsigned cap = category_blocks(cat);
   run->cat = cat;
   run->allocated = cap;
+  cache->stats[cat].allocated += cap;
+  cache->stats[cat].runs++;
+  catp->misses++;
 
-  Block* p = byte_advance((Block*)run, category_to_size(cat));
+  Block* p = byte_advance((Block*)run, category_first_block_offset(cat));
   Block* np = byte_advance(p, category_to_size(cat));
   np->next = nullptr;
   np->count = cap - 1;
@@ -118,31 +282,128 @@ void* alloc_small_category_with_cache(SmallCache* cache, unsigned cat) {
   return p;
 }
 
-void free_small_with_cache(SmallCache* cache, void* ptr) {
-  Block* p = static_cast<Block*>(ptr);
+// Called when the free list reaches its limit.  The limit is doubled if the
+// cache has had to refill from runs since it last overflowed, i.e. the
+// blocks flushed last time would have been reused.
+void adapt_limit(ThreadCategory* catp, unsigned cat) {
+  size_t size = category_to_size(cat);
+  if (catp->limit == 0) {
+    unsigned limit = kInitialCacheBytes / size;
+    if (!reserve_cache_bytes(limit * size)) {
+      limit = kMinCacheBytes / size;
+      charge_cache_bytes(limit * size);
+    }
+    catp->limit = limit;
+  } else if (catp->misses) {
+    unsigned limit = std::min<size_t>(catp->limit * 2, kMaxCacheBytes / size);
+    if (limit > catp->limit &&
+        reserve_cache_bytes((limit - catp->limit) * size))
+      catp->limit = limit;
+  }
+  catp->misses = 0;
+}
 
-  unsigned cat = block2run(p)->cat;
-  if (cat > kMaxCategory) memory_corrupt();
+void free_small_with_cache(SmallCache* cache, void* ptr, unsigned cat) {
+  Block* p = static_cast<Block*>(ptr);
 
-  if (uintptr_t(p) & (category_to_size(cat) - 1)) memory_corrupt();
+  if (!is_category_block_offset(uintptr_t(p) % kPageSize, cat))
+    memory_corrupt();
 
   ThreadCategory* catp = &cache->category[cat];
+  if (catp->count_free >= catp->limit) {
+    scavenge_if_due(cache);
+    if (catp->count_free >= catp->limit) adapt_limit(catp, cat);
+    if (catp->count_free >= catp->limit) {
+      // Flush down to half the limit
+      unsigned n = catp->count_free - catp->limit / 2;
+      CategoryStats* stats = &cache->stats[cat];
+      stats->freed += n;
+      free_small_list(detach_blocks(catp, category_to_size(cat), n), stats);
+    }
+  }
   p->count = 1;
-  if (catp->count_free >= 256) {
-    p->next = nullptr;
-    catp->count_free = 1;
-    free_small_list(std::exchange(catp->free, p));
-  } else {
-    p->next = catp->free;
-    catp->free = p;
-    catp->count_free++;
+  p->next = catp->free;
+  catp->free = p;
+  catp->count_free++;
+}
+
+// Splices blocks off the free list, and carves fresh runs directly when
+// the cache runs short
+size_t alloc_small_batch_with_cache(SmallCache* cache, unsigned cat, size_t n,
+                                    void** out) {
+  ThreadCategory* catp = &cache->category[cat];
+  size_t size = category_to_size(cat);
+  size_t i = 0;
+  while (i < n && catp->free) {
+    Block* free = catp->free;
+    unsigned count = free->count;
+    unsigned take = std::min<size_t>(count, n - i);
+    unsigned remaining = count - take;
+    if (remaining == 0)
+      catp->free = free->next;
+    else
+      free->count = remaining;
+    catp->count_free -= take;
+    for (unsigned k = count; k-- > remaining;)
+      out[i++] = byte_advance(free, k * size);
+  }
+  if (catp->count_free < catp->low_water) catp->low_water = catp->count_free;
+
+  while (i < n) {
+    Run* run = (Run*)allocate_page(kPageSize);
+    if (false_no_fail(run == nullptr)) break;
+    unsigned cap = category_blocks(cat);
+    run->cat = cat;
+    run->allocated = cap;
+    cache->stats[cat].allocated += cap;
+    cache->stats[cat].runs++;
+    catp->misses++;
+
+    Block* p = byte_advance((Block*)run, category_first_block_offset(cat));
+    unsigned take = std::min<size_t>(cap, n - i);
+    for (unsigned k = 0; k < take; ++k) out[i++] = byte_advance(p, k * size);
+    if (take < cap) {
+      // Only happens for the last run, when the free list is empty
+      Block* np = byte_advance(p, take * size);
+      np->next = nullptr;
+      np->count = cap - take;
+      catp->free = np;
+      catp->count_free = cap - take;
+    }
+  }
+  return i;
+}
+
+void free_small_batch_with_cache(SmallCache* cache, void** ptrs, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    void* ptr = ptrs[i];
+    if (is_medium(ptr) || uintptr_t(ptr) % kPageSize == 0) continue;
+    unsigned cat = small_allocated_category(ptr);
+    if (cat > kMaxCategory) {
+      if (cat != kGuardedCategory || !is_guarded(ptr)) memory_corrupt();
+      free_guarded(ptr);
+      continue;
+    }
+    free_small_with_cache(cache, ptr, cat);
   }
 }
 
 void SmallCache::clear() noexcept {
-  for (ThreadCategory& catg : category) {
-    catg.count_free = 0;
-    free_small_list(std::exchange(catg.free, nullptr));
+  for (unsigned cat = 0; cat < kNumCategories; ++cat) {
+    ThreadCategory& catg = category[cat];
+    stats[cat].freed += std::exchange(catg.count_free, 0);
+    catg.low_water = 0;
+    free_small_list(std::exchange(catg.free, nullptr), &stats[cat]);
+  }
+}
+
+void add_stats(Stats* stats, const SmallCache& cache) noexcept {
+  for (unsigned cat = 0; cat < kNumCategories; ++cat) {
+    SizeClassStats& st = stats->small[cat];
+    st.allocated += cache.stats[cat].allocated;
+    st.freed += cache.stats[cat].freed;
+    st.runs += cache.stats[cat].runs;
+    st.cached += cache.category[cat].count_free;
   }
 }
 
@@ -161,18 +422,53 @@ void* alloc_small(size_t size) noexcept {
   return alloc_small_category(size_to_category(size));
 }
 
-void free_small(void* ptr) noexcept {
+void free_small_category(void* ptr, unsigned cat) noexcept {
   if (UniqueCache unique_cache(&small_cache_pool); unique_cache) {
-    free_small_with_cache(unique_cache.get(), ptr);
+    free_small_with_cache(unique_cache.get(), ptr, cat);
   } else {
     std::lock_guard locker(fallback_cache_lock);
-    free_small_with_cache(&fallback_cache, ptr);
+    free_small_with_cache(&fallback_cache, ptr, cat);
   }
 }
 
+void free_small(void* ptr) noexcept {
+  unsigned cat = small_allocated_category(ptr);
+  if (cat > kMaxCategory) {
+    if (cat != kGuardedCategory || !is_guarded(ptr)) memory_corrupt();
+    return free_guarded(ptr);
+  }
+  free_small_category(ptr, cat);
+}
+
 void free_small(void* ptr, size_t size) noexcept {
-  if (size > small_allocated_size(ptr)) memory_corrupt();
-  return free_small(ptr);
+  // Take the category from the size, so that the run header (which may be
+  // cold) is not loaded
+  if (is_guarded(ptr)) return free_guarded(ptr);
+  if (size > kSmallAllocLimit) memory_corrupt();
+  unsigned cat = size_to_category(std::max<size_t>(size, 1));
+#ifdef CBU_ALLOC_CHECK_SIZED_FREE
+  if (small_allocated_category(ptr) != cat) memory_corrupt();
+#endif
+  free_small_category(ptr, cat);
+}
+
+size_t alloc_small_batch(size_t size, size_t n, void** out) noexcept {
+  unsigned cat = size_to_category(size);
+  if (UniqueCache unique_cache(&small_cache_pool); unique_cache) {
+    return alloc_small_batch_with_cache(unique_cache.get(), cat, n, out);
+  } else {
+    std::lock_guard locker(fallback_cache_lock);
+    return alloc_small_batch_with_cache(&fallback_cache, cat, n, out);
+  }
+}
+
+void free_small_batch(void** ptrs, size_t n) noexcept {
+  if (UniqueCache unique_cache(&small_cache_pool); unique_cache) {
+    free_small_batch_with_cache(unique_cache.get(), ptrs, n);
+  } else {
+    std::lock_guard locker(fallback_cache_lock);
+    free_small_batch_with_cache(&fallback_cache, ptrs, n);
+  }
 }
 
 unsigned small_allocated_category(void* ptr) noexcept {
@@ -182,7 +478,12 @@ unsigned small_allocated_category(void* ptr) noexcept {
 }
 
 size_t small_allocated_size(void* ptr) noexcept {
-  return category_to_size(small_allocated_category(ptr));
+  unsigned cat = small_allocated_category(ptr);
+  if (cat > kMaxCategory) {
+    if (cat != kGuardedCategory || !is_guarded(ptr)) memory_corrupt();
+    return guarded_allocated_size(ptr);
+  }
+  return category_to_size(cat);
 }
 
 void small_trim(size_t) noexcept {
@@ -194,5 +495,53 @@ void small_trim(size_t) noexcept {
   }
 }
 
+void small_scavenge(uint64_t now) noexcept {
+  UniqueCache<SmallCache>::visit_all(
+      &small_cache_pool,
+      [now](SmallCache* cache) noexcept { scavenge(cache, now); });
+  {
+    std::lock_guard locker(fallback_cache_lock);
+    scavenge(&fallback_cache, now);
+  }
+}
+
+bool reserve_cache_bytes(size_t bytes) noexcept {
+  size_t cap = cache_bytes_cap.load(std::memory_order_relaxed);
+  size_t cur = cache_bytes_total.load(std::memory_order_relaxed);
+  do {
+    if (cur + bytes > cap) return false;
+  } while (!cache_bytes_total.compare_exchange_weak(
+      cur, cur + bytes, std::memory_order_relaxed, std::memory_order_relaxed));
+  return true;
+}
+
+void charge_cache_bytes(size_t bytes) noexcept {
+  cache_bytes_total.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void unreserve_cache_bytes(size_t bytes) noexcept {
+  cache_bytes_total.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+void set_thread_cache_limit(size_t bytes) noexcept {
+  cache_bytes_cap.store(bytes, std::memory_order_relaxed);
+}
+
+void small_fork(ForkStage stage) noexcept {
+  small_cache_pool.fork(stage);
+  fork_lock(&fallback_cache_lock, stage);
+}
+
+void small_stats(Stats* stats) noexcept {
+  static_assert(kNumCategories == kStatsSmallClasses);
+  for (unsigned cat = 0; cat < kNumCategories; ++cat)
+    stats->small[cat].size = category_to_size(cat);
+  UniqueCache<SmallCache>::visit_all(
+      &small_cache_pool,
+      [stats](SmallCache* cache) noexcept { add_stats(stats, *cache); });
+  std::lock_guard locker(fallback_cache_lock);
+  add_stats(stats, fallback_cache);
+}
+
 }  // namespace alloc
 }  // namespace cbu
@@ -0,0 +1,238 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2021, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "cbu/alloc/alloc.h"
+#include "cbu/alloc/private.h"
+
+namespace cbu {
+namespace alloc {
+namespace {
+
+uint64_t size_class_in_use(const SizeClassStats* classes,
+                           unsigned n) noexcept {
+  uint64_t res = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    const SizeClassStats& st = classes[i];
+    res += (st.allocated - st.freed - st.cached) * st.size;
+  }
+  return res;
+}
+
+// Appends to a fixed buffer like snprintf, counting the full length
+class StatsWriter {
+ public:
+  StatsWriter(char* buf, size_t size) noexcept : buf_(buf), size_(size) {}
+
+  [[gnu::format(printf, 2, 3)]] void print(const char* format, ...) noexcept;
+
+  size_t length() const noexcept { return len_; }
+
+ private:
+  char* const buf_;
+  const size_t size_;
+  size_t len_ = 0;
+};
+
+void StatsWriter::print(const char* format, ...) noexcept {
+  va_list ap;
+  va_start(ap, format);
+  bool fits = len_ < size_;
+  int n = vsnprintf(fits ? buf_ + len_ : nullptr, fits ? size_ - len_ : 0,
+                    format, ap);
+  va_end(ap);
+  if (n > 0) len_ += n;
+}
+
+// Sums over arenas that allow THP (the first half)
+int64_t thp_arena_sum(const Stats& stats,
+                      int64_t ArenaStats::*field) noexcept {
+  int64_t res = 0;
+  for (unsigned i = 0; i < kStatsArenas / 2; ++i) res += stats.arena[i].*field;
+  return std::max<int64_t>(res, 0);
+}
+
+int64_t hugepages_in_use(const Stats& stats) noexcept {
+  return thp_arena_sum(stats, &ArenaStats::hugepages);
+}
+
+int64_t hugepages_full(const Stats& stats) noexcept {
+  return thp_arena_sum(stats, &ArenaStats::hugepages_full);
+}
+
+bool arena_used(const ArenaStats& st) noexcept {
+  return st.allocated || st.dirty || st.clean;
+}
+
+void format_text(const Stats& stats, StatsWriter* w) noexcept {
+  auto size_classes = [w](const char* title, const char* runs,
+                          const SizeClassStats* classes, unsigned n) {
+    w->print("%s:\n%7s %14s %14s %10s %8s %14s\n", title, "size", "allocated",
+             "freed", "cached", runs, "in use");
+    for (unsigned i = 0; i < n; ++i) {
+      const SizeClassStats& st = classes[i];
+      if (st.allocated == 0) continue;
+      w->print("%7" PRIu32 " %14" PRIu64 " %14" PRIu64 " %10" PRIu64
+               " %8" PRIu64 " %14" PRIu64 "\n",
+               st.size, st.allocated, st.freed, st.cached, st.runs,
+               st.allocated - st.freed - st.cached);
+    }
+  };
+  size_classes("Small size classes", "runs", stats.small, kStatsSmallClasses);
+  size_classes("Medium size classes", "chunks", stats.medium,
+               kStatsMediumClasses);
+
+  w->print("Arenas:\n%4s %4s %14s %14s %14s\n", "id", "thp", "allocated",
+           "dirty", "clean");
+  for (unsigned i = 0; i < kStatsArenas; ++i) {
+    const ArenaStats& st = stats.arena[i];
+    if (!arena_used(st)) continue;
+    w->print("%4u %4s %14" PRId64 " %14" PRIu64 " %14" PRIu64 "\n", i,
+             i < kStatsArenas / 2 ? "yes" : "no", st.allocated, st.dirty,
+             st.clean);
+  }
+
+  w->print("Medium region:  %14" PRIu64 " mapped, %" PRIu64 " free\n",
+           stats.medium_mapped, stats.medium_free);
+  w->print("Page cache:     %14" PRIu64 "\n", stats.page_cached);
+  w->print("Large mapped:   %14" PRIu64 "\n", stats.large_mapped);
+  w->print("Arena mapped:   %14" PRIu64 "\n", stats.arena_mapped);
+  w->print("Trie:           %14" PRIu64 "\n", stats.trie);
+  w->print("Metadata:       %14" PRIu64 "\n", stats.metadata);
+  w->print("In use:         %14" PRIu64 " (small %" PRIu64 ", medium %" PRIu64
+           ", large %" PRIu64 ", guarded %" PRIu64 ")\n",
+           stats.in_use(), stats.small_in_use(), stats.medium_in_use(),
+           stats.large_in_use(), stats.guarded);
+  w->print("Mapped:         %14" PRIu64 "\n", stats.mapped());
+  w->print("Hugepages:      %14" PRId64 " in use, %" PRId64
+           " full, coverage %.1f%%\n",
+           hugepages_in_use(stats), hugepages_full(stats),
+           stats.thp_coverage() * 100);
+}
+
+void format_json(const Stats& stats, StatsWriter* w) noexcept {
+  auto size_classes = [w](const char* name, const SizeClassStats* classes,
+                          unsigned n) {
+    w->print("\"%s\":[", name);
+    for (unsigned i = 0; i < n; ++i) {
+      const SizeClassStats& st = classes[i];
+      w->print("%s{\"size\":%" PRIu32 ",\"allocated\":%" PRIu64
+               ",\"freed\":%" PRIu64 ",\"cached\":%" PRIu64
+               ",\"runs\":%" PRIu64 "}",
+               i ? "," : "", st.size, st.allocated, st.freed, st.cached,
+               st.runs);
+    }
+    w->print("],");
+  };
+  w->print("{");
+  size_classes("small", stats.small, kStatsSmallClasses);
+  size_classes("medium", stats.medium, kStatsMediumClasses);
+
+  w->print("\"arenas\":[");
+  bool first = true;
+  for (unsigned i = 0; i < kStatsArenas; ++i) {
+    const ArenaStats& st = stats.arena[i];
+    if (!arena_used(st)) continue;
+    w->print("%s{\"id\":%u,\"thp\":%s,\"allocated\":%" PRId64
+             ",\"dirty\":%" PRIu64 ",\"clean\":%" PRIu64 "}",
+             first ? "" : ",", i, i < kStatsArenas / 2 ? "true" : "false",
+             st.allocated, st.dirty, st.clean);
+    first = false;
+  }
+  w->print("],");
+
+  w->print("\"medium_mapped\":%" PRIu64 ",\"medium_free\":%" PRIu64
+           ",\"page_cached\":%" PRIu64 ",\"large_mapped\":%" PRIu64
+           ",\"arena_mapped\":%" PRIu64 ",\"trie\":%" PRIu64
+           ",\"metadata\":%" PRIu64 ",",
+           stats.medium_mapped, stats.medium_free, stats.page_cached,
+           stats.large_mapped, stats.arena_mapped, stats.trie,
+           stats.metadata);
+  w->print("\"in_use\":{\"small\":%" PRIu64 ",\"medium\":%" PRIu64
+           ",\"large\":%" PRIu64 ",\"guarded\":%" PRIu64 ",\"total\":%" PRIu64
+           "},\"mapped\":%" PRIu64 ",",
+           stats.small_in_use(), stats.medium_in_use(), stats.large_in_use(),
+           stats.guarded, stats.in_use(), stats.mapped());
+  w->print("\"hugepages\":{\"in_use\":%" PRId64 ",\"full\":%" PRId64
+           ",\"coverage\":%.4f}}\n",
+           hugepages_in_use(stats), hugepages_full(stats),
+           stats.thp_coverage());
+}
+
+}  // namespace
+
+uint64_t Stats::small_in_use() const noexcept {
+  return size_class_in_use(small, kStatsSmallClasses);
+}
+
+uint64_t Stats::medium_in_use() const noexcept {
+  return size_class_in_use(medium, kStatsMediumClasses);
+}
+
+uint64_t Stats::large_in_use() const noexcept {
+  // Small runs and cached pages are allocated from arenas too
+  int64_t res = large_mapped - page_cached;
+  for (const ArenaStats& st : arena) res += st.allocated;
+  for (const SizeClassStats& st : small) res -= st.runs * kPageSize;
+  return std::max<int64_t>(res, 0);
+}
+
+double Stats::thp_coverage() const noexcept {
+  int64_t allocated = thp_arena_sum(*this, &ArenaStats::allocated);
+  if (allocated == 0 || kTHPSize == 0) return 0;
+  return std::min(
+      double(hugepages_full(*this)) * kTHPSize / double(allocated), 1.);
+}
+
+void get_stats(Stats* stats) noexcept {
+  memset(stats, 0, sizeof(*stats));
+  small_stats(stats);
+  medium_stats(stats);
+  large_stats(stats);
+  guard_stats(stats);
+}
+
+size_t format_stats(const Stats& stats, char* buf, size_t size,
+                    StatsFormat format) noexcept {
+  StatsWriter w(buf, size);
+  if (format == StatsFormat::JSON)
+    format_json(stats, &w);
+  else
+    format_text(stats, &w);
+  return w.length();
+}
+
+}  // namespace alloc
+}  // namespace cbu
@@ -0,0 +1,217 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2021, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "cbu/alloc/tc.h"
+
+#include <linux/membarrier.h>
+#include <pthread.h>
+
+#include "cbu/alloc/permanent.h"
+
+namespace cbu {
+namespace alloc {
+namespace {
+
+// 0 = unknown; 1 = usable; 2 = unusable
+constinit std::atomic<int> thread_cache_state{0};
+constinit LowLevelMutex registry_lock;
+pthread_key_t thread_key;
+constinit ThreadCachePool* pools[kMaxThreadCachePools];
+constinit uint32_t pool_count = 0;
+
+// 0 = caches not taken yet; 1 = caches taken; 2 = exited
+thread_local uint8_t thread_state = 0;
+
+void thread_exit(void*) noexcept {
+  // Destructors run after this one use the shared caches
+  thread_state = 2;
+  for (uint32_t i = 0; i < kMaxThreadCachePools; ++i) {
+    if (ThreadNode* node = g_thread_nodes[i]) {
+      g_thread_nodes[i] = nullptr;
+      pools[i]->put(node);
+    }
+  }
+}
+
+// Remote users rely on membarrier, so don't use thread caches at all if it's
+// unavailable.  The key is needed to give caches back when threads exit.
+bool thread_cache_usable() noexcept {
+  int state = thread_cache_state.load(std::memory_order_acquire);
+  if (__builtin_expect(state == 0, 0)) {
+    std::lock_guard lock(registry_lock);
+    state = thread_cache_state.load(std::memory_order_relaxed);
+    if (state == 0) {
+      state = (fsys_membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0,
+                               0) == 0 &&
+               pthread_key_create(&thread_key, thread_exit) == 0)
+                  ? 1
+                  : 2;
+      thread_cache_state.store(state, std::memory_order_release);
+    }
+  }
+  return state == 1;
+}
+
+// Makes sure other threads either see our stores, or have their stores seen
+void thread_cache_fence() noexcept {
+  if (fsys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) == 0) return;
+  // Registration is not inherited by child processes
+  if (fsys_membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0 &&
+      fsys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) == 0)
+    return;
+  fatal("membarrier failed\n");
+}
+
+// Arranges for thread_exit to be called when the thread exits
+bool register_thread() noexcept {
+  if (thread_state == 1) return true;
+  if (thread_state == 2) return false;
+  // pthread_setspecific may allocate, and get here again
+  thread_state = 1;
+  if (pthread_setspecific(thread_key, &thread_state) != 0) {
+    thread_state = 2;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+ThreadNode* ThreadCachePool::create() noexcept {
+  if (!thread_cache_usable()) return nullptr;
+
+  uint32_t id = id_.load(std::memory_order_acquire);
+  if (id == 0) {
+    std::lock_guard lock(registry_lock);
+    id = id_.load(std::memory_order_relaxed);
+    if (id == 0) {
+      if (pool_count >= kMaxThreadCachePools) return nullptr;
+      pools[pool_count] = this;
+      id = ++pool_count;
+      id_.store(id, std::memory_order_release);
+    }
+  }
+
+  if (!register_thread()) return nullptr;
+  // If pthread_setspecific allocated, we may already have a node
+  if (ThreadNode* node = g_thread_nodes[id - 1]) return node;
+
+  // The lock may be held by ourselves in visit_all, in which case we use
+  // the shared caches this time
+  if (!lock_.try_lock()) return nullptr;
+  std::lock_guard lock(lock_, std::adopt_lock);
+
+  if (free_ == nullptr) {
+    // Carve a few nodes at a time
+    size_t bytes = pagesize_ceil(size_t(node_size_));
+    char* p = reinterpret_cast<char*>(
+        RawPageAllocator::instance<true, PermaAllocTag>.allocate(bytes));
+    if (p == nullptr) return nullptr;
+    for (size_t n = bytes / node_size_; n; --n, p += node_size_) {
+      construct_(p);
+      ThreadNode* node = static_cast<ThreadNode*>(static_cast<void*>(p));
+      node->next = all_;
+      all_ = node;
+      node->next_free = free_;
+      free_ = node;
+    }
+  }
+
+  // Prefer nodes that last ran on our NUMA node
+  uint32_t numa = numa_nodes() > 1 ? thread_numa_node() : kNoNumaNode;
+  ThreadNode** pnode = &free_;
+  if (numa != kNoNumaNode) {
+    for (ThreadNode** p = &free_; *p; p = &(*p)->next_free) {
+      if ((*p)->numa == numa) {
+        pnode = p;
+        break;
+      }
+    }
+  }
+  ThreadNode* node = *pnode;
+  *pnode = node->next_free;
+  node->next_free = nullptr;
+  node->numa = numa;
+  g_thread_nodes[id - 1] = node;
+  return node;
+}
+
+void ThreadCachePool::put(ThreadNode* node) noexcept {
+  std::lock_guard lock(lock_);
+  node->next_free = free_;
+  free_ = node;
+}
+
+void ThreadCachePool::mark_all_remote() noexcept {
+  for (ThreadNode* node = all_; node; node = node->next)
+    node->remote.store(1, std::memory_order_relaxed);
+  thread_cache_fence();
+}
+
+void ThreadCachePool::wait_idle(ThreadNode* node) noexcept {
+  while (node->busy.load(std::memory_order_acquire)) fsys_sched_yield();
+}
+
+void ThreadCachePool::fork(ForkStage stage) noexcept {
+  switch (stage) {
+    case ForkStage::PREPARE:
+      lock_.lock();
+      if (all_ == nullptr) break;
+      mark_all_remote();
+      for (ThreadNode* node = all_; node; node = node->next) wait_idle(node);
+      break;
+    case ForkStage::PARENT:
+      for (ThreadNode* node = all_; node; node = node->next)
+        node->remote.store(0, std::memory_order_release);
+      lock_.unlock();
+      break;
+    case ForkStage::CHILD: {
+      std::construct_at(&lock_);
+      // Other threads are gone in the child, so their caches are given back
+      uint32_t id = id_.load(std::memory_order_relaxed);
+      ThreadNode* own = id ? g_thread_nodes[id - 1] : nullptr;
+      free_ = nullptr;
+      for (ThreadNode* node = all_; node; node = node->next) {
+        node->remote.store(0, std::memory_order_relaxed);
+        if (node != own) {
+          node->next_free = free_;
+          free_ = node;
+        }
+      }
+      break;
+    }
+  }
+}
+
+void thread_cache_fork(ForkStage stage) noexcept {
+  fork_lock(&registry_lock, stage);
+}
+
+}  // namespace alloc
+}  // namespace cbu
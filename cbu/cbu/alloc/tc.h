@@ -31,10 +31,14 @@
 #include <pthread.h>
 #include <sched.h>
 
+#include <atomic>
 #include <mutex>
+#include <new>
 #include <type_traits>
 
+#include "cbu/alloc/numa.h"
 #include "cbu/alloc/pagesize.h"
+#include "cbu/alloc/percpu.h"
 #include "cbu/alloc/private.h"
 #include "cbu/fsyscall/fsyscall.h"
 #include "cbu/sys/low_level_mutex.h"
@@ -43,48 +47,184 @@
 namespace cbu {
 namespace alloc {
 
-// Try to make each active thread use a fixed cache, so that there is minimal
-// race.
+// Shared caches, used when thread caches can't be.  Try to make each active
+// thread use a fixed one, so that there is minimal race.
 inline thread_local uint32_t g_thread_cache_idx = 0;
 inline std::atomic<uint32_t> g_used_max_concurrency{0};
 
 constexpr uint32_t kHardMaxConcurrency = 128;
 
+// Thread caches
+// Each thread takes an exclusive cache from a pool on first use, and gives
+// it back to the pool when it exits, to be adopted by a new thread.
+// The owner marks its cache busy with plain stores.  Others taking a cache
+// (statistics, trimming, fork) mark it remote first, and use membarrier so
+// that either the owner sees the mark, or they see the owner's busy mark.
+// The owner falls back to the shared caches if its cache is marked remote,
+// or is already busy because a signal handler interrupted it.
+constexpr uint32_t kMaxThreadCachePools = 8;
+
+struct alignas(kCacheLineSize) ThreadNode {
+  std::atomic<uint32_t> busy{0};  // Only written by the owner
+  std::atomic<uint32_t> remote{0};
+  uint32_t numa = kNoNumaNode;  // Node of the thread that last used it
+  ThreadNode* next = nullptr;  // List of all nodes of the pool
+  ThreadNode* next_free = nullptr;  // Nodes of exited threads
+};
+
+inline thread_local ThreadNode* g_thread_nodes[kMaxThreadCachePools] = {};
+
+class ThreadCachePool {
+ public:
+  constexpr ThreadCachePool(uint32_t node_size,
+                            void (*construct)(void*) noexcept) noexcept
+      : node_size_(node_size), construct_(construct) {}
+
+  // Marks the cache of the current thread busy, and returns it; or returns
+  // nullptr if the caller should fall back to the shared caches.
+  ThreadNode* acquire() noexcept {
+    uint32_t id = id_.load(std::memory_order_relaxed);
+    ThreadNode* node = id ? g_thread_nodes[id - 1] : nullptr;
+    if (__builtin_expect(node == nullptr, 0)) {
+      node = create();
+      if (node == nullptr) return nullptr;
+    }
+    if (node->busy.load(std::memory_order_relaxed)) return nullptr;
+    node->busy.store(1, std::memory_order_relaxed);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    if (__builtin_expect(node->remote.load(std::memory_order_acquire), 0)) {
+      release(node);
+      return nullptr;
+    }
+    return node;
+  }
+
+  static void release(ThreadNode* node) noexcept {
+    node->busy.store(0, std::memory_order_release);
+  }
+
+  // Calls callback with every node, including those of exited threads
+  template <typename Callback>
+  void visit_all(Callback callback);
+
+  void fork(ForkStage stage) noexcept;
+
+  // Called when a thread exits
+  void put(ThreadNode* node) noexcept;
+
+ private:
+  ThreadNode* create() noexcept;
+  // Marks all nodes remote.  Their owners may still be busy.
+  void mark_all_remote() noexcept;
+  static void wait_idle(ThreadNode* node) noexcept;
+
+ private:
+  std::atomic<uint32_t> id_{0};  // 1-based index to g_thread_nodes
+  uint32_t node_size_;
+  void (*construct_)(void*) noexcept;
+  LowLevelMutex lock_;
+  ThreadNode* all_ = nullptr;
+  ThreadNode* free_ = nullptr;
+};
+
+template <typename Callback>
+void ThreadCachePool::visit_all(Callback callback) {
+  std::lock_guard lock(lock_);
+  if (all_ == nullptr) return;
+  mark_all_remote();
+  for (ThreadNode* node = all_; node; node = node->next) {
+    wait_idle(node);
+    callback(node);
+    node->remote.store(0, std::memory_order_release);
+  }
+}
+
 template <typename CacheClass>
 struct CachePool {
+  // Used before nodes
+  struct alignas(kCacheLineSize) ThreadCacheNode : ThreadNode {
+    CacheClass cache;
+  };
+  ThreadCachePool threads{sizeof(ThreadCacheNode), [](void* p) noexcept {
+                            new (p) ThreadCacheNode;
+                          }};
+
   struct alignas(kCacheLineSize) Node {
     CacheClass cache;
     LowLevelMutex mutex;
   };
   Node nodes[kHardMaxConcurrency];
+
+#if CBU_ALLOC_PER_CPU
+  // Used before nodes if rseq is available
+  struct alignas(kCacheLineSize) CpuNode {
+    uint32_t owner;
+    std::atomic<bool> used;
+    bool fork_owned;  // Taken by fork(PREPARE)
+    CacheClass cache;
+  };
+  CpuNode cpu_nodes[kMaxPerCpuCaches];
+#endif
+
+  // Takes or releases all caches (see ForkStage)
+  void fork(ForkStage stage) noexcept;
 };
 
+template <typename CacheClass>
+void CachePool<CacheClass>::fork(ForkStage stage) noexcept {
+  if (cbu::tweak::SINGLE_THREADED) return;
+#if CBU_ALLOC_PER_CPU
+  for (uint32_t cpu = 0; cpu < kMaxPerCpuCaches; ++cpu) {
+    CpuNode& node = cpu_nodes[cpu];
+    if (stage == ForkStage::PREPARE) {
+      if (!node.used.load(std::memory_order_relaxed)) continue;
+      // If this fails, the node stays owned in the child, which then never
+      // uses it
+      node.fork_owned = percpu_acquire_remote(&node.owner, cpu);
+    } else if (node.fork_owned) {
+      node.fork_owned = false;
+      percpu_release(&node.owner);
+    }
+  }
+#endif
+  threads.fork(stage);
+  // Take all nodes, including those not used yet
+  for (Node& node : nodes) fork_lock(&node.mutex, stage);
+}
+
 template <typename CacheClass>
 class UniqueCache {
  public:
-  explicit UniqueCache(CachePool<CacheClass>* pool) noexcept
-      : ptr_(grab(pool)) {}
+  explicit UniqueCache(CachePool<CacheClass>* pool) noexcept { grab(pool); }
   ~UniqueCache() noexcept;
 
-  explicit operator bool() const noexcept { return ptr_; }
-  CacheClass* get() const noexcept { return &ptr_->cache; }
-  CacheClass& operator*() const noexcept { return ptr_->cache; }
-  CacheClass* operator->() const noexcept { return &ptr_->cache; }
+  explicit operator bool() const noexcept { return cache_; }
+  CacheClass* get() const noexcept { return cache_; }
+  CacheClass& operator*() const noexcept { return *cache_; }
+  CacheClass* operator->() const noexcept { return cache_; }
 
   template <typename Callback>
   static void visit_all(CachePool<CacheClass>* pool, Callback callback);
 
  private:
-  using Node = typename CachePool<CacheClass>::Node;
-  static Node* grab(CachePool<CacheClass>* pool) noexcept;
+  void grab(CachePool<CacheClass>* pool) noexcept;
 
  private:
-  Node* ptr_;
+  CacheClass* cache_ = nullptr;
+  ThreadNode* thread_node_ = nullptr;
+  LowLevelMutex* mutex_ = nullptr;
+#if CBU_ALLOC_PER_CPU
+  uint32_t* owner_ = nullptr;
+#endif
 };
 
 template <typename CacheClass>
 UniqueCache<CacheClass>::~UniqueCache() noexcept {
-  if (ptr_) ptr_->mutex.unlock();
+#if CBU_ALLOC_PER_CPU
+  if (owner_) percpu_release(owner_);
+#endif
+  if (thread_node_) ThreadCachePool::release(thread_node_);
+  if (mutex_) mutex_->unlock();
 }
 
 template <typename CacheClass>
@@ -92,6 +232,19 @@ template <typename Callback>
 void UniqueCache<CacheClass>::visit_all(CachePool<CacheClass>* pool,
                                         Callback callback) {
   if (cbu::tweak::SINGLE_THREADED) return;
+#if CBU_ALLOC_PER_CPU
+  for (uint32_t cpu = 0; cpu < kMaxPerCpuCaches; ++cpu) {
+    auto& node = pool->cpu_nodes[cpu];
+    if (!node.used.load(std::memory_order_relaxed)) continue;
+    if (!percpu_acquire_remote(&node.owner, cpu)) continue;
+    callback(&node.cache);
+    percpu_release(&node.owner);
+  }
+#endif
+  pool->threads.visit_all([&](ThreadNode* node) {
+    using ThreadCacheNode = typename CachePool<CacheClass>::ThreadCacheNode;
+    callback(&static_cast<ThreadCacheNode*>(node)->cache);
+  });
   uint32_t k = g_used_max_concurrency.load(std::memory_order_relaxed);
   while (k--) {
     std::lock_guard lock(pool->nodes[k].mutex);
@@ -100,25 +253,72 @@ void UniqueCache<CacheClass>::visit_all(CachePool<CacheClass>* pool,
 }
 
 template <typename CacheClass>
-typename UniqueCache<CacheClass>::Node*
-UniqueCache<CacheClass>::grab(CachePool<CacheClass>* pool) noexcept {
-  if (cbu::tweak::SINGLE_THREADED) return nullptr;
+void UniqueCache<CacheClass>::grab(CachePool<CacheClass>* pool) noexcept {
+  if (cbu::tweak::SINGLE_THREADED) return;
+
+#if CBU_ALLOC_PER_CPU
+  using CpuNode = typename CachePool<CacheClass>::CpuNode;
+  uint32_t cpu =
+      percpu_try_acquire(rseq_area(), uintptr_t(&pool->cpu_nodes[0].owner),
+                         sizeof(CpuNode));
+  if (cpu != kNoCpu) {
+    CpuNode* node = &pool->cpu_nodes[cpu];
+    if (!node->used.load(std::memory_order_relaxed))
+      node->used.store(true, std::memory_order_relaxed);
+    owner_ = &node->owner;
+    cache_ = &node->cache;
+    return;
+  }
+#endif
 
+  if (ThreadNode* node = pool->threads.acquire(); node) {
+    using ThreadCacheNode = typename CachePool<CacheClass>::ThreadCacheNode;
+    thread_node_ = node;
+    cache_ = &static_cast<ThreadCacheNode*>(node)->cache;
+    return;
+  }
+
+  // Shared caches
   uint32_t max_concurrency =
       g_used_max_concurrency.load(std::memory_order_relaxed);
   uint32_t k = g_thread_cache_idx;
 
   // Fast path
-  if (k < max_concurrency && pool->nodes[k].mutex.try_lock())
-    return &pool->nodes[k];
+  if (k < max_concurrency && pool->nodes[k].mutex.try_lock()) {
+    mutex_ = &pool->nodes[k].mutex;
+    cache_ = &pool->nodes[k].cache;
+    return;
+  }
 
   // Slow path
+  // On NUMA systems, nodes[k] belongs to node k % numa_nodes(), and slots of
+  // the thread's own node are preferred.
+  uint32_t numa = numa_nodes();
   for (;;) {
-    for (uint32_t remaining = max_concurrency; remaining; --remaining) {
+    if (numa > 1) {
+      for (uint32_t j = thread_numa_node() % numa; j < max_concurrency;
+           j += numa) {
+        if (pool->nodes[j].mutex.try_lock()) {
+          g_thread_cache_idx = j;
+          mutex_ = &pool->nodes[j].mutex;
+          cache_ = &pool->nodes[j].cache;
+          return;
+        }
+      }
+    }
+
+    // Other nodes' slots are only used if no more slots can be added
+    for (uint32_t remaining =
+             (numa == 1 || max_concurrency >= kHardMaxConcurrency)
+                 ? max_concurrency
+                 : 0;
+         remaining; --remaining) {
       if (++k >= max_concurrency) k = 0;
       if (pool->nodes[k].mutex.try_lock()) {
         g_thread_cache_idx = k;
-        return &pool->nodes[k];
+        mutex_ = &pool->nodes[k].mutex;
+        cache_ = &pool->nodes[k].cache;
+        return;
       }
     }
 
@@ -31,6 +31,7 @@
 #include <string.h>
 
 #include <memory>
+#include <mutex>
 
 #include "cbu/alloc/alloc.h"
 #include "cbu/alloc/permanent.h"
@@ -105,6 +106,11 @@ class Trie {
   ValueType* lookup_fail_crash(uintptr_t);
   ValueType* lookup(uintptr_t);
 
+  // Memory used by nodes
+  size_t bytes() const noexcept { return allocator_.bytes(); }
+
+  void fork(ForkStage stage) noexcept { allocator_.fork(stage); }
+
  private:
   SimplePermaAlloc<Node> allocator_ {};
   Node* head_[1 << TopBits] {};
@@ -148,5 +154,82 @@ ValueType* Trie<TotalBits, ValueType>::lookup(uintptr_t v) {
   return &node->tbl[v & ((1 << LeafBits) - 1)];
 }
 
+// Two-level radix tree, which looks up with two dependent loads, where Trie
+// needs one for every 3 bits.  The root is an array in the object itself
+// (untouched parts cost no memory if it's static), and leaves are allocated
+// on demand, without THP, so that only their used pages are populated.
+template <unsigned TotalBits, typename ValueType = uintptr_t,
+          unsigned MaxLeafBits = 17>
+requires (TotalBits <= sizeof(uintptr_t) * 8)
+class PageMap {
+ private:
+  static constexpr unsigned LeafBits =
+      TotalBits < MaxLeafBits ? TotalBits : MaxLeafBits;
+  static constexpr unsigned RootBits = TotalBits - LeafBits;
+  static constexpr size_t LeafBytes =
+      pagesize_ceil(sizeof(ValueType) << LeafBits);
+
+  struct Leaf {
+    ValueType tbl[size_t(1) << LeafBits];
+  };
+
+ public:
+  // The entry must have been created by lookup
+  ValueType* lookup_fail_crash(uintptr_t v) noexcept {
+    assert(v < (uintptr_t(1) << TotalBits));
+    Leaf* leaf = std::atomic_ref<Leaf*>(root_[v >> LeafBits])
+                     .load(std::memory_order_acquire);
+    return &leaf->tbl[v & ((uintptr_t(1) << LeafBits) - 1)];
+  }
+
+  // Creates the entry if necessary; returns nullptr on failure
+  ValueType* lookup(uintptr_t v) noexcept {
+    assert(v < (uintptr_t(1) << TotalBits));
+    Leaf* leaf = std::atomic_ref<Leaf*>(root_[v >> LeafBits])
+                     .load(std::memory_order_acquire);
+    if (false_no_fail(leaf == nullptr)) {
+      leaf = create_leaf(v >> LeafBits);
+      if (false_no_fail(leaf == nullptr)) return nullptr;
+    }
+    return &leaf->tbl[v & ((uintptr_t(1) << LeafBits) - 1)];
+  }
+
+  // Memory reserved for leaves
+  size_t bytes() const noexcept {
+    return leaves_.load(std::memory_order_relaxed) * LeafBytes;
+  }
+
+  void fork(ForkStage stage) noexcept { fork_lock(&lock_, stage); }
+
+ private:
+  Leaf* create_leaf(uintptr_t idx) noexcept;
+
+ private:
+  LowLevelMutex lock_;
+  std::atomic<size_t> leaves_{0};
+  Leaf* root_[size_t(1) << RootBits]{};
+
+  static inline constexpr auto* raw_page_allocator_ =
+      &RawPageAllocator::instance<false, PermaAllocTag>;
+};
+
+template <unsigned TotalBits, typename ValueType, unsigned MaxLeafBits>
+requires (TotalBits <= sizeof(uintptr_t) * 8)
+typename PageMap<TotalBits, ValueType, MaxLeafBits>::Leaf*
+PageMap<TotalBits, ValueType, MaxLeafBits>::create_leaf(
+    uintptr_t idx) noexcept {
+  std::lock_guard locker(lock_);
+  Leaf* leaf = root_[idx];
+  if (leaf == nullptr) {
+    // RawPageAllocator returns zero'd pages
+    leaf = reinterpret_cast<Leaf*>(raw_page_allocator_->allocate(LeafBytes));
+    if (false_no_fail(leaf == nullptr)) return nullptr;
+    leaves_.store(leaves_.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+    std::atomic_ref<Leaf*>(root_[idx]).store(leaf, std::memory_order_release);
+  }
+  return leaf;
+}
+
 }  // namespace alloc
 }  // namespace cbu
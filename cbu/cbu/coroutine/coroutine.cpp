@@ -27,13 +27,23 @@
  */
 
 #include "coroutine.h"
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <atomic>
 #include <exception>
-#include <map>
+#include <iterator>
+#include <system_error>
 #include "cbu/common/byte_size.h"
+#include "cbu/common/heapq.h"
+#include "cbu/coroutine/scheduler.h"
 #include "cbu/coroutine/syscall_hook.h"
 
 namespace cbu {
@@ -41,6 +51,45 @@ namespace coroutine {
 
 __thread CoContainer* active_container = nullptr;
 
+namespace {
+
+constexpr int64_t kNsPerSec = 1000000000;
+
+inline timespec to_timespec(int64_t ns) noexcept {
+  return {time_t(ns / kNsPerSec), long(ns % kNsPerSec)};
+}
+
+// Rounds up, so that we don't wake up early
+inline int to_timeout_ms(int64_t timeout_ns) noexcept {
+  if (timeout_ns < 0)
+    return -1;
+  return std::min<int64_t>((timeout_ns + 999999) / 1000000, INT_MAX);
+}
+
+std::atomic<bool> no_epoll_pwait2{false};
+
+// Sleeps for timeout_ns nanoseconds (-1 means forever)
+int sleep_ns(int64_t timeout_ns) {
+  timespec ts = to_timespec(timeout_ns);
+  return ppoll(nullptr, 0, timeout_ns < 0 ? nullptr : &ts, nullptr);
+}
+
+} // namespace
+
+int EpollWaitNs(int epfd, epoll_event* events, int maxevents,
+                int64_t timeout_ns) {
+  // epoll_pwait2 is Linux 5.11+
+  if (timeout_ns > 0 && !no_epoll_pwait2.load(std::memory_order_relaxed)) {
+    timespec ts = to_timespec(timeout_ns);
+    int ret = syscall(SYS_epoll_pwait2, epfd, events, maxevents, &ts,
+                      nullptr, _NSIG / 8);
+    if (ret >= 0 || errno != ENOSYS)
+      return ret;
+    no_epoll_pwait2.store(true, std::memory_order_relaxed);
+  }
+  return sys_epoll_wait(epfd, events, maxevents, to_timeout_ms(timeout_ns));
+}
+
 void Stack::Allocate(size_t sentinel_size, size_t stack_size) {
   size_t total_size = sentinel_size + stack_size;
 
@@ -49,7 +98,8 @@ void Stack::Allocate(size_t sentinel_size, size_t stack_size) {
       nullptr, total_size,
       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
       -1, 0);
-  if (sentinel_ == nullptr) {
+  if (sentinel_ == MAP_FAILED) {
+    sentinel_ = nullptr;
     throw std::bad_alloc();
   }
   if (sentinel_size) {
@@ -68,13 +118,47 @@ void Stack::Deallocate() noexcept {
   }
 }
 
+void StackPool::Allocate(Stack* stack) {
+  if (!stacks_.empty()) {
+    *stack = std::move(stacks_.back());
+    stacks_.pop_back();
+  } else {
+    stack->Allocate(attr_.stack_sentinel_size, attr_.stack_size);
+  }
+}
+
+void StackPool::Reclaim(Stack* stack) {
+  if (stack->sentinel() == nullptr)
+    return;
+  if (stacks_.size() >= attr_.stack_pool_size) {
+    stack->Deallocate();
+    return;
+  }
+  if (attr_.stack_pool_madvise) {
+    static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t lo = (uintptr_t(stack->lo()) + page_size - 1) & -page_size;
+    uintptr_t hi = (uintptr_t(stack->hi()) & -page_size) - page_size;
+    if (lo < hi)
+      madvise(reinterpret_cast<void*>(lo), hi - lo, MADV_FREE);
+  }
+  stacks_.push_back(std::move(*stack));
+}
+
 CoContainer::CoContainer(Attr attr) : attr_(attr) {
+  if (attr_.use_io_uring)
+    uring_.Init(attr_.io_uring_entries);
+
   // Push scheduler as the 0-th coroutine
   std::unique_ptr<CoRoutine> scheduler(new CoRoutine);
   scheduler->status = Status::RUNNING;
   co_list_.push_back(std::move(scheduler));
 }
 
+CoContainer::~CoContainer() {
+  if (epoll_fd_ >= 0)
+    close(epoll_fd_);
+}
+
 CoId CoContainer::Register(CoFunc func) {
   size_t id = co_list_.size();
   co_list_.push_back(MakeCoRoutine(id, std::move(func)));
@@ -94,7 +178,8 @@ void CoContainer::Run() {
     if (!ready_list_.empty()) {
       run_idx = ready_list_.front();
       ready_list_.pop();
-    } else if (!io_wait_list_.empty()) {
+    } else if (!io_wait_list_.empty() || uring_waiting_ != 0 ||
+               !timers_.empty()) {
       DoPoll();
       // When DoPoll returns, ready_list_ should not be empty
       run_idx = ready_list_.front();
@@ -115,6 +200,7 @@ void CoContainer::Run() {
         co_list_[id]->status = Status::READY;
         ready_list_.push(id);
       }
+      stack_pool_.Reclaim(&coroutine->stack);
       co_list_[run_idx].reset();
     }
   }
@@ -122,98 +208,209 @@ void CoContainer::Run() {
   active_container = nullptr;
 
   co_list_.resize(1);
+  fd_waiters_.clear();
 }
 
-// Poll all io-waiting coroutines, and move io-ready ones to ready list
+// Wait for io-waiting coroutines, and move io-ready ones to ready list
 void CoContainer::DoPoll() {
+  epoll_event events[256];
+  now_valid_ = false;
   for (;;) {
-    std::vector<pollfd> poll_fds;
-
-    std::chrono::steady_clock::time_point expire_time = \
-        IoWaitInfo::kNoExpireTime;
-    for (CoId id: io_wait_list_) {
-      auto* coroutine = co_list_[id].get();
-      auto& io_wait_info = coroutine->io_wait_info;
-      expire_time = std::min(expire_time, io_wait_info.expire_time);
-      poll_fds.insert(poll_fds.end(),
-                      io_wait_info.fds,
-                      io_wait_info.fds + io_wait_info.nfds);
-    }
-
-    int timeout_ms = -1;
-    if (expire_time < IoWaitInfo::kNoExpireTime) {
-      auto now = std::chrono::steady_clock::now();
-      if (now >= expire_time) {
-        timeout_ms = 0;
-      } else {
-        // Plus 999999 nanoseconds so that we round up
-        timeout_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-            expire_time - now + std::chrono::nanoseconds(999999)).count();
-      }
+    int64_t timeout_ns = -1;
+    if (!timers_.empty()) {
+      timeout_ns = std::max<int64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              timers_[0].expire_time - Now()).count(),
+          0);
     }
-    int ret = sys_poll(poll_fds.data(), poll_fds.size(), timeout_ms);
+    int ret;
+    if (uring_)
+      ret = UringPoll(events, std::size(events), timeout_ns);
+    else if (epoll_fd_ >= 0 && !io_wait_list_.empty())
+      ret = EpollWaitNs(epoll_fd_, events, std::size(events), timeout_ns);
+    else
+      ret = sleep_ns(timeout_ns);
+    now_valid_ = false;
     if (ret < 0) {
       // This is not likely, but we need to handle them.
-      for (CoId id: io_wait_list_) {
-        auto* coroutine = co_list_[id].get();
-        coroutine->status = Status::READY;
-        coroutine->io_wait_info.ret = ret;
-        ready_list_.push(id);
-      }
-      io_wait_list_.clear();
-      return;
+      int error = errno;
+      while (!io_wait_list_.empty())
+        WakeIo(*io_wait_list_.begin(), ret, error);
+      ret = 0;
     }
 
-    // Collect returned fd status
-    std::map<int, uint16_t> revents_map;
-    for (auto& item: poll_fds) {
-      if (item.revents != 0) {
-        revents_map[item.fd] |= item.revents;
+    // Check coroutines waiting for the fired fds.  An fd may fire though
+    // none of its waiters is ready (e.g. another coroutine has read the
+    // data), so their own fds are polled again.
+    for (int i = 0; i < ret; ++i) {
+      int fd = events[i].data.fd;
+      if (size_t(fd) >= fd_waiters_.size())
+        continue;
+      auto& waiters = fd_waiters_[fd].waiters;
+      size_t kept = 0;
+      for (size_t k = 0, m = waiters.size(); k < m; ++k) {
+        auto waiter = waiters[k];
+        if (!IsWaiting(waiter))
+          continue;
+        auto& io_wait_info = co_list_[waiter.id]->io_wait_info;
+        int ready_count = sys_poll(io_wait_info.fds, io_wait_info.nfds, 0);
+        if (ready_count != 0)
+          WakeIo(waiter.id, ready_count);
+        else
+          waiters[kept++] = waiter;
       }
-    }
-
-    // Check which coroutines are now ready
-    for (auto it = io_wait_list_.begin(); it != io_wait_list_.end(); ) {
-      CoId id = *it;
-      auto* coroutine = co_list_[id].get();
-      auto& io_wait_info = coroutine->io_wait_info;
-      int ready_count = 0;
-      for (size_t k = 0, m = io_wait_info.nfds; k < m; ++k) {
-        auto& item = io_wait_info.fds[k];
-        auto it_fd = revents_map.find(item.fd);
-        if (it_fd != revents_map.end()) {
-          item.revents = it_fd->second & (
-              item.events | POLLERR | POLLHUP | POLLNVAL);
-          if (item.revents != 0)
-            ++ready_count;
-        } else {
-          item.revents = 0;
+      waiters.resize(kept);
+      if (kept != 0) {
+        if (int error = RearmFd(fd)) {
+          // Don't leave them waiting for an fd that can't be watched
+          for (auto waiter: waiters) {
+            if (!IsWaiting(waiter))
+              continue;
+            auto& io_wait_info = co_list_[waiter.id]->io_wait_info;
+            int ready_count = sys_poll(io_wait_info.fds, io_wait_info.nfds, 0);
+            WakeIo(waiter.id, ready_count != 0 ? ready_count : -1, error);
+          }
+          waiters.clear();
         }
       }
+    }
 
-      bool done = false;
-      if (ready_count != 0) {
-        io_wait_info.ret = ready_count;
-        done = true;
-      } else if (io_wait_info.expire_time < io_wait_info.kNoExpireTime &&
-                 std::chrono::steady_clock::now() >= io_wait_info.expire_time) {
-        io_wait_info.ret = 0;
-        done = true;
-      }
-
-      if (done) {
-        coroutine->status = Status::READY;
-        ready_list_.push(id);
-        it = io_wait_list_.erase(it);
-      } else {
-        ++it;
+    // Wake up sleeping and timed-out coroutines
+    if (!timers_.empty()) {
+      auto now = Now();
+      while (!timers_.empty() && timers_[0].expire_time <= now) {
+        CoId id = timers_[0].id;
+        const CoRoutine* coroutine = co_list_[id].get();
+        const auto& io_wait_info = coroutine->io_wait_info;
+        WakeIo(id, coroutine->status == Status::WAITING_IO ?
+                   sys_poll(io_wait_info.fds, io_wait_info.nfds, 0) : 0);
       }
     }
+
     if (!ready_list_.empty())
       return;
   }
 }
 
+// Wait with io_uring, and move coroutines whose operations are done to
+// ready list.  Returns the number of epoll events, like epoll_wait.
+int CoContainer::UringPoll(epoll_event* events, int maxevents,
+                           int64_t timeout_ns) {
+  constexpr uint64_t kEpollUserData = ~uint64_t(0);
+  if (!io_wait_list_.empty() && epoll_fd_ >= 0 && !epoll_armed_) {
+    if (io_uring_sqe* sqe = uring_.GetSqe()) {
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = epoll_fd_;
+      sqe->poll32_events = POLLIN;
+      sqe->user_data = kEpollUserData;
+      epoll_armed_ = true;
+    } else {
+      // Should be rare; just don't wait
+      timeout_ns = 0;
+    }
+  }
+
+  uring_.SubmitAndWait(timeout_ns);
+
+  // If it couldn't be armed, check it anyway
+  bool epoll_ready = !epoll_armed_ && !io_wait_list_.empty() && epoll_fd_ >= 0;
+  uring_.Reap([&](const io_uring_cqe& cqe) {
+    if (cqe.user_data == kEpollUserData) {
+      epoll_armed_ = false;
+      epoll_ready = true;
+      return;
+    }
+    CoId id = cqe.user_data;
+    auto* coroutine = co_list_[id].get();
+    coroutine->io_wait_info.ret = cqe.res;
+    coroutine->status = Status::READY;
+    ready_list_.push(id);
+    --uring_waiting_;
+  });
+
+  if (!epoll_ready)
+    return 0;
+  return sys_epoll_wait(epoll_fd_, events, maxevents, 0);
+}
+
+int CoContainer::AddFdWaiter(int fd, CoId id, uint32_t seq) {
+  if (epoll_fd_ < 0) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0)
+      throw std::system_error(errno, std::generic_category(), "epoll_create1");
+  }
+  if (size_t(fd) >= fd_waiters_.size())
+    fd_waiters_.resize(fd + 1);
+  auto& waiters = fd_waiters_[fd].waiters;
+  std::erase_if(waiters, [this](const FdWaiters::Waiter& waiter) {
+    return !IsWaiting(waiter);
+  });
+  waiters.push_back({id, seq});
+  return RearmFd(fd);
+}
+
+// Arm the fd for the events its waiters are interested in
+int CoContainer::RearmFd(int fd) {
+  uint32_t interest = 0;
+  for (const auto& waiter: fd_waiters_[fd].waiters) {
+    const auto& io_wait_info = co_list_[waiter.id]->io_wait_info;
+    for (size_t k = 0, m = io_wait_info.nfds; k < m; ++k) {
+      if (io_wait_info.fds[k].fd == fd)
+        interest |= uint16_t(io_wait_info.fds[k].events);
+    }
+  }
+  epoll_event event = {};
+  event.events = interest | EPOLLONESHOT;
+  event.data.fd = fd;
+  // Registrations are removed when fds are closed, so we don't remember them
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &event) == 0)
+    return 0;
+  if (errno == ENOENT && epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) == 0)
+    return 0;
+  return errno;
+}
+
+bool CoContainer::IsWaiting(const FdWaiters::Waiter& waiter) const {
+  if (waiter.id >= co_list_.size())
+    return false;
+  const CoRoutine* coroutine = co_list_[waiter.id].get();
+  return coroutine != nullptr && coroutine->status == Status::WAITING_IO &&
+         coroutine->io_wait_info.seq == waiter.seq;
+}
+
+void CoContainer::WakeIo(CoId id, int ret, int error) {
+  auto* coroutine = co_list_[id].get();
+  auto& io_wait_info = coroutine->io_wait_info;
+  io_wait_info.ret = ret;
+  io_wait_info.error = error;
+  if (io_wait_info.timer_pos != IoWaitInfo::kNoTimer)
+    CancelTimer(id);
+  coroutine->status = Status::READY;
+  ready_list_.push(id);
+  io_wait_list_.erase(id);
+}
+
+std::chrono::steady_clock::time_point CoContainer::Now() {
+  if (!now_valid_) {
+    now_ = std::chrono::steady_clock::now();
+    now_valid_ = true;
+  }
+  return now_;
+}
+
+void CoContainer::AddTimer(std::chrono::steady_clock::time_point expire_time,
+                           CoId id) {
+  timers_.push_back({expire_time, id});
+  co_list_[id]->io_wait_info.timer_pos = timers_.size() - 1;
+  heapq_adjust_tail(timers_, std::less<>(), TimerPositioner());
+}
+
+void CoContainer::CancelTimer(CoId id) {
+  auto& io_wait_info = co_list_[id]->io_wait_info;
+  size_t pos = std::exchange(io_wait_info.timer_pos, IoWaitInfo::kNoTimer);
+  heapq_remove(timers_, pos, std::less<>(), TimerPositioner());
+}
+
 void CoContainer::Yield() {
   SwitchToScheduler(Status::READY);
 }
@@ -221,33 +418,71 @@ void CoContainer::Yield() {
 int CoContainer::Poll(pollfd* fds, nfds_t nfds, int timeout_ms) {
   if (nfds == 0) {
     // Used as sleeping
-    if (timeout_ms <= 0) {
-      // The kernel doesn't reject nfds == 0 && timeout_ms < 0, in which case
-      // poll works pretty much like sigpending.
-      // But we don't support such usage.
-      return 0;
-    }
-  } else {
-    // Do a non-waiting poll first, in case some arguments are invalid, and
-    // in case some fds are already ready.
-    int ret = sys_poll(fds, nfds, 0);
-    if (ret != 0 || timeout_ms == 0)
-      return ret;
+    // The kernel doesn't reject nfds == 0 && timeout_ms < 0, in which case
+    // poll works pretty much like sigpending.
+    // But we don't support such usage.
+    if (timeout_ms > 0)
+      Sleep(std::chrono::milliseconds(timeout_ms));
+    return 0;
   }
 
+  // Do a non-waiting poll first, in case some arguments are invalid, and
+  // in case some fds are already ready.
+  int ret = sys_poll(fds, nfds, 0);
+  if (ret != 0 || timeout_ms == 0)
+    return ret;
+
   // Push coroutine to io-waiting list
   auto* coroutine = co_list_[current_id_].get();
-  coroutine->io_wait_info.fds = fds;
-  coroutine->io_wait_info.nfds = nfds;
-
-  if (timeout_ms < 0) {
-    coroutine->io_wait_info.expire_time = IoWaitInfo::kNoExpireTime;
-  } else {
-    coroutine->io_wait_info.expire_time = std::chrono::steady_clock::now() +
-      std::chrono::milliseconds(timeout_ms);
+  auto& io_wait_info = coroutine->io_wait_info;
+  io_wait_info.fds = fds;
+  io_wait_info.nfds = nfds;
+  ++io_wait_info.seq;
+
+  // Negative fds are ignored, like poll
+  for (nfds_t k = 0; k < nfds; ++k) {
+    if (fds[k].fd < 0)
+      continue;
+    if (int error = AddFdWaiter(fds[k].fd, current_id_, io_wait_info.seq)) {
+      // Fail like poll (e.g. ENOMEM, or ENOSPC if max_user_watches is hit),
+      // rather than wait forever.  Entries already added become stale.
+      ++io_wait_info.seq;
+      errno = error;
+      return -1;
+    }
   }
 
+  if (timeout_ms > 0)
+    AddTimer(std::chrono::steady_clock::now() +
+                 std::chrono::milliseconds(timeout_ms),
+             current_id_);
+
   SwitchToScheduler(Status::WAITING_IO);
+  if (io_wait_info.ret < 0)
+    errno = io_wait_info.error;
+  return io_wait_info.ret;
+}
+
+void CoContainer::Sleep(std::chrono::nanoseconds duration) {
+  if (duration <= std::chrono::nanoseconds::zero())
+    return;
+  AddTimer(std::chrono::steady_clock::now() + duration, current_id_);
+  SwitchToScheduler(Status::SLEEPING);
+}
+
+io_uring_sqe* CoContainer::PrepareUring() {
+  if (!uring_ || current_id_ == 0)
+    return nullptr;
+  io_uring_sqe* sqe = uring_.GetSqe();
+  if (sqe != nullptr)
+    sqe->user_data = current_id_;
+  return sqe;
+}
+
+int CoContainer::WaitUring() {
+  auto* coroutine = co_list_[current_id_].get();
+  ++uring_waiting_;
+  SwitchToScheduler(Status::WAITING_URING);
   return coroutine->io_wait_info.ret;
 }
 
@@ -291,36 +526,90 @@ void CoContainer::SwitchToScheduler(Status new_status) {
 }
 
 void CoContainer::CoRoutineWrapper(CoFunc& func) {
-  try {
-    if (func)
-      func();
-  } catch (const std::exception& e) {
-    fprintf(stderr, "Coroutine throws exception %s: %s\n",
-            typeid(e).name(), e.what());
-    std::terminate();
-  } catch (...) {
-    fprintf(stderr, "Coroutine throws unknown exception\n");
-    std::terminate();
-  }
+  RunCoFunc(func);
   active_container->SwitchToScheduler(Status::DONE);
   __builtin_trap();
 }
 
 std::unique_ptr<CoRoutine> CoContainer::MakeCoRoutine(
     CoId id, CoFunc func) {
+  return NewCoRoutine(id, std::move(func), attr_, &stack_pool_,
+                      &CoRoutineWrapper);
+}
+
+std::unique_ptr<CoRoutine> NewCoRoutine(CoId id, CoFunc func,
+                                        const Attr& attr,
+                                        StackPool* stack_pool,
+                                        void (*wrapper)(CoFunc&)) {
   std::unique_ptr<CoRoutine> coroutine(new CoRoutine);
   coroutine->id = id;
+  RestartCoRoutine(coroutine.get(), std::move(func), attr, stack_pool,
+                   wrapper);
+  return coroutine;
+}
+
+void RestartCoRoutine(CoRoutine* coroutine, CoFunc func, const Attr& attr,
+                      StackPool* stack_pool, void (*wrapper)(CoFunc&)) {
+  if (stack_pool)
+    stack_pool->Allocate(&coroutine->stack);
+  else
+    coroutine->stack.Allocate(attr.stack_sentinel_size, attr.stack_size);
   coroutine->func = std::move(func);
-  coroutine->stack.Allocate(attr_.stack_sentinel_size, attr_.stack_size);
 
   // x86-64 ABI expects stack to be aligned to 16 bytes *before* calling
   // a function, so we subtract by 8.
   coroutine->context.rsp =
     reinterpret_cast<uint64_t>(coroutine->stack.hi()) - 8;
-  coroutine->context.rip = reinterpret_cast<uint64_t>(&CoRoutineWrapper);
+  coroutine->context.rip = reinterpret_cast<uint64_t>(wrapper);
   coroutine->context.startup_context =
     reinterpret_cast<uint64_t>(&coroutine->func);
-  return coroutine;
+}
+
+void Yield() {
+  if (active_container)
+    active_container->Yield();
+  else if (Scheduler* sched = Scheduler::Current())
+    sched->Yield();
+}
+
+CoId Self() {
+  if (active_container)
+    return active_container->Self();
+  if (Scheduler* sched = Scheduler::Current())
+    return sched->Self();
+  return 0;
+}
+
+void Sleep(std::chrono::nanoseconds duration) {
+  if (active_container) {
+    active_container->Sleep(duration);
+  } else if (Scheduler* sched = Scheduler::Current()) {
+    sched->Sleep(duration);
+  } else if (duration > std::chrono::nanoseconds::zero()) {
+    sleep_ns(duration.count());
+  }
+}
+
+bool WaitFor(CoId other_id) {
+  if (active_container)
+    return active_container->WaitFor(other_id);
+  if (Scheduler* sched = Scheduler::Current())
+    return sched->WaitFor(other_id);
+  return false;
+}
+
+void RunCoFunc(CoFunc& func) noexcept {
+  try {
+    if (func)
+      func();
+  } catch (const std::exception& e) {
+    fprintf(stderr, "Coroutine throws exception %s: %s\n",
+            typeid(e).name(), e.what());
+    std::terminate();
+  } catch (...) {
+    fprintf(stderr, "Coroutine throws unknown exception\n");
+    std::terminate();
+  }
 }
 
 } // namespace coroutine
@@ -30,12 +30,15 @@
 
 #include <poll.h>
 #include <stdint.h>
+#include <sys/epoll.h>
 #include <chrono>
 #include <functional>
 #include <memory>
 #include <queue>
 #include <set>
+#include <utility>
 #include <vector>
+#include "cbu/coroutine/uring.h"
 
 namespace cbu {
 namespace coroutine {
@@ -55,7 +58,9 @@ struct Context {
 enum struct Status: unsigned char {
   READY,  // Ready to continue running
   RUNNING,  // Currently running
-  WAITING_IO,  // Waiting for IO
+  WAITING_IO,  // Waiting for IO (poll)
+  SLEEPING,  // Waiting for a timer only
+  WAITING_URING,  // Waiting for an io_uring operation
   WAITING_OTHER,  // Waiting for another coroutine to finish
   DONE,  // Exited
 };
@@ -71,8 +76,19 @@ class Stack {
   Stack() = default;
   Stack(const Stack&) = delete;
   Stack& operator=(const Stack&) = delete;
+  Stack(Stack&& other) noexcept { swap(other); }
+  Stack& operator=(Stack&& other) noexcept {
+    swap(other);
+    return *this;
+  }
   ~Stack() { Deallocate(); }
 
+  void swap(Stack& other) noexcept {
+    std::swap(sentinel_, other.sentinel_);
+    std::swap(lo_, other.lo_);
+    std::swap(hi_, other.hi_);
+  }
+
   void Allocate(size_t sentinel_size, size_t stack_size);
   void Deallocate() noexcept;
 
@@ -87,13 +103,34 @@ class Stack {
 };
 
 struct IoWaitInfo {
-  static constexpr auto kNoExpireTime = \
-      std::chrono::steady_clock::time_point::max();
-  std::chrono::steady_clock::time_point expire_time = kNoExpireTime;
+  static constexpr uint32_t kNoTimer = UINT32_MAX;
+  uint32_t timer_pos = kNoTimer;  // Position in the timer heap
 
   pollfd* fds = nullptr;
   nfds_t nfds = 0;
   int ret = -1;  // Return value of poll
+  int error = 0;  // errno of poll, if ret < 0
+  // Incremented on each wait, so that stale entries in FdWaiters are ignored
+  uint32_t seq = 0;
+};
+
+// Coroutines waiting for an fd.  Entries of coroutines that have since
+// stopped waiting are removed lazily.
+struct FdWaiters {
+  struct Waiter {
+    CoId id;
+    uint32_t seq;
+  };
+  std::vector<Waiter> waiters;
+};
+
+struct Timer {
+  std::chrono::steady_clock::time_point expire_time;
+  CoId id;
+
+  bool operator<(const Timer& other) const noexcept {
+    return expire_time < other.expire_time;
+  }
 };
 
 struct CoRoutine {
@@ -111,11 +148,41 @@ struct CoRoutine {
 struct Attr {
   size_t stack_size = 64 * 1024;
   size_t stack_sentinel_size = 8192;
+  // Submit reads, writes, accept and connect with io_uring (Linux 5.11+).
+  // Falls back to poll if unavailable.
+  bool use_io_uring = false;
+  unsigned io_uring_entries = 256;
+  // Stacks of finished coroutines are kept for reuse, up to this many
+  size_t stack_pool_size = 64;
+  // Free the memory of pooled stacks with MADV_FREE (except the top page),
+  // keeping the mappings.  Saves memory if stacks are deep, but costs a
+  // syscall for each coroutine.
+  bool stack_pool_madvise = false;
+};
+
+// Recycles stacks, with their sentinel pages, so that creating a coroutine
+// doesn't need mmap and mprotect, nor finishing one munmap.
+// Not thread-safe.
+class StackPool {
+ public:
+  explicit StackPool(const Attr& attr) noexcept : attr_(attr) {}
+  StackPool(const StackPool&) = delete;
+  StackPool& operator=(const StackPool&) = delete;
+
+  void Allocate(Stack* stack);
+  void Reclaim(Stack* stack);
+
+ private:
+  const Attr& attr_;
+  std::vector<Stack> stacks_;
 };
 
 class CoContainer {
  public:
   explicit CoContainer(Attr attr = {});
+  CoContainer(const CoContainer&) = delete;
+  CoContainer& operator=(const CoContainer&) = delete;
+  ~CoContainer();
 
   CoId Register(CoFunc func);
 
@@ -126,10 +193,33 @@ class CoContainer {
   // The following cannot be called from the main coroutine
   void Yield();
   int Poll(pollfd* fds, nfds_t nfds, int timeout_ms = -1);
+  void Sleep(std::chrono::nanoseconds duration);
   bool WaitFor(CoId other_id);
 
+  // Returns an entry for an io_uring operation of the current coroutine,
+  // or nullptr if io_uring is not used.  Only user_data is filled.
+  io_uring_sqe* PrepareUring();
+  // Waits for the prepared operation, and returns its result
+  int WaitUring();
+
  private:
   void DoPoll();
+  // The clock is read at most once per wait in DoPoll.  Coroutines may run
+  // long after it, so timers they arm read the clock afresh.
+  std::chrono::steady_clock::time_point Now();
+  void AddTimer(std::chrono::steady_clock::time_point expire_time, CoId id);
+  void CancelTimer(CoId id);
+  auto TimerPositioner() {
+    return [this](const Timer& timer, size_t pos) {
+      co_list_[timer.id]->io_wait_info.timer_pos = pos;
+    };
+  }
+  // These return 0, or an errno value if the fd can't be watched
+  int AddFdWaiter(int fd, CoId id, uint32_t seq);
+  int RearmFd(int fd);
+  bool IsWaiting(const FdWaiters::Waiter& waiter) const;
+  void WakeIo(CoId id, int ret, int error = 0);
+  int UringPoll(epoll_event* events, int maxevents, int64_t timeout_ns);
   std::unique_ptr<CoRoutine> MakeCoRoutine(CoId id, CoFunc func);
   void SwitchToScheduler(Status new_status);
 
@@ -137,29 +227,59 @@ class CoContainer {
 
  private:
   Attr attr_;
+  StackPool stack_pool_{attr_};
   CoId current_id_ = 0;
   std::vector<std::unique_ptr<CoRoutine>> co_list_;
   std::queue<CoId> ready_list_;
   std::set<CoId> io_wait_list_;
+  // Sleeps and waits with a timeout, in a heap by expire time
+  std::vector<Timer> timers_;
+  std::chrono::steady_clock::time_point now_;
+  bool now_valid_ = false;
+  // Waited fds are registered with epoll (EPOLLONESHOT), and rearmed on each
+  // wait, so that only coroutines whose fds fired are checked.  Registrations
+  // aren't kept across waits, because fds may be closed and their numbers
+  // reused without our knowledge (the hooks don't see every close), which
+  // would leave a stale registration that never fires.
+  int epoll_fd_ = -1;
+  std::vector<FdWaiters> fd_waiters_;  // Indexed by fd
+  // If io_uring is used, the scheduler waits with it, with the epoll fd
+  // polled by it (POLL_ADD).
+  Uring uring_;
+  uint32_t uring_waiting_ = 0;  // Coroutines waiting for io_uring
+  bool epoll_armed_ = false;
 };
 
+// Creates a coroutine, which starts by calling wrapper(coroutine->func).
+// wrapper should call RunCoFunc, and then switch away for good.
+// The stack is taken from stack_pool, or allocated if it's nullptr.
+std::unique_ptr<CoRoutine> NewCoRoutine(CoId id, CoFunc func,
+                                        const Attr& attr,
+                                        StackPool* stack_pool,
+                                        void (*wrapper)(CoFunc&));
+// Likewise, but reuses a coroutine that is done, and whose stack has been
+// reclaimed.  The id and status are left to the caller.
+void RestartCoRoutine(CoRoutine* coroutine, CoFunc func, const Attr& attr,
+                      StackPool* stack_pool, void (*wrapper)(CoFunc&));
+// Calls func, terminating on exceptions
+void RunCoFunc(CoFunc& func) noexcept;
+// epoll_wait with a timeout of timeout_ns nanoseconds (-1 means no timeout)
+int EpollWaitNs(int epfd, epoll_event* events, int maxevents,
+                int64_t timeout_ns);
+
 // thread_local generates longer code in non-LTO builds
 extern __thread CoContainer* active_container;
 
 void SwitchContext(CoRoutine* from, const CoRoutine* to) noexcept
   asm("cbu_coroutine_switch_context");
 
-inline void Yield() {
-  active_container->Yield();
-}
-
-inline CoId Self() {
-  return active_container->Self();
-}
-
-inline bool WaitFor(CoId other_id) {
-  return active_container->WaitFor(other_id);
-}
+// The following call the CoContainer or Scheduler running the calling
+// coroutine.  Outside coroutines, Yield does nothing, Self returns 0, Sleep
+// blocks the thread, and WaitFor returns false.
+void Yield();
+CoId Self();
+void Sleep(std::chrono::nanoseconds duration);
+bool WaitFor(CoId other_id);
 
 } // namespace coroutine
 } // namespace cbu
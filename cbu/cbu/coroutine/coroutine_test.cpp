@@ -26,12 +26,21 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <gtest/gtest.h>
+#include <array>
 #include <chrono>
+#include <vector>
 #include "coroutine.h"
 
 namespace cbu {
@@ -92,6 +101,77 @@ TEST(CoRoutineTest, Sleep_Multiple) {
   EXPECT_GT(0.7, seconds);
 }
 
+TEST(CoRoutineTest, Sleep_Microseconds) {
+  CoContainer cont;
+
+  // usleep used to sleep in milliseconds, and block for the remainder
+  for (int i = 0; i < 2; ++i) {
+    cont.Register([&]{
+      for (int j = 0; j < 50; ++j)
+        usleep(300);
+    });
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  cont.Run();
+  auto end = std::chrono::steady_clock::now();
+  auto seconds = std::chrono::duration<double>(end - start).count();
+  EXPECT_LE(0.015, seconds);
+  EXPECT_GT(0.03, seconds);
+}
+
+TEST(CoRoutineTest, Sleep_Order) {
+  CoContainer cont;
+
+  std::vector<int> vec;
+  for (int i = 0; i < 100; ++i) {
+    int ms = (i * 37) % 100 + 1;
+    cont.Register([&, ms]{
+      Sleep(std::chrono::milliseconds(ms));
+      vec.push_back(ms);
+    });
+  }
+  // A poll timeout shorter than the sleeps
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  cont.Register([&]{
+    pollfd pfd = {fds[0], POLLIN, 0};
+    EXPECT_EQ(0, poll(&pfd, 1, 50));
+    vec.push_back(-1);
+  });
+  cont.Run();
+  close(fds[0]);
+  close(fds[1]);
+
+  ASSERT_EQ(101u, vec.size());
+  EXPECT_EQ(-1, vec[50]);
+  vec.erase(vec.begin() + 50);
+  for (int i = 0; i < 100; ++i)
+    EXPECT_EQ(i + 1, vec[i]);
+}
+
+TEST(CoRoutineTest, Sleep_AfterBusy) {
+  CoContainer cont;
+
+  // Timers are armed from the time they're armed, not from when the
+  // coroutine was woken
+  double seconds = 0;
+  cont.Register([&]{
+    usleep(1000);
+    auto busy_end = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(50);
+    while (std::chrono::steady_clock::now() < busy_end) {
+    }
+    auto start = std::chrono::steady_clock::now();
+    usleep(20000);
+    auto end = std::chrono::steady_clock::now();
+    seconds = std::chrono::duration<double>(end - start).count();
+  });
+  cont.Run();
+
+  EXPECT_LE(0.02, seconds);
+}
+
 TEST(CoRoutineTest, PipeTest) {
   int pipefds[2];
   ASSERT_EQ(0, pipe(pipefds));
@@ -120,6 +200,74 @@ TEST(CoRoutineTest, PipeTest) {
   EXPECT_EQ(2554, res);
 }
 
+// An fd number reused for another file after a wait must still be watched
+TEST(CoRoutineTest, ReusedFdTest) {
+  int first[2];
+  int second[2];
+  ASSERT_EQ(0, pipe(first));
+  ASSERT_EQ(0, pipe(second));
+  int res = 0;
+  int discard;
+
+  CoContainer cont;
+
+  cont.Register([&]{
+    discard = read(first[0], &res, sizeof(res));
+    // The read end of the second pipe takes over the number
+    dup2(second[0], first[0]);
+    close(second[0]);
+    discard = read(first[0], &res, sizeof(res));
+  });
+  cont.Register([&] {
+    int r = 1;
+    usleep(10000);
+    discard = write(first[1], &r, sizeof(r));
+    r = 2;
+    usleep(10000);
+    discard = write(second[1], &r, sizeof(r));
+  });
+
+  cont.Run();
+  EXPECT_EQ(2, res);
+  close(first[0]);
+  close(first[1]);
+  close(second[1]);
+}
+
+TEST(CoRoutineTest, UnwatchableFdTest) {
+  // Epoll fds can only be nested so deep, so the container can't watch the
+  // last one
+  int epfds[5];
+  for (int i = 0; i < 5; ++i) {
+    epfds[i] = epoll_create1(EPOLL_CLOEXEC);
+    ASSERT_LE(0, epfds[i]);
+    if (i > 0) {
+      epoll_event event = {};
+      event.events = EPOLLIN;
+      ASSERT_EQ(0, epoll_ctl(epfds[i], EPOLL_CTL_ADD, epfds[i - 1], &event));
+    }
+  }
+  int fd = epfds[4];
+
+  CoContainer cont;
+  int read_errno = 0;
+  int epoll_errno = 0;
+  cont.Register([&] {
+    // The hooks fail instead of making the syscalls, which may block
+    char c;
+    if (read(fd, &c, 1) < 0)
+      read_errno = errno;
+    epoll_event event;
+    if (epoll_wait(fd, &event, 1, -1) < 0)
+      epoll_errno = errno;
+  });
+  cont.Run();
+  EXPECT_EQ(ELOOP, read_errno);
+  EXPECT_EQ(ELOOP, epoll_errno);
+  for (int epfd: epfds)
+    close(epfd);
+}
+
 TEST(CoRoutineTest, EpollTest) {
   int discard;
   int pipefds[2];
@@ -236,5 +384,238 @@ TEST(CoRoutineTest, WaitingTest) {
   EXPECT_EQ(133, d);
 }
 
+Attr IoUringAttr() {
+  Attr attr;
+  attr.use_io_uring = true;
+  return attr;
+}
+
+TEST(CoRoutineTest, IoUringPipeTest) {
+  int pipefds[2];
+  ASSERT_EQ(0, pipe(pipefds));
+  int res = 0;
+  int got = 0;
+  int slept = 0;
+
+  CoContainer cont(IoUringAttr());
+
+  cont.Register([&]{
+    got = read(pipefds[0], &res, sizeof(res));
+    close(pipefds[0]);
+  });
+  cont.Register([&] {
+    usleep(100000);
+    int r = 2554;
+    if (write(pipefds[1], &r, sizeof(r)) == sizeof(r))
+      close(pipefds[1]);
+  });
+  // Poll waiters are served along with io_uring ones
+  cont.Register([&] {
+    pollfd pfd = {pipefds[1], POLLOUT, 0};
+    slept = poll(&pfd, 1, 50) + poll(nullptr, 0, 50);
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  cont.Run();
+  auto end = std::chrono::steady_clock::now();
+  auto seconds = std::chrono::duration<double>(end - start).count();
+  EXPECT_LE(0.1, seconds);
+  EXPECT_GT(0.2, seconds);
+  EXPECT_EQ(int(sizeof(res)), got);
+  EXPECT_EQ(2554, res);
+  EXPECT_EQ(1, slept);
+}
+
+TEST(CoRoutineTest, IoUringSocketTest) {
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  ASSERT_GE(listener, 0);
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  // Abstract socket
+  snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+           "cbu-coroutine-test-%d", int(getpid()));
+  socklen_t addrlen = offsetof(sockaddr_un, sun_path) + 1 +
+      strlen(addr.sun_path + 1);
+  ASSERT_EQ(0, bind(listener, reinterpret_cast<sockaddr*>(&addr), addrlen));
+  ASSERT_EQ(0, listen(listener, 16));
+
+  constexpr int kClients = 10;
+  int sum = 0;
+  int errors = 0;
+
+  CoContainer cont(IoUringAttr());
+  cont.Register([&] {
+    for (int i = 0; i < kClients; ++i) {
+      int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        ++errors;
+        continue;
+      }
+      cont.Register([&, fd] {
+        int x;
+        // An address without its length is rejected, like the syscall
+        sockaddr_un from;
+        if (recvfrom(fd, &x, sizeof(x), 0, reinterpret_cast<sockaddr*>(&from),
+                     nullptr) != -1 || errno != EFAULT)
+          ++errors;
+        if (recv(fd, &x, sizeof(x), 0) == sizeof(x))
+          x *= 2;
+        if (send(fd, &x, sizeof(x), 0) != sizeof(x))
+          ++errors;
+        close(fd);
+      });
+    }
+  });
+  for (int i = 0; i < kClients; ++i) {
+    cont.Register([&, i] {
+      int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (connect(fd, reinterpret_cast<sockaddr*>(&addr), addrlen) != 0) {
+        ++errors;
+        close(fd);
+        return;
+      }
+      int x = i;
+      if (send(fd, &x, sizeof(x), 0) != sizeof(x) ||
+          recv(fd, &x, sizeof(x), 0) != sizeof(x))
+        ++errors;
+      sum += x;
+      close(fd);
+    });
+  }
+  cont.Run();
+  close(listener);
+
+  EXPECT_EQ(0, errors);
+  EXPECT_EQ(kClients * (kClients - 1), sum);
+}
+
+// Benchmark: 100 active sockets ping-ponging among 10k idle ones
+TEST(CoRoutineTest, ManyIdleSockets) {
+  constexpr int kIdlePairs = 5000;
+  constexpr int kActivePairs = 50;
+  constexpr int kRounds = 1000;
+
+  rlimit rl;
+  ASSERT_EQ(0, getrlimit(RLIMIT_NOFILE, &rl));
+  rlim_t needed = (kIdlePairs + kActivePairs) * 2 + 64;
+  if (rl.rlim_cur < needed) {
+    if (rl.rlim_max < needed)
+      GTEST_SKIP() << "RLIMIT_NOFILE too low";
+    rl.rlim_cur = needed;
+    ASSERT_EQ(0, setrlimit(RLIMIT_NOFILE, &rl));
+  }
+
+  std::vector<std::array<int, 2>> idle(kIdlePairs);
+  std::vector<std::array<int, 2>> active(kActivePairs);
+  for (auto& fds: idle)
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+                            fds.data()));
+  for (auto& fds: active)
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+                            fds.data()));
+
+  CoContainer cont;
+  int woken = 0;
+  for (auto& fds: idle) {
+    for (int fd: fds) {
+      cont.Register([&, fd] {
+        pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, -1) == 1 && pfd.revents == POLLIN)
+          ++woken;
+      });
+    }
+  }
+
+  int done = 0;
+  std::vector<CoId> pingers;
+  for (auto& fds: active) {
+    pingers.push_back(cont.Register([&, fd = fds[0]] {
+      char c = 0;
+      for (int i = 0; i < kRounds; ++i) {
+        if (write(fd, &c, 1) != 1 || read(fd, &c, 1) != 1)
+          return;
+      }
+      ++done;
+    }));
+    cont.Register([&, fd = fds[1]] {
+      char c;
+      for (int i = 0; i < kRounds; ++i) {
+        if (read(fd, &c, 1) != 1 || write(fd, &c, 1) != 1)
+          return;
+      }
+    });
+  }
+
+  // Wake up the idle coroutines when done
+  cont.Register([&] {
+    for (CoId id: pingers)
+      WaitFor(id);
+    char c = 0;
+    for (auto& fds: idle) {
+      for (int fd: fds)
+        ASSERT_EQ(1, write(fd, &c, 1));
+    }
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  cont.Run();
+  auto end = std::chrono::steady_clock::now();
+  printf("%d idle, %d active sockets, %d rounds: %.3fs\n",
+         kIdlePairs * 2, kActivePairs * 2, kRounds,
+         std::chrono::duration<double>(end - start).count());
+
+  EXPECT_EQ(kActivePairs, done);
+  EXPECT_EQ(kIdlePairs * 2, woken);
+
+  for (auto& fds: idle) {
+    close(fds[0]);
+    close(fds[1]);
+  }
+  for (auto& fds: active) {
+    close(fds[0]);
+    close(fds[1]);
+  }
+}
+
+TEST(CoRoutineTest, SpawnRate) {
+  constexpr int kCount = 100000;
+
+  // Without the pool, then with it, with and without MADV_FREE
+  struct Config {
+    size_t pool_size;
+    bool madvise;
+    const char* name;
+  };
+  for (const Config& config: {Config{0, false, " (unpooled)"},
+                              Config{64, false, ""},
+                              Config{64, true, " (MADV_FREE)"}}) {
+    int done = 0;
+    Attr attr;
+    attr.stack_pool_size = config.pool_size;
+    attr.stack_pool_madvise = config.madvise;
+    CoContainer cont(attr);
+    cont.Register([&] {
+      for (int i = 0; i < kCount; ++i) {
+        cont.Register([&] {
+          // Touch some stack
+          char buf[4096];
+          memset(buf, i, sizeof(buf));
+          asm volatile("" : : "r"(buf) : "memory");
+          ++done;
+        });
+        Yield();
+      }
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    cont.Run();
+    auto end = std::chrono::steady_clock::now();
+    printf("%d coroutines%s: %.3g spawns/s\n", kCount, config.name,
+           kCount / std::chrono::duration<double>(end - start).count());
+
+    EXPECT_EQ(kCount, done);
+  }
+}
+
 } // namespace coroutine
 } // namespace cbu
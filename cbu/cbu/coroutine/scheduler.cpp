@@ -0,0 +1,748 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2022, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "scheduler.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include "cbu/common/heapq.h"
+#include "cbu/coroutine/syscall_hook.h"
+
+namespace cbu {
+namespace coroutine {
+
+bool RunQueue::Push(CoRoutine* coroutine) noexcept {
+  uint64_t bottom = bottom_.load(std::memory_order_relaxed);
+  uint64_t top = top_.load(std::memory_order_acquire);
+  if (bottom - top >= kCapacity)
+    return false;
+  buffer_[bottom % kCapacity].store(coroutine, std::memory_order_relaxed);
+  bottom_.store(bottom + 1, std::memory_order_release);
+  return true;
+}
+
+CoRoutine* RunQueue::Take() noexcept {
+  uint64_t top = top_.load(std::memory_order_acquire);
+  uint64_t bottom = bottom_.load(std::memory_order_acquire);
+  if (top >= bottom)
+    return nullptr;
+  // If the slot has since been reused, top has moved, and CAS fails
+  CoRoutine* coroutine =
+      buffer_[top % kCapacity].load(std::memory_order_relaxed);
+  if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_acq_rel,
+                                    std::memory_order_relaxed))
+    return nullptr;
+  return coroutine;
+}
+
+struct Scheduler::Worker {
+  Worker(Scheduler* s, unsigned i)
+      : scheduler(s), index(i), stacks(s->attr_) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+      throw std::system_error(errno, std::generic_category(), "epoll_create1");
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd < 0) {
+      int error = errno;
+      close(epoll_fd);
+      throw std::system_error(error, std::generic_category(), "eventfd");
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = wake_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) != 0) {
+      int error = errno;
+      close(wake_fd);
+      close(epoll_fd);
+      throw std::system_error(error, std::generic_category(), "epoll_ctl");
+    }
+  }
+  ~Worker() {
+    close(wake_fd);
+    close(epoll_fd);
+  }
+
+  Scheduler* scheduler;
+  unsigned index;
+  unsigned tick = 0;
+  CoRoutine sched;  // Context of WorkerLoop
+  CoRoutine* current = nullptr;
+  After after = After::YIELD;
+  CoId wait_target = 0;
+  RunQueue queue;
+  // Stacks are reused by coroutines registered by this worker
+  StackPool stacks;
+
+  // Coroutines that started waiting for IO or timers on this worker are
+  // woken by it, like in CoContainer (EPOLLONESHOT, rearmed on each wait)
+  int epoll_fd;
+  int wake_fd;  // eventfd in epoll_fd, written to wake the worker
+  std::atomic<bool> polling{false};  // Parked in epoll_wait
+  size_t suspended = 0;  // Coroutines waiting for IO or timers
+  std::vector<Timer> timers;
+  std::vector<FdWaiters> fd_waiters;  // Indexed by fd
+};
+
+__thread Scheduler::Worker* Scheduler::active_worker_ = nullptr;
+
+Scheduler::Scheduler(unsigned threads, Attr attr) : attr_(attr) {
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned i = 0; i < threads; ++i) {
+    std::unique_ptr<Worker> worker(new Worker(this, i));
+    workers_.push_back(std::move(worker));
+  }
+}
+
+Scheduler::~Scheduler() {
+  Clear();
+}
+
+CoId Scheduler::Register(CoFunc func) {
+  Worker* worker = CurrentWorker();
+  if (worker != nullptr && worker->scheduler != this)
+    worker = nullptr;
+  StackPool* stack_pool = worker ? &worker->stacks : nullptr;
+
+  CoRoutine* coroutine = nullptr;
+  CoId id;
+  {
+    std::lock_guard lock(wait_lock_);
+    if (!free_slots_.empty()) {
+      coroutine = GetSlot(free_slots_.front());
+      free_slots_.pop_front();
+      // Wraps around within the high bits
+      id = coroutine->id + (CoId(1) << kSlotBits);
+      std::atomic_ref(coroutine->id).store(id, std::memory_order_relaxed);
+    }
+  }
+
+  if (coroutine != nullptr) {
+    try {
+      RestartCoRoutine(coroutine, std::move(func), attr_, stack_pool,
+                       &CoRoutineWrapper);
+    } catch (...) {
+      std::lock_guard lock(wait_lock_);
+      free_slots_.push_front(id & kSlotMask);
+      throw;
+    }
+    std::atomic_ref(coroutine->status).store(Status::READY,
+                                             std::memory_order_relaxed);
+  } else {
+    uint32_t slot = next_slot_.fetch_add(1, std::memory_order_relaxed);
+    uint32_t chunk_idx = slot >> kChunkBits;
+    if (chunk_idx >= kMaxChunks)
+      throw std::length_error("Too many coroutines");
+    auto* chunk = chunks_[chunk_idx].load(std::memory_order_acquire);
+    if (chunk == nullptr) {
+      std::lock_guard lock(register_lock_);
+      chunk = chunks_[chunk_idx].load(std::memory_order_relaxed);
+      if (chunk == nullptr) {
+        chunk = new std::atomic<CoRoutine*>[size_t(1) << kChunkBits]();
+        chunks_[chunk_idx].store(chunk, std::memory_order_release);
+      }
+    }
+    id = slot;
+    coroutine = NewCoRoutine(id, std::move(func), attr_, stack_pool,
+                             &CoRoutineWrapper).release();
+    chunk[slot & ((1u << kChunkBits) - 1)].store(coroutine,
+                                                 std::memory_order_release);
+  }
+  live_.fetch_add(1, std::memory_order_relaxed);
+
+  if (worker != nullptr)
+    Push(worker, coroutine);
+  else
+    Inject(coroutine);
+  return id;
+}
+
+void Scheduler::Run() {
+  if (live_.load(std::memory_order_acquire) == 0)
+    return;
+  {
+    std::lock_guard lock(park_lock_);
+    done_ = false;
+  }
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < workers_.size(); ++i)
+    threads.emplace_back(&Scheduler::WorkerLoop, this, workers_[i].get());
+  WorkerLoop(workers_[0].get());
+  for (auto& thread: threads)
+    thread.join();
+
+  Clear();
+}
+
+Scheduler* Scheduler::Current() noexcept {
+  Worker* worker = CurrentWorker();
+  return worker && worker->current ? worker->scheduler : nullptr;
+}
+
+CoId Scheduler::Self() const {
+  return CurrentWorker()->current->id;
+}
+
+void Scheduler::Yield() {
+  SwitchToScheduler(After::YIELD);
+}
+
+int Scheduler::Poll(pollfd* fds, nfds_t nfds, int timeout_ms) {
+  if (nfds == 0) {
+    // Used as sleeping, like CoContainer::Poll
+    if (timeout_ms > 0)
+      Sleep(std::chrono::milliseconds(timeout_ms));
+    return 0;
+  }
+
+  int ret = sys_poll(fds, nfds, 0);
+  if (ret != 0 || timeout_ms == 0)
+    return ret;
+
+  // Registered with this worker before switching away.  That's safe, since
+  // only this worker wakes the coroutine, after the switch.
+  Worker* worker = CurrentWorker();
+  CoRoutine* self = worker->current;
+  auto& io_wait_info = self->io_wait_info;
+  io_wait_info.fds = fds;
+  io_wait_info.nfds = nfds;
+  // Other workers may check seq of their stale waiters
+  std::atomic_ref seq(io_wait_info.seq);
+  seq.store(seq.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+  // Released with seq, for IsWaiting
+  std::atomic_ref(self->status).store(Status::WAITING_IO,
+                                      std::memory_order_release);
+
+  for (nfds_t k = 0; k < nfds; ++k) {
+    if (fds[k].fd < 0)
+      continue;
+    if (int error = AddFdWaiter(worker, fds[k].fd, self)) {
+      // Fail like poll, rather than wait forever
+      seq.store(seq.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+      std::atomic_ref(self->status).store(Status::RUNNING,
+                                          std::memory_order_relaxed);
+      errno = error;
+      return -1;
+    }
+  }
+  if (timeout_ms > 0) {
+    AddTimer(worker,
+             std::chrono::steady_clock::now() +
+                 std::chrono::milliseconds(timeout_ms),
+             self);
+  }
+  ++worker->suspended;
+
+  SwitchToScheduler(After::SUSPEND);
+  // We may be on another thread now
+  if (io_wait_info.ret < 0)
+    SetErrno(io_wait_info.error);
+  return io_wait_info.ret;
+}
+
+void Scheduler::Sleep(std::chrono::nanoseconds duration) {
+  if (duration <= std::chrono::nanoseconds::zero())
+    return;
+  Worker* worker = CurrentWorker();
+  CoRoutine* self = worker->current;
+  std::atomic_ref(self->status).store(Status::SLEEPING,
+                                      std::memory_order_relaxed);
+  AddTimer(worker, std::chrono::steady_clock::now() + duration, self);
+  ++worker->suspended;
+  SwitchToScheduler(After::SUSPEND);
+}
+
+bool Scheduler::WaitFor(CoId other_id) {
+  Worker* worker = CurrentWorker();
+  if (worker == nullptr || worker->scheduler != this)
+    return false;
+  CoRoutine* self = worker->current;
+  uint32_t slot = other_id & kSlotMask;
+  if (slot == 0 || other_id == self->id ||
+      slot >= next_slot_.load(std::memory_order_relaxed))
+    return false;
+
+  {
+    std::lock_guard lock(wait_lock_);
+    // If its slot has been reused, it's done
+    CoRoutine* other = Get(other_id);
+    if (other == nullptr ||
+        std::atomic_ref(other->status).load(std::memory_order_relaxed) ==
+            Status::DONE)
+      return true;
+    // Any circles?
+    for (CoRoutine* coroutine = other;
+         coroutine != nullptr &&
+         std::atomic_ref(coroutine->status).load(std::memory_order_relaxed) ==
+             Status::WAITING_OTHER; ) {
+      if (coroutine->waiting_for == self->id)
+        return false;
+      coroutine = Get(coroutine->waiting_for);
+    }
+    self->waiting_for = other_id;
+    std::atomic_ref(self->status).store(Status::WAITING_OTHER,
+                                        std::memory_order_relaxed);
+  }
+  // We're added to other->waited_by only after switching away, lest we be
+  // resumed by another worker before our context is saved
+  worker->wait_target = other_id;
+  SwitchToScheduler(After::WAIT);
+  return true;
+}
+
+CoRoutine* Scheduler::GetSlot(uint32_t slot) const noexcept {
+  auto* chunk = chunks_[slot >> kChunkBits].load(std::memory_order_acquire);
+  if (chunk == nullptr)
+    return nullptr;
+  return chunk[slot & ((1u << kChunkBits) - 1)].load(
+      std::memory_order_acquire);
+}
+
+CoRoutine* Scheduler::Get(CoId id) const noexcept {
+  CoRoutine* coroutine = GetSlot(id & kSlotMask);
+  if (coroutine == nullptr ||
+      std::atomic_ref(coroutine->id).load(std::memory_order_relaxed) != id)
+    return nullptr;
+  return coroutine;
+}
+
+void Scheduler::Push(Worker* worker, CoRoutine* coroutine) {
+  if (!worker->queue.Push(coroutine)) {
+    Inject(coroutine);
+    return;
+  }
+  Notify();
+}
+
+void Scheduler::Inject(CoRoutine* coroutine) {
+  {
+    std::lock_guard lock(inject_lock_);
+    inject_.push_back(coroutine);
+    inject_empty_.store(false, std::memory_order_relaxed);
+  }
+  Notify();
+}
+
+// Wakes a parked worker, if any.  Pairs with Park.
+void Scheduler::Notify() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleepers_.load(std::memory_order_relaxed) == 0)
+    return;
+  bool cv_sleeping;
+  {
+    std::lock_guard lock(park_lock_);
+    ++wakeups_;
+    cv_sleeping = (cv_sleepers_ != 0);
+  }
+  if (cv_sleeping) {
+    park_cv_.notify_one();
+    return;
+  }
+  // Those sleeping in epoll_wait (except ourselves, waking our own waiters)
+  Worker* self = CurrentWorker();
+  for (auto& worker: workers_) {
+    if (worker.get() != self &&
+        worker->polling.load(std::memory_order_relaxed)) {
+      uint64_t one = 1;
+      ssize_t discard [[maybe_unused]] =
+          sys_write(worker->wake_fd, &one, sizeof(one));
+      return;
+    }
+  }
+}
+
+CoRoutine* Scheduler::FindWork(Worker* worker) {
+  // Check injected coroutines and IO once in a while, even if we're busy
+  if (++worker->tick % 61 == 0) {
+    if (worker->suspended != 0)
+      PollIo(worker, 0);
+    if (CoRoutine* coroutine = TakeInjected())
+      return coroutine;
+  }
+  if (CoRoutine* coroutine = worker->queue.TakeUntilEmpty())
+    return coroutine;
+  if (CoRoutine* coroutine = TakeInjected())
+    return coroutine;
+  // Our own waiters come before the others' work
+  if (worker->suspended != 0 && PollIo(worker, 0)) {
+    if (CoRoutine* coroutine = worker->queue.TakeUntilEmpty())
+      return coroutine;
+  }
+
+  // Steal from the others
+  size_t n = workers_.size();
+  for (size_t k = 1; k < n; ++k) {
+    RunQueue& queue = workers_[(worker->index + k) % n]->queue;
+    if (CoRoutine* coroutine = queue.TakeUntilEmpty())
+      return coroutine;
+  }
+  return nullptr;
+}
+
+CoRoutine* Scheduler::TakeInjected() {
+  if (inject_empty_.load(std::memory_order_acquire))
+    return nullptr;
+  std::lock_guard lock(inject_lock_);
+  if (inject_.empty())
+    return nullptr;
+  CoRoutine* coroutine = inject_.front();
+  inject_.pop_front();
+  if (inject_.empty())
+    inject_empty_.store(true, std::memory_order_relaxed);
+  return coroutine;
+}
+
+bool Scheduler::HasWork() {
+  if (!inject_empty_.load(std::memory_order_acquire))
+    return true;
+  for (auto& worker: workers_) {
+    if (!worker->queue.Empty())
+      return true;
+  }
+  return false;
+}
+
+void Scheduler::Park(Worker* worker) {
+  if (worker->suspended != 0) {
+    // Wait for our own waiters too.  Run can't be done before they are.
+    worker->polling.store(true, std::memory_order_relaxed);
+    sleepers_.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t timeout_ns = -1;
+    if (!worker->timers.empty()) {
+      timeout_ns = std::max<int64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              worker->timers[0].expire_time -
+              std::chrono::steady_clock::now()).count(),
+          0);
+    }
+    PollIo(worker, HasWork() ? 0 : timeout_ns);
+    sleepers_.fetch_sub(1, std::memory_order_relaxed);
+    worker->polling.store(false, std::memory_order_relaxed);
+    return;
+  }
+
+  std::unique_lock lock(park_lock_);
+  uint64_t seen = wakeups_;
+  ++cv_sleepers_;
+  sleepers_.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!done_ && !HasWork())
+    park_cv_.wait(lock, [&] { return wakeups_ != seen || done_; });
+  sleepers_.fetch_sub(1, std::memory_order_relaxed);
+  --cv_sleepers_;
+}
+
+void Scheduler::WorkerLoop(Worker* worker) {
+  active_worker_ = worker;
+
+  for (;;) {
+    CoRoutine* coroutine = FindWork(worker);
+    if (coroutine == nullptr) {
+      if (live_.load(std::memory_order_acquire) == 0)
+        break;
+      Park(worker);
+      continue;
+    }
+
+    std::atomic_ref(coroutine->status).store(Status::RUNNING,
+                                             std::memory_order_relaxed);
+    worker->current = coroutine;
+    SwitchContext(&worker->sched, coroutine);
+    worker->current = nullptr;
+
+    switch (worker->after) {
+      case After::YIELD:
+        std::atomic_ref(coroutine->status).store(Status::READY,
+                                                 std::memory_order_relaxed);
+        Push(worker, coroutine);
+        break;
+      case After::WAIT: {
+        bool ready;
+        {
+          std::lock_guard lock(wait_lock_);
+          // Done, and maybe already reused, while we were switching
+          CoRoutine* other = Get(worker->wait_target);
+          ready = other == nullptr ||
+                  std::atomic_ref(other->status).load(
+                      std::memory_order_relaxed) == Status::DONE;
+          if (!ready)
+            other->waited_by.push_back(coroutine->id);
+        }
+        if (ready) {
+          std::atomic_ref(coroutine->status).store(Status::READY,
+                                                   std::memory_order_relaxed);
+          Push(worker, coroutine);
+        }
+        break;
+      }
+      case After::SUSPEND:
+        // Already registered with this worker, which wakes it
+        break;
+      case After::DONE:
+        Finish(worker, coroutine);
+        break;
+    }
+  }
+
+  active_worker_ = nullptr;
+}
+
+void Scheduler::SwitchToScheduler(After after) {
+  Worker* worker = CurrentWorker();
+  worker->after = after;
+  SwitchContext(worker->current, &worker->sched);
+}
+
+void Scheduler::Finish(Worker* worker, CoRoutine* coroutine) {
+  worker->stacks.Reclaim(&coroutine->stack);
+  coroutine->func = nullptr;
+  std::vector<CoId> waited_by;
+  {
+    std::lock_guard lock(wait_lock_);
+    std::atomic_ref(coroutine->status).store(Status::DONE,
+                                             std::memory_order_relaxed);
+    waited_by.swap(coroutine->waited_by);
+    // May be reused by Register as soon as the lock is released
+    free_slots_.push_back(coroutine->id & kSlotMask);
+  }
+  for (CoId id: waited_by) {
+    CoRoutine* waiter = Get(id);
+    std::atomic_ref(waiter->status).store(Status::READY,
+                                          std::memory_order_relaxed);
+    Push(worker, waiter);
+  }
+
+  if (live_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    {
+      std::lock_guard lock(park_lock_);
+      done_ = true;
+    }
+    park_cv_.notify_all();
+  }
+}
+
+void Scheduler::Clear() noexcept {
+  uint32_t n = next_slot_.exchange(1, std::memory_order_relaxed);
+  for (uint32_t i = 0; i < kMaxChunks && (i << kChunkBits) < n; ++i) {
+    auto* chunk = chunks_[i].exchange(nullptr, std::memory_order_relaxed);
+    if (chunk == nullptr)
+      continue;
+    for (size_t k = 0; k < (size_t(1) << kChunkBits); ++k)
+      delete chunk[k].load(std::memory_order_relaxed);
+    delete[] chunk;
+  }
+  free_slots_.clear();
+  live_.store(0, std::memory_order_relaxed);
+  // Ids are reused in the next run
+  for (auto& worker: workers_) {
+    worker->fd_waiters.clear();
+    worker->timers.clear();
+    worker->suspended = 0;
+  }
+  inject_.clear();
+  inject_empty_.store(true, std::memory_order_relaxed);
+}
+
+void Scheduler::AddTimer(Worker* worker,
+                         std::chrono::steady_clock::time_point expire_time,
+                         CoRoutine* coroutine) {
+  worker->timers.push_back({expire_time, coroutine->id});
+  coroutine->io_wait_info.timer_pos = worker->timers.size() - 1;
+  heapq_adjust_tail(worker->timers, std::less<>(), TimerPositioner());
+}
+
+void Scheduler::CancelTimer(Worker* worker, CoRoutine* coroutine) {
+  size_t pos = std::exchange(coroutine->io_wait_info.timer_pos,
+                             IoWaitInfo::kNoTimer);
+  heapq_remove(worker->timers, pos, std::less<>(), TimerPositioner());
+}
+
+int Scheduler::AddFdWaiter(Worker* worker, int fd, CoRoutine* coroutine) {
+  if (size_t(fd) >= worker->fd_waiters.size())
+    worker->fd_waiters.resize(fd + 1);
+  auto& waiters = worker->fd_waiters[fd].waiters;
+  std::erase_if(waiters, [this](const FdWaiters::Waiter& waiter) {
+    return !IsWaiting(waiter);
+  });
+  waiters.push_back({coroutine->id, coroutine->io_wait_info.seq});
+  return RearmFd(worker, fd);
+}
+
+// Arm the fd for the events its waiters are interested in
+int Scheduler::RearmFd(Worker* worker, int fd) {
+  uint32_t interest = 0;
+  for (const auto& waiter: worker->fd_waiters[fd].waiters) {
+    const auto& io_wait_info = Get(waiter.id)->io_wait_info;
+    for (size_t k = 0, m = io_wait_info.nfds; k < m; ++k) {
+      if (io_wait_info.fds[k].fd == fd)
+        interest |= uint16_t(io_wait_info.fds[k].events);
+    }
+  }
+  epoll_event event = {};
+  event.events = interest | EPOLLONESHOT;
+  event.data.fd = fd;
+  if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0)
+    return 0;
+  if (errno == ENOENT &&
+      epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0)
+    return 0;
+  return errno;
+}
+
+// A coroutine waits on one worker at a time, and seq grows with each wait,
+// so a matching seq means it's waiting on the worker checking it.  Entries
+// left by a coroutine that is done fail Get once its slot is reused, and seq
+// isn't reset on reuse anyway.
+bool Scheduler::IsWaiting(const FdWaiters::Waiter& waiter) const {
+  CoRoutine* coroutine = Get(waiter.id);
+  return coroutine != nullptr &&
+         std::atomic_ref(coroutine->status).load(std::memory_order_acquire) ==
+             Status::WAITING_IO &&
+         std::atomic_ref(coroutine->io_wait_info.seq).load(
+             std::memory_order_relaxed) == waiter.seq;
+}
+
+void Scheduler::WakeIo(Worker* worker, CoRoutine* coroutine, int ret,
+                       int error) {
+  auto& io_wait_info = coroutine->io_wait_info;
+  io_wait_info.ret = ret;
+  io_wait_info.error = error;
+  if (io_wait_info.timer_pos != IoWaitInfo::kNoTimer)
+    CancelTimer(worker, coroutine);
+  --worker->suspended;
+  std::atomic_ref(coroutine->status).store(Status::READY,
+                                           std::memory_order_relaxed);
+  Push(worker, coroutine);
+}
+
+bool Scheduler::PollIo(Worker* worker, int64_t timeout_ns) {
+  epoll_event events[256];
+  int ret = EpollWaitNs(worker->epoll_fd, events, std::size(events),
+                        timeout_ns);
+  size_t suspended = worker->suspended;
+  if (ret < 0) {
+    // This is not likely, but we need to handle it.  Wake those waiting for
+    // fds, whose entries are found in fd_waiters.
+    int error = errno;
+    for (auto& fd_waiters: worker->fd_waiters) {
+      for (auto waiter: fd_waiters.waiters) {
+        if (IsWaiting(waiter))
+          WakeIo(worker, Get(waiter.id), -1, error);
+      }
+      fd_waiters.waiters.clear();
+    }
+    ret = 0;
+  }
+
+  // Check coroutines waiting for the fired fds, as CoContainer::DoPoll does
+  for (int i = 0; i < ret; ++i) {
+    int fd = events[i].data.fd;
+    if (fd == worker->wake_fd) {
+      uint64_t count;
+      ssize_t discard [[maybe_unused]] =
+          sys_read(worker->wake_fd, &count, sizeof(count));
+      continue;
+    }
+    if (size_t(fd) >= worker->fd_waiters.size())
+      continue;
+    auto& waiters = worker->fd_waiters[fd].waiters;
+    size_t kept = 0;
+    for (size_t k = 0, m = waiters.size(); k < m; ++k) {
+      auto waiter = waiters[k];
+      if (!IsWaiting(waiter))
+        continue;
+      CoRoutine* coroutine = Get(waiter.id);
+      auto& io_wait_info = coroutine->io_wait_info;
+      int ready_count = sys_poll(io_wait_info.fds, io_wait_info.nfds, 0);
+      if (ready_count != 0)
+        WakeIo(worker, coroutine, ready_count);
+      else
+        waiters[kept++] = waiter;
+    }
+    waiters.resize(kept);
+    if (kept != 0) {
+      if (int error = RearmFd(worker, fd)) {
+        // Don't leave them waiting for an fd that can't be watched
+        for (auto waiter: waiters) {
+          if (!IsWaiting(waiter))
+            continue;
+          CoRoutine* coroutine = Get(waiter.id);
+          auto& io_wait_info = coroutine->io_wait_info;
+          int ready_count = sys_poll(io_wait_info.fds, io_wait_info.nfds, 0);
+          WakeIo(worker, coroutine, ready_count != 0 ? ready_count : -1,
+                 error);
+        }
+        waiters.clear();
+      }
+    }
+  }
+
+  // Wake up sleeping and timed-out coroutines
+  if (!worker->timers.empty()) {
+    auto now = std::chrono::steady_clock::now();
+    while (!worker->timers.empty() && worker->timers[0].expire_time <= now) {
+      CoRoutine* coroutine = Get(worker->timers[0].id);
+      const auto& io_wait_info = coroutine->io_wait_info;
+      WakeIo(worker, coroutine,
+             std::atomic_ref(coroutine->status).load(
+                 std::memory_order_relaxed) == Status::WAITING_IO ?
+                 sys_poll(io_wait_info.fds, io_wait_info.nfds, 0) : 0);
+    }
+  }
+
+  return worker->suspended != suspended;
+}
+
+Scheduler::Worker* Scheduler::CurrentWorker() noexcept {
+  return active_worker_;
+}
+
+void Scheduler::SetErrno(int error) noexcept {
+  errno = error;
+}
+
+void Scheduler::CoRoutineWrapper(CoFunc& func) {
+  RunCoFunc(func);
+  CurrentWorker()->scheduler->SwitchToScheduler(After::DONE);
+  __builtin_trap();
+}
+
+} // namespace coroutine
+} // namespace cbu
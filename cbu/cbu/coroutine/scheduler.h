@@ -0,0 +1,216 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2022, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <poll.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "cbu/coroutine/coroutine.h"
+
+namespace cbu {
+namespace coroutine {
+
+// Bounded lock-free queue of runnable coroutines, owned by a worker.
+// Only the owner pushes; the owner and thieves take from the other end
+// with CAS, so that it's FIFO like CoContainer, and a coroutine that keeps
+// yielding doesn't starve others.
+class RunQueue {
+ public:
+  static constexpr uint32_t kCapacity = 1024;
+
+  // Returns false if full
+  bool Push(CoRoutine* coroutine) noexcept;
+  // Returns nullptr if empty, or if lost a race
+  CoRoutine* Take() noexcept;
+  // Retries until it succeeds or the queue is empty
+  CoRoutine* TakeUntilEmpty() noexcept {
+    while (!Empty()) {
+      if (CoRoutine* coroutine = Take())
+        return coroutine;
+    }
+    return nullptr;
+  }
+
+  bool Empty() const noexcept {
+    return top_.load(std::memory_order_acquire) >=
+        bottom_.load(std::memory_order_acquire);
+  }
+
+ private:
+  alignas(64) std::atomic<uint64_t> top_{0};
+  alignas(64) std::atomic<uint64_t> bottom_{0};
+  std::atomic<CoRoutine*> buffer_[kCapacity] = {};
+};
+
+// M:N scheduler: coroutines are run by a number of worker threads, each
+// with its own run queue.  Idle workers steal from the others.
+//
+// Coroutines may migrate between threads whenever they switch to the
+// scheduler, so they must not keep addresses of thread-local variables
+// (including errno, whose address glibc says never changes) across Yield,
+// WaitFor, or anything that may wait.
+//
+// Each worker waits for the fds and timers of coroutines that started
+// waiting on it, with its own epoll fd and timer heap, so the syscall hooks
+// and the free functions (Yield, Sleep etc.) work as in CoContainer.  A
+// worker with coroutines waiting parks in epoll_wait, and others wake it
+// with an eventfd.  io_uring (Attr::use_io_uring) is not used.
+class Scheduler {
+ public:
+  // threads = 0 uses one per CPU
+  explicit Scheduler(unsigned threads = 0, Attr attr = {});
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator=(const Scheduler&) = delete;
+  ~Scheduler();
+
+  // May be called from any thread, or from coroutines of this scheduler.
+  // Up to 2^20 coroutines may be live at a time.  IDs of those done are
+  // reused, but only after their slots have been reused 4096 times.
+  CoId Register(CoFunc func);
+
+  // Runs until all coroutines are done.  The calling thread is one of the
+  // workers.
+  void Run();
+
+  unsigned threads() const noexcept { return workers_.size(); }
+
+  // The scheduler running the calling coroutine, or nullptr
+  [[gnu::noinline]] static Scheduler* Current() noexcept;
+
+  // The following can only be called from coroutines of this scheduler
+  CoId Self() const;
+  void Yield();
+  int Poll(pollfd* fds, nfds_t nfds, int timeout_ms = -1);
+  void Sleep(std::chrono::nanoseconds duration);
+  // Like CoContainer::WaitFor; the other coroutine may be run by any worker
+  bool WaitFor(CoId other_id);
+
+ private:
+  struct Worker;
+
+  // What the worker does after the coroutine switches back
+  enum struct After: unsigned char {
+    YIELD,
+    WAIT,
+    SUSPEND,  // Waiting for IO or a timer of the worker, which wakes it
+    DONE,
+  };
+
+  CoRoutine* GetSlot(uint32_t slot) const noexcept;
+  // nullptr if the slot has been reused
+  CoRoutine* Get(CoId id) const noexcept;
+  void Push(Worker* worker, CoRoutine* coroutine);
+  void Inject(CoRoutine* coroutine);
+  void Notify();
+  CoRoutine* FindWork(Worker* worker);
+  CoRoutine* TakeInjected();
+  bool HasWork();
+  void Park(Worker* worker);
+  void WorkerLoop(Worker* worker);
+  // IO and timer waits.  Only the worker itself calls these with it.
+  void AddTimer(Worker* worker,
+                std::chrono::steady_clock::time_point expire_time,
+                CoRoutine* coroutine);
+  void CancelTimer(Worker* worker, CoRoutine* coroutine);
+  auto TimerPositioner() {
+    return [this](const Timer& timer, size_t pos) {
+      Get(timer.id)->io_wait_info.timer_pos = pos;
+    };
+  }
+  // These return 0, or an errno value if the fd can't be watched
+  int AddFdWaiter(Worker* worker, int fd, CoRoutine* coroutine);
+  int RearmFd(Worker* worker, int fd);
+  bool IsWaiting(const FdWaiters::Waiter& waiter) const;
+  void WakeIo(Worker* worker, CoRoutine* coroutine, int ret, int error = 0);
+  // Waits up to timeout_ns nanoseconds (-1 means no timeout), and wakes
+  // coroutines whose fds are ready or whose timers expired.  Returns whether
+  // any is woken.
+  bool PollIo(Worker* worker, int64_t timeout_ns);
+  void SwitchToScheduler(After after);
+  void Finish(Worker* worker, CoRoutine* coroutine);
+  void Clear() noexcept;
+
+  // Not inlined, so that the address of the thread-local variable isn't
+  // reused after the coroutine migrates
+  [[gnu::noinline]] static Worker* CurrentWorker() noexcept;
+  [[gnu::noinline]] static void SetErrno(int error) noexcept;
+  [[noreturn]] static void CoRoutineWrapper(CoFunc& func);
+
+ private:
+  static __thread Worker* active_worker_;
+
+  // Coroutines are found in chunks of slots by ID without locking.  Those
+  // done give their stacks back to the pools, and are reused with their
+  // slots, in FIFO order.  Objects are only freed when Run returns, since
+  // stale fd waiters of other workers may still look at them.
+  // The low bits of an ID are the slot, and the high bits count reuses of
+  // the slot, so that WaitFor can tell a coroutine that is done from one
+  // that reuses its slot.
+  static constexpr uint32_t kSlotBits = 20;
+  static constexpr CoId kSlotMask = (CoId(1) << kSlotBits) - 1;
+  static constexpr uint32_t kChunkBits = 12;
+  static constexpr uint32_t kMaxChunks = 1u << (kSlotBits - kChunkBits);
+
+  Attr attr_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  std::mutex register_lock_;
+  std::atomic<std::atomic<CoRoutine*>*> chunks_[kMaxChunks] = {};
+  std::atomic<uint32_t> next_slot_{1};
+  std::atomic<size_t> live_{0};  // Registered and not yet done
+
+  // Coroutines registered from outside the workers, or overflowing run
+  // queues
+  std::mutex inject_lock_;
+  std::deque<CoRoutine*> inject_;
+  std::atomic<bool> inject_empty_{true};
+
+  // Protects status, waiting_for and waited_by for WaitFor, and the reuse
+  // of slots
+  std::mutex wait_lock_;
+  std::deque<uint32_t> free_slots_;
+
+  // Idle workers sleep here, unless they have coroutines waiting for IO or
+  // timers, in which case they sleep in epoll_wait
+  std::mutex park_lock_;
+  std::condition_variable park_cv_;
+  std::atomic<uint32_t> sleepers_{0};  // Both kinds
+  uint32_t cv_sleepers_ = 0;  // Protected by park_lock_
+  uint64_t wakeups_ = 0;  // Protected by park_lock_
+  bool done_ = false;  // Protected by park_lock_
+};
+
+} // namespace coroutine
+} // namespace cbu
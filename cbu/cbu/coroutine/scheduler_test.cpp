@@ -0,0 +1,307 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2022, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "coroutine.h"
+#include "scheduler.h"
+
+namespace cbu {
+namespace coroutine {
+
+TEST(SchedulerTest, Basic) {
+  Scheduler sched(4);
+  std::atomic<int> count{0};
+  for (int i = 0; i < 1000; ++i) {
+    sched.Register([&] {
+      for (int k = 0; k < 10; ++k) {
+        count.fetch_add(1, std::memory_order_relaxed);
+        sched.Yield();
+      }
+    });
+  }
+  sched.Run();
+  EXPECT_EQ(10000, count.load());
+
+  // It can be run again
+  sched.Register([&] { count = 0; });
+  sched.Run();
+  EXPECT_EQ(0, count.load());
+}
+
+TEST(SchedulerTest, Register) {
+  Scheduler sched(4);
+  std::atomic<int> count{0};
+  sched.Register([&] {
+    std::vector<CoId> children;
+    for (int i = 0; i < 100; ++i) {
+      children.push_back(sched.Register([&] {
+        sched.Yield();
+        count.fetch_add(1, std::memory_order_relaxed);
+      }));
+    }
+    for (CoId id: children)
+      EXPECT_TRUE(sched.WaitFor(id));
+    EXPECT_EQ(100, count.load());
+  });
+  sched.Run();
+  EXPECT_EQ(100, count.load());
+}
+
+TEST(SchedulerTest, WaitForChain) {
+  Scheduler sched(4);
+  constexpr int kLength = 200;
+  std::vector<int> order;
+  std::mutex lock;
+  std::vector<CoId> ids(kLength);
+  std::atomic<int> registered{0};
+
+  // Each coroutine waits for the previous one, wherever they run
+  for (int i = 0; i < kLength; ++i) {
+    ids[i] = sched.Register([&, i] {
+      while (registered.load() < kLength)
+        sched.Yield();
+      if (i > 0) {
+        EXPECT_TRUE(sched.WaitFor(ids[i - 1]));
+      }
+      std::lock_guard locker(lock);
+      order.push_back(i);
+    });
+    registered.fetch_add(1);
+  }
+  sched.Run();
+
+  ASSERT_EQ(kLength, int(order.size()));
+  for (int i = 0; i < kLength; ++i)
+    EXPECT_EQ(i, order[i]);
+}
+
+TEST(SchedulerTest, WaitForCircle) {
+  Scheduler sched(2);
+  CoId a = 0;
+  CoId b = 0;
+  std::atomic<int> failed{0};
+  std::atomic<int> started{0};
+  a = sched.Register([&] {
+    started.fetch_add(1);
+    while (started.load() < 2)
+      sched.Yield();
+    if (!sched.WaitFor(b))
+      failed.fetch_add(1);
+  });
+  b = sched.Register([&] {
+    started.fetch_add(1);
+    while (started.load() < 2)
+      sched.Yield();
+    if (!sched.WaitFor(a))
+      failed.fetch_add(1);
+  });
+  sched.Run();
+  // Neither can finish before its own WaitFor, so the later one sees the
+  // circle
+  EXPECT_EQ(1, failed.load());
+}
+
+TEST(SchedulerTest, ReuseDone) {
+  // More coroutines than there are slots (2^20), one at a time, so those
+  // done must be reused
+  constexpr int kCount = (1 << 20) + 1000;
+  Scheduler sched(2);
+  int done = 0;
+  CoId first = 0;
+  CoId last = 0;
+  sched.Register([&] {
+    for (int i = 0; i < kCount; ++i) {
+      CoId id = sched.Register([&] { ++done; });
+      ASSERT_TRUE(sched.WaitFor(id));
+      if (i == 0)
+        first = id;
+      last = id;
+    }
+    // Done long ago, and its slot has since been reused
+    EXPECT_TRUE(sched.WaitFor(first));
+  });
+  sched.Run();
+
+  EXPECT_EQ(kCount, done);
+  EXPECT_NE(first, last);
+}
+
+TEST(SchedulerTest, FreeFunctions) {
+  Scheduler sched(2);
+  std::atomic<int> count{0};
+  CoId first = sched.Register([&] {
+    Yield();
+    count.fetch_add(1);
+  });
+  sched.Register([&] {
+    EXPECT_EQ(&sched, Scheduler::Current());
+    EXPECT_NE(0u, Self());
+    EXPECT_NE(first, Self());
+    EXPECT_TRUE(WaitFor(first));
+    EXPECT_EQ(1, count.load());
+  });
+  sched.Run();
+  EXPECT_EQ(nullptr, Scheduler::Current());
+  EXPECT_EQ(0u, Self());
+}
+
+TEST(SchedulerTest, Sleep) {
+  Scheduler sched(2);
+  constexpr int kCoroutines = 100;
+  std::atomic<int> count{0};
+  for (int i = 0; i < kCoroutines; ++i) {
+    sched.Register([&, i] {
+      if (i % 2)
+        Sleep(std::chrono::milliseconds(50));
+      else
+        usleep(50000);  // Hooked
+      count.fetch_add(1);
+    });
+  }
+  auto start = std::chrono::steady_clock::now();
+  sched.Run();
+  auto end = std::chrono::steady_clock::now();
+  EXPECT_EQ(kCoroutines, count.load());
+  // The workers don't block in the sleeps
+  EXPECT_LT(end - start, std::chrono::seconds(1));
+  EXPECT_GE(end - start, std::chrono::milliseconds(50));
+}
+
+TEST(SchedulerTest, Pipes) {
+  // More blocking readers than threads
+  Scheduler sched(2);
+  constexpr int kPairs = 16;
+  constexpr int kRounds = 100;
+  int fds[kPairs][2][2];
+  for (auto& pair: fds) {
+    ASSERT_EQ(0, pipe(pair[0]));
+    ASSERT_EQ(0, pipe(pair[1]));
+  }
+  std::atomic<int> done{0};
+  for (auto& pair: fds) {
+    // Echoes what it reads
+    sched.Register([&] {
+      for (int k = 0; k < kRounds; ++k) {
+        int v;
+        ASSERT_EQ(ssize_t(sizeof(v)), read(pair[0][0], &v, sizeof(v)));
+        ASSERT_EQ(ssize_t(sizeof(v)), write(pair[1][1], &v, sizeof(v)));
+      }
+    });
+    sched.Register([&] {
+      for (int k = 0; k < kRounds; ++k) {
+        ASSERT_EQ(ssize_t(sizeof(k)), write(pair[0][1], &k, sizeof(k)));
+        int v = -1;
+        ASSERT_EQ(ssize_t(sizeof(v)), read(pair[1][0], &v, sizeof(v)));
+        ASSERT_EQ(k, v);
+      }
+      done.fetch_add(1);
+    });
+  }
+  // poll times out
+  sched.Register([&] {
+    pollfd pfd = {fds[0][0][1], POLLIN, 0};
+    EXPECT_EQ(0, poll(&pfd, 1, 10));
+  });
+  sched.Run();
+  EXPECT_EQ(kPairs, done.load());
+  for (auto& pair: fds) {
+    for (auto& p: pair) {
+      close(p[0]);
+      close(p[1]);
+    }
+  }
+}
+
+TEST(SchedulerTest, RegisterWhileSleeping) {
+  // The only worker is in epoll_wait, and must be woken for the new one
+  Scheduler sched(1);
+  std::atomic<bool> registered{false};
+  std::atomic<bool> ran{false};
+  sched.Register([&] {
+    while (!registered.load())
+      Sleep(std::chrono::milliseconds(1));
+    Sleep(std::chrono::seconds(1));
+  });
+  auto start = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point ran_time;
+  std::thread thread([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    sched.Register([&] {
+      ran_time = std::chrono::steady_clock::now();
+      ran = true;
+    });
+    registered = true;
+  });
+  sched.Run();
+  thread.join();
+  EXPECT_TRUE(ran.load());
+  EXPECT_LT(ran_time - start, std::chrono::milliseconds(500));
+}
+
+// Benchmark: context switches per second, which should scale with cores
+TEST(SchedulerTest, Throughput) {
+  constexpr int kCoroutines = 1000;
+  constexpr int kYields = 1000;
+  unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+    Scheduler sched(threads);
+    std::atomic<uint64_t> sum{0};
+    for (int i = 0; i < kCoroutines; ++i) {
+      sched.Register([&, i] {
+        uint64_t x = i;
+        for (int k = 0; k < kYields; ++k) {
+          // Some work between switches
+          for (int j = 0; j < 100; ++j)
+            x = x * 6364136223846793005u + 1442695040888963407u;
+          sched.Yield();
+        }
+        sum.fetch_add(x, std::memory_order_relaxed);
+      });
+    }
+    auto start = std::chrono::steady_clock::now();
+    sched.Run();
+    auto end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+    printf("%u threads: %.3g switches/s\n", threads,
+           kCoroutines * double(kYields) / seconds);
+    EXPECT_NE(0u, sum.load());
+    if (threads == max_threads)
+      break;
+  }
+}
+
+} // namespace coroutine
+} // namespace cbu
@@ -27,11 +27,18 @@
  */
 
 #include "syscall_hook.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <chrono>
 #include "coroutine.h"
+#include "scheduler.h"
 
 #if defined __GNUC__ && !defined __clang__
 # define VISIBLE __attribute__((externally_visible, visibility("default")))
@@ -48,35 +55,93 @@ inline bool is_non_blocking(int fd) {
   return (flags >= 0 && (flags & O_NONBLOCK));
 }
 
-void single_poll(int fd, short events, int timeout = -1) {
+// Whether we're in a coroutine, of either a CoContainer or a Scheduler
+inline bool in_coroutine() {
+  return active_container != nullptr || Scheduler::Current() != nullptr;
+}
+
+// The following can only be called if in_coroutine()
+int co_poll(pollfd* fds, nfds_t nfds, int timeout) {
+  if (active_container)
+    return active_container->Poll(fds, nfds, timeout);
+  return Scheduler::Current()->Poll(fds, nfds, timeout);
+}
+
+void co_sleep(std::chrono::nanoseconds duration) {
+  if (active_container)
+    active_container->Sleep(duration);
+  else
+    Scheduler::Current()->Sleep(duration);
+}
+
+// Scheduler doesn't use io_uring
+inline io_uring_sqe* prepare_uring() {
+  return active_container ? active_container->PrepareUring() : nullptr;
+}
+
+// Returns false, with errno set, if the fd can't be waited for.  The caller
+// must then fail rather than block in the syscall.
+bool single_poll(int fd, short events, int timeout = -1) {
   pollfd fds[] = {{fd, events, 0}};
-  active_container->Poll(fds, 1, timeout);
+  return co_poll(fds, 1, timeout) >= 0;
+}
+
+// Waits for the operation prepared by PrepareUring, and returns its result
+// like a syscall
+inline int wait_uring() {
+  int ret = active_container->WaitUring();
+  if (ret < 0) {
+    errno = -ret;
+    return -1;
+  }
+  return ret;
 }
 
+// Limit of bytes read or written at a time, like Linux
+constexpr size_t kMaxRw = 0x7ffff000;
+
 } // namespace
 
 extern "C" {
 
 VISIBLE int hook_poll(pollfd* fds, nfds_t nfds, int timeout) asm("poll");
 int hook_poll(pollfd* fds, nfds_t nfds, int timeout) {
-  if (active_container == nullptr)
+  if (!in_coroutine())
     return sys_poll(fds, nfds, timeout);
-  return active_container->Poll(fds, nfds, timeout);
+  return co_poll(fds, nfds, timeout);
 }
 
 VISIBLE ssize_t hook_read(int fd, void* buffer, size_t n) asm("read");
 ssize_t hook_read(int fd, void* buffer, size_t n) {
-  if (active_container == nullptr || is_non_blocking(fd))
+  if (!in_coroutine() || is_non_blocking(fd))
     return sys_read(fd, buffer, n);
-  single_poll(fd, POLLIN);
+  if (io_uring_sqe* sqe = prepare_uring()) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(buffer);
+    sqe->len = std::min(n, kMaxRw);
+    sqe->off = uint64_t(-1);  // Current position
+    return wait_uring();
+  }
+  if (!single_poll(fd, POLLIN))
+    return -1;
   return sys_read(fd, buffer, n);
 }
 
 VISIBLE ssize_t hook_write(int fd, const void* buffer, size_t n) asm("write");
 ssize_t hook_write(int fd, const void* buffer, size_t n) {
-  if (active_container == nullptr || is_non_blocking(fd))
+  if (!in_coroutine() || is_non_blocking(fd))
     return sys_write(fd, buffer, n);
-  single_poll(fd, POLLOUT);
+  if (io_uring_sqe* sqe = prepare_uring()) {
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(buffer);
+    sqe->len = std::min(n, kMaxRw);
+    sqe->off = uint64_t(-1);  // Current position
+    return wait_uring();
+  }
+  if (!single_poll(fd, POLLOUT))
+    return -1;
   return sys_write(fd, buffer, n);
 }
 
@@ -91,40 +156,147 @@ VISIBLE ssize_t hook_sendto(int fd, const void* buffer, size_t n, int flags,
   asm("sendto");
 ssize_t hook_sendto(int fd, const void* buffer, size_t n, int flags,
                     const sockaddr* addr, socklen_t addrlen) {
-  if (active_container == nullptr || is_non_blocking(fd))
+  if (!in_coroutine() || is_non_blocking(fd))
     return sys_sendto(fd, buffer, n, flags, addr, addrlen);
-  single_poll(fd, POLLOUT);
+  iovec iov = {const_cast<void*>(buffer), n};
+  msghdr msg = {};
+  if (io_uring_sqe* sqe = prepare_uring()) {
+    sqe->fd = fd;
+    sqe->msg_flags = flags;
+    if (addr == nullptr) {
+      sqe->opcode = IORING_OP_SEND;
+      sqe->addr = reinterpret_cast<uintptr_t>(buffer);
+      sqe->len = std::min(n, kMaxRw);
+    } else {
+      msg.msg_name = const_cast<sockaddr*>(addr);
+      msg.msg_namelen = addrlen;
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->addr = reinterpret_cast<uintptr_t>(&msg);
+      sqe->len = 1;
+    }
+    return wait_uring();
+  }
+  if (!single_poll(fd, POLLOUT))
+    return -1;
   return sys_sendto(fd, buffer, n, flags, addr, addrlen);
 }
 
 VISIBLE ssize_t hook_recv(int fd, void* buffer, size_t n, int flags)
   asm("recv");
 ssize_t hook_recv(int fd, void* buffer, size_t n, int flags) {
-  return recvfrom(fd, buffer, n, flags, nullptr, 0);
+  return recvfrom(fd, buffer, n, flags, nullptr, nullptr);
 }
 
 VISIBLE ssize_t hook_recvfrom(int fd, void* buffer, size_t n, int flags,
-                              sockaddr* addr, socklen_t addrlen)
+                              sockaddr* addr, socklen_t* addrlen)
   asm("recvfrom");
 ssize_t hook_recvfrom(int fd, void* buffer, size_t n, int flags,
-                      sockaddr* addr, socklen_t addrlen) {
-  if (active_container == nullptr || is_non_blocking(fd))
+                      sockaddr* addr, socklen_t* addrlen) {
+  if (!in_coroutine() || is_non_blocking(fd))
     return sys_recvfrom(fd, buffer, n, flags, addr, addrlen);
-  single_poll(fd, POLLIN);
+  // Like the syscall (which fails after receiving the data, though)
+  if (addr != nullptr && addrlen == nullptr) {
+    errno = EFAULT;
+    return -1;
+  }
+  iovec iov = {buffer, n};
+  msghdr msg = {};
+  if (io_uring_sqe* sqe = prepare_uring()) {
+    sqe->fd = fd;
+    sqe->msg_flags = flags;
+    if (addr == nullptr) {
+      sqe->opcode = IORING_OP_RECV;
+      sqe->addr = reinterpret_cast<uintptr_t>(buffer);
+      sqe->len = std::min(n, kMaxRw);
+      return wait_uring();
+    }
+    msg.msg_name = addr;
+    msg.msg_namelen = *addrlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->addr = reinterpret_cast<uintptr_t>(&msg);
+    sqe->len = 1;
+    ssize_t ret = wait_uring();
+    if (ret >= 0)
+      *addrlen = msg.msg_namelen;
+    return ret;
+  }
+  if (!single_poll(fd, POLLIN))
+    return -1;
   return sys_recvfrom(fd, buffer, n, flags, addr, addrlen);
 }
 
+VISIBLE int hook_accept4(int fd, sockaddr* addr, socklen_t* addrlen,
+                         int flags) asm("accept4");
+int hook_accept4(int fd, sockaddr* addr, socklen_t* addrlen, int flags) {
+  if (!in_coroutine() || is_non_blocking(fd))
+    return sys_accept4(fd, addr, addrlen, flags);
+  if (io_uring_sqe* sqe = prepare_uring()) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(addr);
+    sqe->addr2 = reinterpret_cast<uintptr_t>(addrlen);
+    sqe->accept_flags = flags;
+    return wait_uring();
+  }
+  if (!single_poll(fd, POLLIN))
+    return -1;
+  return sys_accept4(fd, addr, addrlen, flags);
+}
+
+VISIBLE int hook_accept(int fd, sockaddr* addr, socklen_t* addrlen)
+  asm("accept");
+int hook_accept(int fd, sockaddr* addr, socklen_t* addrlen) {
+  return accept4(fd, addr, addrlen, 0);
+}
+
+// Without io_uring, this still blocks
+VISIBLE int hook_connect(int fd, const sockaddr* addr, socklen_t addrlen)
+  asm("connect");
+int hook_connect(int fd, const sockaddr* addr, socklen_t addrlen) {
+  if (!in_coroutine() || is_non_blocking(fd))
+    return sys_connect(fd, addr, addrlen);
+  if (io_uring_sqe* sqe = prepare_uring()) {
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(addr);
+    sqe->off = addrlen;
+    return wait_uring();
+  }
+  return sys_connect(fd, addr, addrlen);
+}
+
 VISIBLE unsigned int hook_sleep(unsigned int seconds) asm("sleep");
 unsigned int hook_sleep(unsigned int seconds) {
-  poll(nullptr, 0, seconds * 1000);
+  if (!in_coroutine())
+    return sys_sleep(seconds);
+  co_sleep(std::chrono::seconds(seconds));
+  return 0;
+}
+
+VISIBLE int hook_usleep(useconds_t usec) asm("usleep");
+int hook_usleep(useconds_t usec) {
+  if (!in_coroutine())
+    return sys_usleep(usec);
+  co_sleep(std::chrono::microseconds(usec));
   return 0;
 }
 
-VISIBLE int hook_usleep(useconds_t seconds) asm("usleep");
-int hook_usleep(useconds_t seconds) {
-  poll(nullptr, 0, seconds / 1000);
-  if (auto remain = seconds % 1000)
-    sys_usleep(remain);
+VISIBLE int hook_nanosleep(const timespec* req, timespec* rem)
+  asm("nanosleep");
+int hook_nanosleep(const timespec* req, timespec* rem) {
+  if (!in_coroutine())
+    return sys_nanosleep(req, rem);
+  if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000) {
+    errno = EINVAL;
+    return -1;
+  }
+  // Capped at about 68 years, so that the expire time doesn't overflow
+  co_sleep(std::chrono::seconds(std::min<time_t>(req->tv_sec, INT_MAX)) +
+           std::chrono::nanoseconds(req->tv_nsec));
   return 0;
 }
 
@@ -132,9 +304,10 @@ VISIBLE int hook_epoll_wait(int epfd, epoll_event* events, int maxevents,
                             int timeout) asm("epoll_wait");
 int hook_epoll_wait(int epfd, epoll_event* events, int maxevents,
                     int timeout) {
-  if (active_container == nullptr)
+  if (!in_coroutine())
     return sys_epoll_wait(epfd, events, maxevents, timeout);
-  single_poll(epfd, POLLIN, timeout);
+  if (!single_poll(epfd, POLLIN, timeout))
+    return -1;
   return sys_epoll_wait(epfd, events, maxevents, 0);
 }
 
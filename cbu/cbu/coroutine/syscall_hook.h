@@ -28,6 +28,7 @@
 
 #include <dlfcn.h>
 #include <poll.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
@@ -80,11 +81,19 @@ inline auto& sys_recv = RawFuncAccessor<
   "recv"_str, ssize_t(int, void*, size_t, int)>::instance;
 inline auto& sys_recvfrom = RawFuncAccessor<
   "recvfrom"_str, ssize_t(int, void*, size_t, int,
-                          sockaddr*, socklen_t)>::instance;
+                          sockaddr*, socklen_t*)>::instance;
+inline auto& sys_sleep = RawFuncAccessor<
+  "sleep"_str, unsigned int(unsigned int)>::instance;
 inline auto& sys_usleep = RawFuncAccessor<
   "usleep"_str, int(useconds_t)>::instance;
+inline auto& sys_nanosleep = RawFuncAccessor<
+  "nanosleep"_str, int(const timespec*, timespec*)>::instance;
 inline auto& sys_epoll_wait = RawFuncAccessor<
   "epoll_wait"_str, int(int, epoll_event*, int, int)>::instance;
+inline auto& sys_accept4 = RawFuncAccessor<
+  "accept4"_str, int(int, sockaddr*, socklen_t*, int)>::instance;
+inline auto& sys_connect = RawFuncAccessor<
+  "connect"_str, int(int, const sockaddr*, socklen_t)>::instance;
 
 } // namespace coroutine
 } // namespace cbu
@@ -0,0 +1,156 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2022, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "uring.h"
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <algorithm>
+
+namespace cbu {
+namespace coroutine {
+
+bool Uring::Init(unsigned entries) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0)
+    return false;
+  fd_ = fd;
+
+  // EXT_ARG (5.11) implies the operations we use are all supported, and
+  // FAST_POLL makes them not block on sockets and pipes
+  constexpr unsigned kRequiredFeatures = IORING_FEAT_SINGLE_MMAP |
+      IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL | IORING_FEAT_EXT_ARG;
+  if ((params.features & kRequiredFeatures) != kRequiredFeatures) {
+    Destroy();
+    return false;
+  }
+
+  ring_size_ = std::max(
+      params.sq_off.array + params.sq_entries * sizeof(unsigned),
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  ring_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring_ == MAP_FAILED) {
+    ring_ = nullptr;
+    Destroy();
+    return false;
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = static_cast<io_uring_sqe*>(
+      mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+  if (sqes_ == MAP_FAILED) {
+    sqes_ = nullptr;
+    Destroy();
+    return false;
+  }
+
+  char* ring = static_cast<char*>(ring_);
+  sq_head_ = reinterpret_cast<unsigned*>(ring + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(ring + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned*>(ring + params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  sqe_tail_ = *sq_tail_;
+  // Entries are always used in order
+  unsigned* array = reinterpret_cast<unsigned*>(ring + params.sq_off.array);
+  for (unsigned i = 0; i < sq_entries_; ++i)
+    array[i] = i;
+
+  cq_head_ = reinterpret_cast<unsigned*>(ring + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(ring + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned*>(ring + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(ring + params.cq_off.cqes);
+  return true;
+}
+
+void Uring::Destroy() noexcept {
+  if (sqes_ != nullptr) {
+    munmap(sqes_, sqes_size_);
+    sqes_ = nullptr;
+  }
+  if (ring_ != nullptr) {
+    munmap(ring_, ring_size_);
+    ring_ = nullptr;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+io_uring_sqe* Uring::GetSqe() {
+  unsigned head =
+      std::atomic_ref<unsigned>(*sq_head_).load(std::memory_order_acquire);
+  if (sqe_tail_ - head >= sq_entries_) {
+    if (to_submit_ == 0 || Enter(to_submit_, 0, 0, nullptr, 0) <= 0)
+      return nullptr;
+    head =
+        std::atomic_ref<unsigned>(*sq_head_).load(std::memory_order_acquire);
+    if (sqe_tail_ - head >= sq_entries_)
+      return nullptr;
+  }
+  io_uring_sqe* sqe = &sqes_[sqe_tail_ & sq_mask_];
+  memset(sqe, 0, sizeof(*sqe));
+  ++sqe_tail_;
+  ++to_submit_;
+  return sqe;
+}
+
+void Uring::SubmitAndWait(int64_t timeout_ns) {
+  __kernel_timespec ts;
+  io_uring_getevents_arg arg = {};
+  arg.sigmask_sz = _NSIG / 8;
+  if (timeout_ns >= 0) {
+    ts.tv_sec = timeout_ns / 1000000000;
+    ts.tv_nsec = timeout_ns % 1000000000;
+    arg.ts = reinterpret_cast<uintptr_t>(&ts);
+  }
+  // Errors (EINTR, ETIME, EBUSY if completions overflowed) only make us
+  // return early
+  Enter(to_submit_, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+        &arg, sizeof(arg));
+}
+
+int Uring::Enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+                 const void* arg, size_t argsz) {
+  Publish();
+  int ret = syscall(__NR_io_uring_enter, fd_, to_submit, min_complete, flags,
+                    arg, argsz);
+  if (ret > 0)
+    to_submit_ -= ret;
+  return ret;
+}
+
+} // namespace coroutine
+} // namespace cbu
@@ -0,0 +1,111 @@
+/*
+ * cbu - chys's basic utilities
+ * Copyright (c) 2019-2022, chys <admin@CHYS.INFO>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of chys <admin@CHYS.INFO> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY chys <admin@CHYS.INFO> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL chys <admin@CHYS.INFO> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <atomic>
+
+namespace cbu {
+namespace coroutine {
+
+// A minimal io_uring, without liburing.
+// Submissions are queued by GetSqe, and only handed to the kernel by
+// SubmitAndWait (or by GetSqe if the queue is full), so that they're
+// batched.
+class Uring {
+ public:
+  Uring() = default;
+  Uring(const Uring&) = delete;
+  Uring& operator=(const Uring&) = delete;
+  ~Uring() { Destroy(); }
+
+  // Returns false if io_uring is unavailable, or the kernel is too old
+  // (5.11 is required)
+  bool Init(unsigned entries);
+  void Destroy() noexcept;
+
+  explicit operator bool() const noexcept { return fd_ >= 0; }
+
+  // Returns a zero'd entry, or nullptr if the queue is full even after
+  // submitting what's queued
+  io_uring_sqe* GetSqe();
+
+  // Submits queued entries, and waits for at least one completion up to
+  // timeout_ns nanoseconds (-1 means no timeout)
+  void SubmitAndWait(int64_t timeout_ns);
+
+  // Calls callback with each completion
+  template <typename Callback>
+  void Reap(Callback callback);
+
+ private:
+  int Enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+            const void* arg, size_t argsz);
+  void Publish() noexcept {
+    std::atomic_ref<unsigned>(*sq_tail_).store(sqe_tail_,
+                                               std::memory_order_release);
+  }
+
+ private:
+  int fd_ = -1;
+  void* ring_ = nullptr;
+  size_t ring_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned sqe_tail_ = 0;  // Entries before it are filled
+  unsigned to_submit_ = 0;  // Filled but not yet submitted
+
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+};
+
+template <typename Callback>
+void Uring::Reap(Callback callback) {
+  unsigned head = *cq_head_;
+  unsigned tail =
+      std::atomic_ref<unsigned>(*cq_tail_).load(std::memory_order_acquire);
+  for (; head != tail; ++head) {
+    // Copy it, so that the entry can be released before callback runs
+    io_uring_cqe cqe = cqes_[head & cq_mask_];
+    std::atomic_ref<unsigned>(*cq_head_).store(head + 1,
+                                               std::memory_order_release);
+    callback(cqe);
+  }
+}
+
+} // namespace coroutine
+} // namespace cbu
@@ -301,7 +301,9 @@ def_fsys(futex3,futex,int,3,int *,int,int)
 def_fsys(mmap,mmap,void*,6,void*,unsigned long,int,int,int,long)
 def_fsys(munmap,munmap,int,2,void*,unsigned long)
 def_fsys(madvise,madvise,int,3,void*,unsigned long,int)
+def_fsys(mprotect,mprotect,int,3,void*,unsigned long,int)
 def_fsys(mremap,mremap,void*,4,void*,unsigned long,unsigned long,int)
+def_fsys(mremap5,mremap,void*,5,void*,unsigned long,unsigned long,int,void*)
 // Should be sigset_t. But don't want to include signal.h here
 def_fsys(rt_sigprocmask,rt_sigprocmask,int,
          4,int,const void *,void *,unsigned long)
@@ -419,6 +421,11 @@ def_fsys(mount,mount,int,5,const char *,const char *,const char *,
 def_fsys(umount2,umount2,int,2,const char *,int)
 def_fsys(pivot_root,pivot_root,int,2,const char *,const char *)
 def_fsys(memfd_create,memfd_create,int,2,const char *,unsigned)
+def_fsys(rseq,rseq,int,4,void *,unsigned,int,unsigned)
+def_fsys_nomem(membarrier,membarrier,int,3,int,unsigned,int)
+def_fsys(mbind,mbind,long,6,void *,unsigned long,int,const unsigned long *,
+         unsigned long,unsigned)
+def_fsys(getcpu,getcpu,int,3,unsigned *,unsigned *,void *)
 
 // vsyscall is nowadays deprecated; We should use vDSO instead,
 // of which modern glibc takes good care.
@@ -548,7 +555,9 @@ fsys_inline int fsys_posix_fadvise(int fd, __OFF64_T_TYPE off,
 #define fsys_mmap mmap
 #define fsys_munmap munmap
 #define fsys_madvise madvise
+#define fsys_mprotect mprotect
 #define fsys_mremap mremap
+#define fsys_mremap5 mremap
 #define fsys_sigprocmask sigprocmask
 #define fsys_setsid setsid
 #define fsys_kill kill
@@ -620,5 +629,9 @@ fsys_inline int fsys_posix_fadvise(int fd, __OFF64_T_TYPE off,
 #define fsys_umount2 umount2
 #define fsys_pivot_root pivot_root
 #define fsys_memfd_create memfd_create
+#define fsys_rseq(...) syscall(__NR_rseq,__VA_ARGS__)
+#define fsys_membarrier(...) syscall(__NR_membarrier,__VA_ARGS__)
+#define fsys_mbind(...) syscall(__NR_mbind,__VA_ARGS__)
+#define fsys_getcpu(...) syscall(__NR_getcpu,__VA_ARGS__)
 
 #endif
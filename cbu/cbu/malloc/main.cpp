@@ -26,13 +26,21 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 
 #include "cbu/alloc/alloc.h"
 #include "cbu/alloc/pagesize.h"
+#include "cbu/common/bit.h"
 #include "cbu/common/fastarith.h"
 #include "cbu/malloc/malloc.h"
 #include "cbu/malloc/visibility.h"
@@ -87,6 +95,25 @@ extern "C" void cbu_free(void* ptr) noexcept { alloc::reclaim(ptr); }
 
 extern "C" void cbu_cfree(void* ) noexcept __attribute__((alias("cbu_free")));
 
+extern "C" void cbu_sized_free(void* ptr, size_t n) noexcept {
+  alloc::reclaim(ptr, n);
+}
+
+extern "C" void cbu_aligned_sized_free(void* ptr, size_t boundary,
+                                       size_t n) noexcept {
+  // Aligned allocations are rounded up to the boundary
+  alloc::reclaim(ptr, cbu::pow2_ceil(n, boundary));
+}
+
+extern "C" size_t cbu_malloc_batch(size_t n, size_t count,
+                                   void** out) noexcept {
+  return alloc::allocate_batch(n, count, out);
+}
+
+extern "C" void cbu_free_batch(void** ptrs, size_t count) noexcept {
+  alloc::reclaim_batch(ptrs, count);
+}
+
 extern "C" int cbu_posix_memalign(void* *pret, size_t boundary,
                                   size_t n) noexcept {
   if (boundary & (boundary - 1))
@@ -115,6 +142,180 @@ extern "C" int cbu_malloc_trim(size_t pad) noexcept {
 #endif
 }
 
+extern "C" void cbu_malloc_set_decay_time(int decay_ms) noexcept {
+  alloc::set_decay_time(decay_ms);
+}
+
+extern "C" void cbu_malloc_set_guard_rate(size_t rate) noexcept {
+  alloc::set_guard_rate(rate);
+}
+
+extern "C" void cbu_malloc_set_thread_cache_limit(size_t bytes) noexcept {
+  alloc::set_thread_cache_limit(bytes);
+}
+
+extern "C" int cbu_malloc_start_background_decay() noexcept {
+  return alloc::start_background_decay();
+}
+
+extern "C" struct cbu_mallinfo2 cbu_mallinfo2() noexcept {
+  alloc::Stats stats;
+  alloc::get_stats(&stats);
+  struct cbu_mallinfo2 res = {};
+  res.arena = stats.arena_mapped + stats.medium_mapped;
+  res.hblkhd = stats.large_mapped;
+  res.fsmblks = stats.page_cached;
+  for (const alloc::SizeClassStats& st : stats.small)
+    res.fsmblks += st.cached * st.size;
+  for (const alloc::SizeClassStats& st : stats.medium)
+    res.fsmblks += st.cached * st.size;
+  res.uordblks = stats.in_use();
+  res.fordblks = std::max(res.arena + res.hblkhd, res.uordblks) - res.uordblks;
+  return res;
+}
+
+namespace {
+
+// Formats statistics in memory directly from the page allocator, and passes
+// it to output
+template <typename Output>
+void with_stats(alloc::StatsFormat format, Output output) noexcept {
+  alloc::Stats stats;
+  alloc::get_stats(&stats);
+  size_t len = alloc::format_stats(stats, nullptr, 0, format);
+  size_t bytes = (len + alloc::kPageSize) & ~(alloc::kPageSize - 1);
+  alloc::Page* page = alloc::allocate_page(bytes);
+  if (page == nullptr) return;
+  char* buf = reinterpret_cast<char*>(page);
+  output(buf, alloc::format_stats(stats, buf, bytes, format));
+  alloc::reclaim_page(page, bytes);
+}
+
+}  // namespace
+
+extern "C" void cbu_malloc_stats() noexcept {
+  with_stats(alloc::StatsFormat::TEXT, [](const char* buf, size_t len) {
+    while (len) {
+      ssize_t n = write(STDERR_FILENO, buf, len);
+      if (n <= 0) break;
+      buf += n;
+      len -= n;
+    }
+  });
+}
+
+extern "C" int cbu_malloc_info(int options, FILE* fp) noexcept {
+  if (options != 0) return EINVAL;
+  with_stats(alloc::StatsFormat::JSON, [fp](const char* buf, size_t len) {
+    fwrite(buf, 1, len, fp);
+  });
+  return 0;
+}
+
+extern "C" size_t cbu_malloc_format_stats(char* buf, size_t size,
+                                          int json) noexcept {
+  alloc::Stats stats;
+  alloc::get_stats(&stats);
+  return alloc::format_stats(
+      stats, buf, size,
+      json ? alloc::StatsFormat::JSON : alloc::StatsFormat::TEXT);
+}
+
+extern "C" void cbu_malloc_set_sample_rate(size_t rate) noexcept {
+  alloc::set_sample_rate(rate);
+}
+
+extern "C" int cbu_malloc_dump_heap_profile(int fd) noexcept {
+  return alloc::dump_heap_profile(fd);
+}
+
+namespace {
+
+constexpr size_t kDefaultSampleRate = 512 * 1024;
+
+char heap_profile_prefix[256];
+std::atomic<unsigned> heap_profile_seq{0};
+
+char* append_dec(char* p, unsigned long v) noexcept {
+  char tmp[24];
+  char* q = tmp + sizeof(tmp);
+  do *--q = '0' + v % 10; while (v /= 10);
+  return static_cast<char*>(mempcpy(p, q, tmp + sizeof(tmp) - q));
+}
+
+// Writes to <prefix>.<pid>.<seq>.heap
+void heap_profile_signal_handler(int) noexcept {
+  int saved_errno = errno;
+  char path[sizeof(heap_profile_prefix) + 64];
+  char* p = stpcpy(path, heap_profile_prefix);
+  *p++ = '.';
+  p = append_dec(p, getpid());
+  *p++ = '.';
+  p = append_dec(p, heap_profile_seq.fetch_add(1, std::memory_order_relaxed));
+  strcpy(p, ".heap");
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd >= 0) {
+    alloc::dump_heap_profile(fd, true);
+    close(fd);
+  }
+  errno = saved_errno;
+}
+
+}  // namespace
+
+extern "C" int cbu_malloc_heap_profile_on_signal(int signo,
+                                                 const char* prefix) noexcept {
+  size_t len = strlen(prefix);
+  if (len >= sizeof(heap_profile_prefix)) return -1;
+  memcpy(heap_profile_prefix, prefix, len + 1);
+  struct sigaction sa = {};
+  sa.sa_handler = heap_profile_signal_handler;
+  sa.sa_flags = SA_RESTART;
+  return sigaction(signo, &sa, nullptr);
+}
+
+namespace {
+
+// Makes it safe to call malloc in the child of a multi-threaded fork
+[[gnu::constructor, gnu::cold]] void register_atfork() noexcept {
+  pthread_atfork(alloc::fork_prepare, alloc::fork_parent, alloc::fork_child);
+}
+
+[[gnu::constructor, gnu::cold]] void init_decay_from_env() noexcept {
+  if (const char* s = getenv("CBU_MALLOC_DECAY_MS"); s && *s)
+    alloc::set_decay_time(atoi(s));
+  if (const char* s = getenv("CBU_MALLOC_BACKGROUND_DECAY"); s && *s == '1')
+    alloc::start_background_decay();
+}
+
+[[gnu::constructor, gnu::cold]] void init_thread_cache_from_env() noexcept {
+  if (const char* s = getenv("CBU_MALLOC_THREAD_CACHE_BYTES"); s && *s)
+    alloc::set_thread_cache_limit(strtoul(s, nullptr, 0));
+}
+
+[[gnu::constructor, gnu::cold]] void init_numa_from_env() noexcept {
+  if (const char* s = getenv("CBU_MALLOC_NUMA"); s && *s == '0')
+    alloc::set_numa_aware(false);
+}
+
+[[gnu::constructor, gnu::cold]] void init_heap_profile_from_env() noexcept {
+  size_t rate = 0;
+  if (const char* s = getenv("CBU_MALLOC_SAMPLE_RATE"); s && *s)
+    rate = strtoul(s, nullptr, 0);
+  if (const char* s = getenv("CBU_MALLOC_HEAP_PROFILE"); s && *s) {
+    if (rate == 0) rate = kDefaultSampleRate;
+    cbu_malloc_heap_profile_on_signal(SIGUSR2, s);
+  }
+  if (rate) alloc::set_sample_rate(rate);
+}
+
+[[gnu::constructor, gnu::cold]] void init_guard_from_env() noexcept {
+  if (const char* s = getenv("CBU_MALLOC_GUARD_RATE"); s && *s)
+    alloc::set_guard_rate(strtoul(s, nullptr, 0));
+}
+
+}  // namespace
+
 extern "C" {
 
 void* malloc(size_t) noexcept
@@ -123,6 +324,12 @@ void free(void*) noexcept
   __attribute__((alias("cbu_free"))) cbu_malloc_visibility_default;
 void cfree(void*) noexcept
   __attribute__((alias("cbu_cfree"))) cbu_malloc_visibility_default;
+// C23
+void free_sized(void*, size_t) noexcept
+  __attribute__((alias("cbu_sized_free"))) cbu_malloc_visibility_default;
+void free_aligned_sized(void*, size_t, size_t) noexcept
+  __attribute__((alias("cbu_aligned_sized_free")))
+  cbu_malloc_visibility_default;
 void* calloc(size_t, size_t) noexcept
   __attribute__((alias("cbu_calloc"))) cbu_malloc_visibility_default;
 void* realloc(void*, size_t) noexcept
@@ -148,5 +355,13 @@ size_t malloc_usable_size(void*) noexcept
 int malloc_trim(size_t) noexcept
   __attribute__((alias("cbu_malloc_trim"), cold))
   cbu_malloc_visibility_default;
+struct cbu_mallinfo2 mallinfo2() noexcept
+  __attribute__((alias("cbu_mallinfo2"), cold)) cbu_malloc_visibility_default;
+void malloc_stats() noexcept
+  __attribute__((alias("cbu_malloc_stats"), cold))
+  cbu_malloc_visibility_default;
+int malloc_info(int, FILE*) noexcept
+  __attribute__((alias("cbu_malloc_info"), cold))
+  cbu_malloc_visibility_default;
 
 } // extern "C"
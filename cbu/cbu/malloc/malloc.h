@@ -29,6 +29,7 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdio.h>
 
 #include "cbu/malloc/visibility.h"
 
@@ -42,6 +43,22 @@ void cbu_free(void *) noexcept cbu_malloc_visibility_default;
 
 void cbu_cfree(void *) noexcept cbu_malloc_visibility_default;
 
+// Like C23 free_sized and free_aligned_sized (which are also provided).
+// The size must be the one requested from malloc, calloc or realloc, or
+// aligned_alloc etc. with the same boundary.  The size class is derived
+// from it without looking up the block, which is faster.
+void cbu_sized_free(void *, size_t) noexcept cbu_malloc_visibility_default;
+
+void cbu_aligned_sized_free(void *, size_t, size_t) noexcept
+  cbu_malloc_visibility_default;
+
+// Non-standard: See cbu::alloc::allocate_batch and cbu::alloc::reclaim_batch.
+// cbu_malloc_batch(size, count, out) returns the number of blocks allocated.
+size_t cbu_malloc_batch(size_t, size_t, void **) noexcept
+  cbu_malloc_visibility_default;
+
+void cbu_free_batch(void **, size_t) noexcept cbu_malloc_visibility_default;
+
 void *cbu_calloc(size_t, size_t) noexcept
   __attribute__((__malloc__)) cbu_malloc_visibility_default;
 
@@ -75,4 +92,71 @@ int cbu_malloc_trim(size_t) noexcept
   cbu_malloc_visibility_default
   ;
 
+// Non-standard: See cbu::alloc::set_decay_time and
+// cbu::alloc::start_background_decay.
+// They can also be set with environment variables CBU_MALLOC_DECAY_MS and
+// CBU_MALLOC_BACKGROUND_DECAY=1.
+void cbu_malloc_set_decay_time(int) noexcept
+  __attribute__((__cold__)) cbu_malloc_visibility_default;
+
+int cbu_malloc_start_background_decay() noexcept
+  __attribute__((__cold__)) cbu_malloc_visibility_default;
+
+// Non-standard: See cbu::alloc::set_guard_rate.
+// It can also be set with environment variable CBU_MALLOC_GUARD_RATE.
+void cbu_malloc_set_guard_rate(size_t) noexcept
+  __attribute__((__cold__)) cbu_malloc_visibility_default;
+
+// Non-standard: See cbu::alloc::set_thread_cache_limit.
+// It can also be set with environment variable CBU_MALLOC_THREAD_CACHE_BYTES.
+void cbu_malloc_set_thread_cache_limit(size_t) noexcept
+  __attribute__((__cold__)) cbu_malloc_visibility_default;
+
+// Statistics (see cbu::alloc::get_stats).
+// Same layout as struct mallinfo2 of glibc.
+struct cbu_mallinfo2 {
+  size_t arena;     // Bytes mapped for arenas and medium blocks
+  size_t ordblks;   // Unused
+  size_t smblks;    // Unused
+  size_t hblks;     // Unused
+  size_t hblkhd;    // Bytes of large blocks in their own mappings
+  size_t usmblks;   // Unused
+  size_t fsmblks;   // Bytes cached in thread caches
+  size_t uordblks;  // Bytes in use
+  size_t fordblks;  // Free bytes (arena + hblkhd - uordblks)
+  size_t keepcost;  // Unused
+};
+
+struct cbu_mallinfo2 cbu_mallinfo2() noexcept
+  __attribute__((__cold__)) cbu_malloc_visibility_default;
+
+// Writes human-readable statistics to stderr
+void cbu_malloc_stats() noexcept
+  __attribute__((__cold__)) cbu_malloc_visibility_default;
+
+// Writes statistics in JSON (not XML like glibc).  options must be 0.
+int cbu_malloc_info(int options, FILE *) noexcept
+  __attribute__((__cold__)) cbu_malloc_visibility_default;
+
+// Non-standard: Formats statistics, in JSON if json is nonzero.
+// Like snprintf, returns the length of the full output.
+size_t cbu_malloc_format_stats(char *, size_t, int json) noexcept
+  __attribute__((__cold__)) cbu_malloc_visibility_default;
+
+// Non-standard: Heap profiling (see cbu::alloc::set_sample_rate and
+// cbu::alloc::dump_heap_profile).
+// cbu_malloc_heap_profile_on_signal installs a handler of signo, which dumps
+// the profile to <prefix>.<pid>.<seq>.heap.
+// Environment variables: CBU_MALLOC_SAMPLE_RATE sets the sample rate;
+// CBU_MALLOC_HEAP_PROFILE=<prefix> dumps on SIGUSR2, and samples every
+// 512 KiB unless CBU_MALLOC_SAMPLE_RATE is also set.
+void cbu_malloc_set_sample_rate(size_t) noexcept
+  __attribute__((__cold__)) cbu_malloc_visibility_default;
+
+int cbu_malloc_dump_heap_profile(int fd) noexcept
+  __attribute__((__cold__)) cbu_malloc_visibility_default;
+
+int cbu_malloc_heap_profile_on_signal(int signo, const char *prefix) noexcept
+  __attribute__((__cold__)) cbu_malloc_visibility_default;
+
 } // extern "C"
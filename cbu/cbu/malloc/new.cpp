@@ -30,10 +30,12 @@
 
 #include <stdlib.h>
 
+#include <algorithm>
 #include <new>
 
 #include "cbu/alloc/alloc.h"
 #include "cbu/alloc/pagesize.h"
+#include "cbu/common/bit.h"
 #include "cbu/malloc/visibility.h"
 
 namespace {
@@ -56,6 +58,12 @@ void* new_throw(size_t n) {
   return r;
 }
 
+// Aligned allocations of 0 bytes allocate 1, and are rounded up to the
+// alignment
+inline size_t aligned_size(size_t size, std::align_val_t alignment) noexcept {
+  return cbu::pow2_ceil(std::max<size_t>(size, 1), size_t(alignment));
+}
+
 }  // namespace
 
 // Regular new/delete
@@ -159,13 +167,15 @@ void* operator new[](size_t n, std::align_val_t alignment,
 }
 
 cbu_malloc_visibility_default
-void operator delete(void* ptr, size_t size, std::align_val_t) noexcept {
-  alloc::reclaim(ptr, size);
+void operator delete(void* ptr, size_t size,
+                     std::align_val_t alignment) noexcept {
+  alloc::reclaim(ptr, aligned_size(size, alignment));
 }
 
 cbu_malloc_visibility_default
-void operator delete [] (void* ptr, size_t size, std::align_val_t) noexcept {
-  alloc::reclaim(ptr, size);
+void operator delete [] (void* ptr, size_t size,
+                         std::align_val_t alignment) noexcept {
+  alloc::reclaim(ptr, aligned_size(size, alignment));
 }
 
 cbu_malloc_visibility_default void operator delete(
@@ -26,19 +26,27 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <fcntl.h>
 #include <malloc.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <atomic>
+#include <new>
+#include <utility>
 #if __has_include(<x86intrin.h>)
 # include <x86intrin.h>
 #endif
@@ -48,6 +56,28 @@
 extern "C" {
 void cbu_sized_free(void *, size_t) __attribute__((__weak__));
 void cbu_sized_free(void *p, size_t) { free(p); }
+size_t cbu_malloc_batch(size_t, size_t, void **) __attribute__((__weak__));
+size_t cbu_malloc_batch(size_t size, size_t n, void **out) {
+  for (size_t i = 0; i < n; ++i)
+    if ((out[i] = malloc(size)) == NULL) return i;
+  return n;
+}
+void cbu_free_batch(void **, size_t) __attribute__((__weak__));
+void cbu_free_batch(void **p, size_t n) {
+  for (size_t i = 0; i < n; ++i) free(p[i]);
+}
+void cbu_malloc_set_decay_time(int) __attribute__((__weak__));
+void cbu_malloc_set_decay_time(int) {}
+int cbu_malloc_start_background_decay() __attribute__((__weak__));
+int cbu_malloc_start_background_decay() { return 0; }
+size_t cbu_malloc_format_stats(char *, size_t, int) __attribute__((__weak__));
+size_t cbu_malloc_format_stats(char *, size_t, int) { return 0; }
+void cbu_malloc_set_sample_rate(size_t) __attribute__((__weak__));
+void cbu_malloc_set_sample_rate(size_t) {}
+int cbu_malloc_dump_heap_profile(int) __attribute__((__weak__));
+int cbu_malloc_dump_heap_profile(int) { return 1; }
+// Not defined unless linking to cbu_malloc
+void cbu_malloc_set_guard_rate(size_t) __attribute__((__weak__));
 } // extern "C"
 
 namespace {
@@ -138,6 +168,30 @@ void *basic_check(void* = nullptr) {
   return nullptr;
 }
 
+// Batches of blocks of the same size, freed in batches of mixed sizes
+void *batch_check(void* = nullptr) {
+  static const size_t sizes[] = {1, 48, 1000, 1500, 30000, 100000};
+  constexpr size_t B = 300;
+  constexpr size_t S = sizeof(sizes) / sizeof(sizes[0]);
+  static char *p[S * B];
+  for (size_t s = 0; s < S; ++s) {
+    if (cbu_malloc_batch(sizes[s], B, (void **)p + s * B) != B)
+      return (void *)1;
+    for (size_t k = 0; k < B; ++k)
+      memset(p[s * B + k], s * B + k, sizes[s]);
+  }
+  for (size_t s = 0; s < S; ++s)
+    for (size_t k = 0; k < B; ++k)
+      if (!check_const(p[s * B + k], s * B + k, sizes[s]))
+        return (void *)1;
+  // Interleave sizes
+  for (size_t k = 0; k < S * B; ++k)
+    std::swap(p[k], p[rand_r(&seed) % (S * B)]);
+  cbu_free_batch((void **)p, S * B / 2);
+  cbu_free_batch((void **)p + S * B / 2, S * B - S * B / 2);
+  return nullptr;
+}
+
 template <size_t N, size_t MAXBLOCK>
 void *calloc_check(void* = nullptr) {
   char *p[N];
@@ -239,6 +293,365 @@ void* align_check(void* = 0) {
   return nullptr;
 }
 
+// Blocks above 4 GiB.  Only a few pages are touched.
+void* huge_check(void* = 0) {
+  if (sizeof(void*) <= 4) return nullptr;
+  constexpr size_t kGiB = size_t(1) << 30;
+  size_t len = 5 * kGiB + 12345;
+  char* p = (char*)malloc(len);
+  if (p == nullptr) {
+    puts("Huge allocation unavailable, skipped.");
+    return nullptr;
+  }
+  if (malloc_usable_size(p) < len) return (void*)1;
+  p[0] = 1;
+  p[4 * kGiB] = 2;
+  p[len - 1] = 3;
+  size_t newlen = 6 * kGiB;
+  p = (char*)realloc(p, newlen);
+  if (p == nullptr) return (void*)1;
+  if (p[0] != 1 || p[4 * kGiB] != 2 || p[len - 1] != 3) return (void*)1;
+  if (malloc_usable_size(p) < newlen) return (void*)1;
+  p[newlen - 1] = 4;
+  // Shrink to below 4 GiB
+  p = (char*)realloc(p, 3 * kGiB);
+  if (p == nullptr || p[0] != 1) return (void*)1;
+  free(p);
+  return nullptr;
+}
+
+// Bytes in use reported by mallinfo2 should follow allocations
+void* stats_check(void* = 0) {
+  constexpr size_t N = 1000;
+  constexpr size_t M = 256;
+  void* p[N];
+  size_t before = mallinfo2().uordblks;
+  for (size_t k = 0; k < N; ++k) p[k] = malloc(M);
+  size_t during = mallinfo2().uordblks;
+  for (size_t k = 0; k < N; ++k) free(p[k]);
+  size_t after = mallinfo2().uordblks;
+  if (during < before + N * M || after > during - N * M / 2) {
+    fprintf(stderr, "mallinfo2: %zu %zu %zu\n", before, during, after);
+    return (void*)1;
+  }
+
+  // The weak cbu_malloc_format_stats returns 0 unless linking to cbu_malloc
+  char buf[256];
+  size_t len = cbu_malloc_format_stats(buf, sizeof(buf), 1);
+  if (len && (len < sizeof(buf) || strlen(buf) != sizeof(buf) - 1 ||
+              buf[0] != '{'))
+    return (void*)1;
+
+  // Mapped bytes should drop when trim returns memory to the kernel (with
+  // cbu malloc, if built with CBU_NEED_MALLOC_TRIM)
+  if (len) {
+    constexpr size_t L = 64;
+    constexpr size_t LM = 256 * 1024;
+    void* q[L];
+    for (size_t k = 0; k < L; ++k) memset(q[k] = malloc(LM), 1, LM);
+    size_t mapped = mallinfo2().arena;
+    for (size_t k = 0; k < L; ++k) free(q[k]);
+    if (malloc_trim(0) && mallinfo2().arena >= mapped) {
+      fprintf(stderr, "mallinfo2 arena: %zu %zu\n", mapped,
+              mallinfo2().arena);
+      return (void*)1;
+    }
+  }
+  return nullptr;
+}
+
+// Dumps the heap profile to a memfd, and gets the number of samples in it,
+// or -1 if nothing is dumped.  Returns false if the profile is malformed.
+// Must be called with sampling disabled.
+bool dump_profile_samples(long* samples) {
+  int fd = memfd_create("heap_profile", MFD_CLOEXEC);
+  if (fd < 0) return false;
+  bool ok = false;
+  off_t size;
+  char* buf = nullptr;
+  if (cbu_malloc_dump_heap_profile(fd) &&
+      (size = lseek(fd, 0, SEEK_END)) >= 0) {
+    buf = static_cast<char*>(malloc(size + 1));
+    if (pread(fd, buf, size, 0) == size) {
+      buf[size] = '\0';
+      long count, bytes;
+      if (size == 0) {
+        *samples = -1;
+        ok = true;
+      } else if (sscanf(buf, "heap profile: %ld: %ld [", &count, &bytes) == 2 &&
+                 strstr(buf, "] @ heap_v2/") &&
+                 strstr(buf, "\nMAPPED_LIBRARIES:\n")) {
+        *samples = count;
+        ok = true;
+      }
+    }
+  }
+  if (!ok) fprintf(stderr, "Bad heap profile: %s\n", buf ? buf : "");
+  free(buf);
+  close(fd);
+  return ok;
+}
+
+// Sampled blocks must behave like any other, and be dumped while they live
+void* profile_check(void* = 0) {
+  cbu_malloc_set_sample_rate(4096);
+  void* r = realloc_check<1024, 4096>();
+  if (r == nullptr) r = calloc_check<1024, 4096>();
+  if (r == nullptr) {
+    void* p[256];
+    for (size_t k = 0; k < 256; ++k) p[k] = malloc(k * 8 + 1);
+    for (size_t k = 0; k < 256; ++k) cbu_sized_free(p[k], k * 8 + 1);
+  }
+  cbu_malloc_set_sample_rate(0);
+  if (r) return r;
+
+  // The first allocation after setting the rate is sampled
+  long before, during, after;
+  if (!dump_profile_samples(&before)) return (void*)1;
+  cbu_malloc_set_sample_rate(1024);
+  void* q = malloc(4096);
+  cbu_malloc_set_sample_rate(0);
+  memset(q, 1, 4096);
+  if (!dump_profile_samples(&during)) return (void*)1;
+  free(q);
+  if (!dump_profile_samples(&after)) return (void*)1;
+  // Nothing is dumped without cbu malloc
+  if (before < 0) return nullptr;
+  if (during != before + 1 || after != before) {
+    fprintf(stderr, "heap profile samples: %ld %ld %ld\n", before, during,
+            after);
+    return (void*)1;
+  }
+  return nullptr;
+}
+
+std::atomic<bool> fork_check_stop;
+
+void *fork_check_worker(void *) {
+  void *p[64];
+  while (!fork_check_stop.load(std::memory_order_relaxed)) {
+    for (size_t k = 0; k < 64; ++k)
+      p[k] = malloc(rand_r(&seed) % 65536 + 1);
+    for (size_t k = 0; k < 64; ++k)
+      free(p[k]);
+  }
+  return nullptr;
+}
+
+// Fork while other threads are allocating; the children must be able to
+// allocate.  A deadlocked child is killed by SIGALRM.
+void* fork_check(void* = 0) {
+  constexpr size_t THREADS = 4;
+  pthread_t id[THREADS];
+  fork_check_stop = false;
+  for (size_t i = 0; i < THREADS; ++i)
+    pthread_create(&id[i], nullptr, fork_check_worker, nullptr);
+
+  void *r = nullptr;
+  for (int i = 0; i < 100 && r == nullptr; ++i) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      alarm(10);
+      _exit(basic_check<64, 65536>() || realloc_check<64, 4096>());
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0)
+      r = (void*)1;
+  }
+
+  fork_check_stop = true;
+  for (size_t i = 0; i < THREADS; ++i)
+    pthread_join(id[i], nullptr);
+  return r;
+}
+
+int thread_count() {
+  int n = 0;
+  if (FILE *fp = fopen("/proc/self/status", "r")) {
+    char line[256];
+    while (fgets(line, sizeof(line), fp) &&
+           sscanf(line, "Threads: %d", &n) != 1) {
+    }
+    fclose(fp);
+  }
+  return n;
+}
+
+// The background decay thread doesn't survive fork; the child must be able to
+// start it again.  Freeing pages mustn't start it behind the child's back.
+// The thread is started in a child, so that it doesn't run during the other
+// tests.
+void* background_decay_check(void* = 0) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    alarm(10);
+    if (!cbu_malloc_start_background_decay())
+      _exit(0);
+    pid_t grandchild = fork();
+    if (grandchild == 0) {
+      free(memset(malloc(4 * 1024 * 1024), 1, 4 * 1024 * 1024));
+      int before = thread_count();
+      _exit(before == 1 && cbu_malloc_start_background_decay() &&
+            thread_count() == 2 ? 0 : 1);
+    }
+    int status;
+    _exit(grandchild < 0 || waitpid(grandchild, &status, 0) != grandchild ||
+          !WIFEXITED(status) || WEXITSTATUS(status) != 0);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0)
+    return (void*)1;
+  return nullptr;
+}
+
+// Runs fn in a child with every allocation guarded, and returns the signal
+// that kills it (0 if it exits normally)
+template <typename Fn>
+int guard_run(Fn fn) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    alarm(10);
+    int fd = open("/dev/null", O_WRONLY);
+    dup2(fd, 2);
+    cbu_malloc_set_guard_rate(1);
+    fn();
+    _exit(0);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid) return -1;
+  return WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status) ? -1 : 0;
+}
+
+void* guard_check(void* = 0) {
+  if (!cbu_malloc_set_guard_rate) return nullptr;
+  static char *volatile p;
+  if (guard_run([] {
+        for (size_t k = 1; k < 4096; k += 37) {
+          p = (char *)malloc(k);
+          memset(p, 1, k);
+          p = (char *)realloc(p, k + 100);
+          if (!check_const(p, 1, k)) _exit(1);
+          free(p);
+        }
+        if (basic_check<64, 4096>()) _exit(1);
+        // Guarded blocks freed in batches
+        void* q[64];
+        for (size_t k = 0; k < 64; ++k) q[k] = malloc(32);
+        cbu_free_batch(q, 64);
+      }) != 0)
+    return (void *)1;
+  // Overflow into the guard page
+  if (guard_run([] { p = (char *)malloc(100); p[112] = 0; }) != SIGSEGV)
+    return (void *)1;
+  // Overflow into the slack before the guard page, detected by free
+  if (guard_run([] { p = (char *)malloc(100); p[100] = 0; free(p); }) !=
+      SIGABRT)
+    return (void *)1;
+  // Use after free
+  if (guard_run([] { p = (char *)malloc(100); free(p); p[0] = 0; }) != SIGSEGV)
+    return (void *)1;
+  // Double sized free
+  if (guard_run([] {
+        p = (char *)malloc(100);
+        cbu_sized_free(p, 100);
+        cbu_sized_free(p, 100);
+      }) != SIGABRT)
+    return (void *)1;
+  return nullptr;
+}
+
+// Number of cached small blocks of the size, from the stats in JSON
+size_t cached_blocks(size_t size) {
+  static char buf[16384];
+  cbu_malloc_format_stats(buf, sizeof(buf), 1);
+  char key[32];
+  snprintf(key, sizeof(key), "{\"size\":%zu,", size);
+  const char* p = strstr(buf, key);
+  if (p) p = strstr(p, "\"cached\":");
+  return p ? strtoull(p + 9, nullptr, 10) : 0;
+}
+
+// Idle blocks in a thread cache are flushed without the background decay
+// thread, as the thread goes through slow paths.  Run in a child, so that
+// the decay time doesn't affect the other tests.
+void* cache_scavenge_check(void* = 0) {
+  char probe[1];
+  if (!cbu_malloc_format_stats(probe, sizeof(probe), 1)) return nullptr;
+  pid_t pid = fork();
+  if (pid == 0) {
+    alarm(10);
+    cbu_malloc_set_decay_time(100);
+    constexpr size_t N = 200;
+    void* p[N];
+    for (size_t k = 0; k < N; ++k) p[k] = malloc(64);
+    for (size_t k = 0; k < N; ++k) free(p[k]);
+    size_t cached = cached_blocks(64);
+    // Medium caches start with room for a single 32 KiB block, and grow
+    // when they overflow after having had to take new blocks
+    constexpr size_t L = 42;
+    void* r[L];
+    for (int round = 0; round < 8; ++round) {
+      for (size_t k = 0; k < L; ++k) r[k] = malloc(32768);
+      for (size_t k = 0; k < L; ++k) free(r[k]);
+    }
+    size_t medium_cached = cached_blocks(32768);
+    // More small and medium blocks than a cache can hold, so that each
+    // round refills and flushes, which checks whether the caches are due
+    // for scavenging.  The first scavenge finds the 64-byte and 32 KiB
+    // blocks; a later one finds them still idle.
+    constexpr size_t M = 1100;
+    constexpr size_t MM = 600;
+    static void* q[M];
+    for (int round = 0; round < 5; ++round) {
+      usleep(20000);
+      for (size_t k = 0; k < M; ++k) q[k] = malloc(1024);
+      for (size_t k = 0; k < M; ++k) free(q[k]);
+      for (size_t k = 0; k < MM; ++k) q[k] = malloc(2048);
+      for (size_t k = 0; k < MM; ++k) free(q[k]);
+    }
+    _exit(cached >= N && cached_blocks(64) < cached &&
+                  cached_blocks(32768) < medium_cached
+              ? 0
+              : 1);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0)
+    return (void*)1;
+  return nullptr;
+}
+
+// Sized free must file blocks under the size classes they came from, or
+// a later small allocation gets a block of a larger class
+void* sized_free_check(void* = 0) {
+  auto check_small = []() -> bool {
+    void* q = malloc(16);
+    size_t usable = malloc_usable_size(q);
+    free(q);
+    return usable < 64;
+  };
+  for (size_t n : {0, 1, 15, 16, 17, 100, 1000, 5000, 40000}) {
+    void* p = malloc(n);
+    memset(p, 1, n);
+    cbu_sized_free(p, n);
+    if (!check_small()) return (void*)1;
+    for (size_t align = 16; align <= 4096; align *= 4) {
+      p = operator new(n, std::align_val_t(align));
+      if ((uintptr_t)p % align) return (void*)1;
+      memset(p, 1, n);
+      operator delete(p, n, std::align_val_t(align));
+      if (!check_small()) return (void*)1;
+      p = operator new[](n, std::align_val_t(align));
+      memset(p, 1, n);
+      operator delete[](p, n, std::align_val_t(align));
+      if (!check_small()) return (void*)1;
+    }
+  }
+  return basic_check<64, 4096>();
+}
+
 double diff(const timespec &a, const timespec &b) {
   return (b.tv_sec - a.tv_sec) + 1.e-9 * (b.tv_nsec - a.tv_nsec);
 }
@@ -296,6 +709,37 @@ void performance_test() {
   printf(" %12.3g %12.3g\n", perf.v(1), perf.v(2));
 }
 
+// Allocates and frees N blocks of M bytes, B at a time
+template <size_t N, size_t M, size_t B, bool BATCH>
+[[gnu::noinline]]
+void performance_batch() {
+  Perf perf;
+
+  static void *p[N];
+  for (size_t k = 0; k < N; k += B) {
+    if (BATCH) {
+      if (cbu_malloc_batch(M, B, p + k) != B) abort();
+    } else {
+      for (size_t j = k; j < k + B; ++j) p[j] = malloc(M);
+    }
+    for (size_t j = k; j < k + B; ++j) *(char *)p[j] = 0;
+  }
+
+  perf.tick(1);
+
+  for (size_t k = 0; k < N; k += B) {
+    if (BATCH) {
+      cbu_free_batch(p + k, B);
+    } else {
+      for (size_t j = k; j < k + B; ++j) free(p[j]);
+    }
+  }
+
+  perf.tick(2);
+
+  printf(" %12.3g %12.3g\n", perf.v(1), perf.v(2));
+}
+
 template <size_t N, size_t MAXBLOCK>
 [[gnu::noinline]]
 void performance_realloc() {
@@ -330,6 +774,35 @@ void performance_realloc() {
   printf(" %12.3g %12.3g %12.3g\n", perf.v(1), perf.v(2), perf.v(3));
 }
 
+// Frees large blocks in random order, reallocating each, so that frees look
+// up blocks spread over a wide range of pages
+template <size_t N, size_t MAXBLOCK>
+[[gnu::noinline]]
+void performance_large_free() {
+  Perf perf;
+
+  static void *p[N];
+  for (size_t k=0; k<N; ++k)
+    p[k] = malloc(MAXBLOCK / 2 + rand_r(&seed) % (MAXBLOCK / 2));
+
+  perf.tick(1);
+
+  for (size_t j=0; j<N*8; ++j) {
+    size_t k = rand_r(&seed) % N;
+    free(p[k]);
+    p[k] = malloc(MAXBLOCK / 2 + rand_r(&seed) % (MAXBLOCK / 2));
+  }
+
+  perf.tick(2);
+
+  for (size_t k=0; k<N; ++k)
+    free(p[k]);
+
+  perf.tick(3);
+
+  printf(" %12.3g %12.3g %12.3g\n", perf.v(1), perf.v(2), perf.v(3));
+}
+
 template <size_t N>
 [[gnu::noinline]]
 void performance_real() {
@@ -358,6 +831,233 @@ void performance_real() {
   printf(" %12.3g\n", perf.v(1));
 }
 
+// Each thread repeatedly allocates and frees a batch of small blocks.
+// This is dominated by the cost of grabbing thread caches.
+template <size_t N, size_t MAXBLOCK>
+void *performance_threads_worker(void *) {
+  void *p[N];
+  for (size_t round = 0; round < 256; ++round) {
+    for (size_t k=0; k<N; ++k)
+      p[k] = malloc(rand_r(&seed) % MAXBLOCK + 1);
+    for (size_t k=0; k<N; ++k)
+      free(p[k]);
+  }
+  return nullptr;
+}
+
+template <size_t THREADS, size_t N, size_t MAXBLOCK>
+[[gnu::noinline]]
+void performance_threads() {
+  Perf perf;
+
+  pthread_t id[THREADS];
+  for (size_t i=0; i<THREADS; ++i)
+    pthread_create(&id[i], NULL, performance_threads_worker<N, MAXBLOCK>, 0);
+  for (size_t i=0; i<THREADS; ++i)
+    pthread_join(id[i], nullptr);
+
+  perf.tick(1);
+
+  printf(" %12.3g\n", perf.v(1));
+}
+
+template <size_t N, size_t MAXBLOCK>
+void *performance_consumer(void *arg) {
+  int fd = *(int *)arg;
+  void *p[N];
+  while (read(fd, p, sizeof(p)) == sizeof(p)) {
+    for (size_t k=0; k<N; ++k)
+      free(p[k]);
+  }
+  return nullptr;
+}
+
+// One thread allocates, and another frees
+// (pipe writes of up to PIPE_BUF bytes are atomic)
+template <size_t ROUNDS, size_t N, size_t MAXBLOCK>
+[[gnu::noinline]]
+void performance_producer_consumer() {
+  static_assert(N * sizeof(void *) <= 4096);
+  Perf perf;
+
+  int fds[2];
+  if (pipe(fds) != 0)
+    return;
+  pthread_t id;
+  pthread_create(&id, NULL, performance_consumer<N, MAXBLOCK>, &fds[0]);
+  void *p[N];
+  for (size_t round = 0; round < ROUNDS; ++round) {
+    for (size_t k=0; k<N; ++k)
+      p[k] = malloc(rand_r(&seed) % MAXBLOCK + 1);
+    if (write(fds[1], p, sizeof(p)) != sizeof(p))
+      break;
+  }
+  close(fds[1]);
+  pthread_join(id, nullptr);
+  close(fds[0]);
+
+  perf.tick(1);
+
+  printf(" %12.3g\n", perf.v(1));
+}
+
+long resident_kib() {
+  long pages = 0;
+  if (FILE *fp = fopen("/proc/self/statm", "r")) {
+    if (fscanf(fp, "%*s %ld", &pages) != 1)
+      pages = 0;
+    fclose(fp);
+  }
+  return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Keep many blocks of random sizes alive, and report internal fragmentation
+// (usable size / requested size) and resident memory / requested size
+template <size_t N, size_t MINBLOCK, size_t MAXBLOCK>
+[[gnu::noinline]]
+void fragmentation_test() {
+  void *p[N];
+  size_t requested = 0;
+  size_t usable = 0;
+
+  long rss_before = resident_kib();
+  for (size_t k=0; k<N; ++k) {
+    size_t siz = MINBLOCK + rand_r(&seed) % (MAXBLOCK - MINBLOCK + 1);
+    p[k] = malloc(siz);
+    memset(p[k], k, siz);
+    requested += siz;
+    usable += malloc_usable_size(p[k]);
+  }
+  long rss_after = resident_kib();
+
+  for (size_t k=0; k<N; ++k)
+    free(p[k]);
+
+  printf(" %12.3f %12.3f\n", double(usable) / requested,
+         (rss_after - rss_before) * 1024. / requested);
+}
+
+// Parses a list like "0-3,8-11" in a sysfs file.
+// Returns the greatest number, or -1 on failure.
+int read_sysfs_list(const char *path, cpu_set_t *set) {
+  char buf[1024];
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+  bool ok = fgets(buf, sizeof(buf), fp);
+  fclose(fp);
+  if (!ok)
+    return -1;
+  CPU_ZERO(set);
+  int max = -1;
+  for (char *p = buf; *p >= '0' && *p <= '9';) {
+    int lo = strtol(p, &p, 10);
+    int hi = (*p == '-') ? strtol(p + 1, &p, 10) : lo;
+    for (int i = lo; i <= hi && i < CPU_SETSIZE; ++i)
+      CPU_SET(i, set);
+    if (hi > max)
+      max = hi;
+    if (*p == ',')
+      ++p;
+  }
+  return max;
+}
+
+struct NumaWorkerArg {
+  long node;
+  cpu_set_t cpus;
+};
+
+// Allocates with a thread pinned to a node, and returns the number of pages
+// placed on other nodes.  The node of a thread is fixed when it first
+// allocates, so it pins itself before anything else.
+void *numa_worker(void *arg) {
+  constexpr size_t N = 4096;
+  const NumaWorkerArg *a = static_cast<const NumaWorkerArg *>(arg);
+  long node = a->node;
+  if (sched_setaffinity(0, sizeof(a->cpus), &a->cpus) != 0)
+    return nullptr;
+
+  static thread_local void *p[N];
+  static thread_local int status[N];
+  for (size_t k=0; k<N; ++k)
+    p[k] = memset(malloc(k % 16 ? 256 : 65536), 1, 256);
+  // Pages are queried with move_pages without moving them
+  void *pages[N];
+  for (size_t k=0; k<N; ++k)
+    pages[k] = (void *)(uintptr_t(p[k]) & -uintptr_t(sysconf(_SC_PAGESIZE)));
+  size_t remote = 0;
+  if (syscall(SYS_move_pages, 0, N, pages, nullptr, status, 0) == 0) {
+    for (size_t k=0; k<N; ++k)
+      remote += (status[k] >= 0 && status[k] != node);
+  }
+  for (size_t k=0; k<N; ++k)
+    free(p[k]);
+  return (void *)remote;
+}
+
+// Runs a thread on each node, and reports the fraction of blocks on remote
+// nodes
+void numa_test() {
+  cpu_set_t nodes;
+  int max_node = read_sysfs_list("/sys/devices/system/node/online", &nodes);
+  // Read here, since reading allocates
+  static NumaWorkerArg args[64];
+  int threads = 0;
+  for (long node = 0; node <= max_node && threads < 64; ++node) {
+    if (!CPU_ISSET(node, &nodes))
+      continue;
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%ld/cpulist",
+             node);
+    args[threads].node = node;
+    if (read_sysfs_list(path, &args[threads].cpus) >= 0)
+      ++threads;
+  }
+  pthread_t id[64];
+  for (int i = 0; i < threads; ++i)
+    pthread_create(&id[i], nullptr, numa_worker, &args[i]);
+  size_t remote = 0;
+  for (int i = 0; i < threads; ++i) {
+    void *v;
+    pthread_join(id[i], &v);
+    remote += (size_t)v;
+  }
+  printf(" %12d %12.3f\n", threads,
+         threads ? double(remote) / (threads * 4096) : 0.);
+}
+
+// Free a burst of 64 MiB, and report RSS (KiB) right after freeing and
+// after the decay time has passed
+void decay_test() {
+  constexpr size_t N = 256;
+  constexpr size_t BLOCK = 256 * 1024;
+  cbu_malloc_set_decay_time(200);
+
+  // Keep as much live, so that freeing the burst doesn't trigger munmap
+  void *live[N];
+  void *p[N];
+  for (size_t k=0; k<N; ++k)
+    live[k] = memset(malloc(BLOCK), 1, BLOCK);
+  for (size_t k=0; k<N; ++k)
+    p[k] = memset(malloc(BLOCK), 1, BLOCK);
+  long peak = resident_kib();
+  for (size_t k=0; k<N; ++k)
+    free(p[k]);
+  long freed = resident_kib();
+
+  // Decay is done as pages are reclaimed
+  for (int i=0; i<10; ++i) {
+    usleep(50000);
+    void *volatile q = malloc(BLOCK);
+    free(q);
+  }
+  printf(" %12ld %12ld %12ld\n", peak, freed, resident_kib());
+
+  for (size_t k=0; k<N; ++k)
+    free(live[k]);
+}
+
 } // namespace
 
 int main (int argc, char **argv) {
@@ -375,6 +1075,29 @@ int main (int argc, char **argv) {
 
   setlinebuf(stdout);
 
+  // Each fragmentation test runs in a fresh child process, so that RSS is not
+  // affected by memory cached from other tests
+#define FRAG_TEST(name,args...) \
+  do { \
+    pid_t pid = fork(); \
+    if (pid == 0) { printf("%15s", name); args; _exit(0); } \
+    waitpid(pid, nullptr, 0); \
+  } while (0)
+
+  puts("Fragmentation (usable/requested, RSS/requested):");
+  FRAG_TEST("  1-128B frag:", fragmentation_test<65536, 1, 128>());
+  FRAG_TEST("129-512B frag:", fragmentation_test<32768, 129, 512>());
+  FRAG_TEST("513-1KiB frag:", fragmentation_test<32768, 513, 1024>());
+  FRAG_TEST("   70B frag:", fragmentation_test<65536, 70, 70>());
+  FRAG_TEST("  520B frag:", fragmentation_test<16384, 520, 520>());
+  FRAG_TEST("2-16KiB frag:", fragmentation_test<4096, 2049, 16384>());
+
+  puts("Decay (RSS KiB at peak, after free, after decay):");
+  FRAG_TEST("  64MiB decay:", decay_test());
+
+  puts("NUMA (nodes, fraction of blocks on remote nodes):");
+  FRAG_TEST("  NUMA remote:", numa_test());
+
   struct timespec starttime, endtime;
   for (int i=0; i<3; ++i) {
 
@@ -393,12 +1116,26 @@ int main (int argc, char **argv) {
     if (realloc_check<8192,1024> ()) return 1;
     puts ("Testing realloc with large blocks...");
     if (realloc_check<128,1024*1024> ()) return 1;
+    puts ("Testing guarded allocation...");
+    if (guard_check ()) return 1;
+    puts ("Testing batch allocation...");
+    if (batch_check ()) return 1;
     puts ("Testing alignment...");
     if (align_check ()) return 1;
-#if 0
-    puts("Testing sized free...");
-    if (sized_delete_check()) return 1;
-#endif
+    puts ("Testing huge blocks...");
+    if (huge_check ()) return 1;
+    puts ("Testing statistics...");
+    if (stats_check ()) return 1;
+    puts ("Testing heap profiling...");
+    if (profile_check ()) return 1;
+    puts ("Testing fork in multi-threaded process...");
+    if (fork_check ()) return 1;
+    puts ("Testing background decay across fork...");
+    if (background_decay_check ()) return 1;
+    puts ("Testing thread cache scavenging...");
+    if (cache_scavenge_check ()) return 1;
+    puts ("Testing sized free...");
+    if (sized_free_check ()) return 1;
 
     puts ("Testing multithreading...");
     pthread_t id[128];
@@ -473,15 +1210,30 @@ int main (int argc, char **argv) {
     TEST(" 1MiB calloc:", performance_test<true, 256,1024*1024>());
     TEST("32MiB calloc:", performance_test<true,16,32*1024*1024>());
 
+    TEST("  64B onebyone:", performance_batch<262144, 64, 256, false>());
+    TEST("  64B batch:", performance_batch<262144, 64, 256, true>());
+    TEST(" 4KiB onebyone:", performance_batch<65536, 4096, 64, false>());
+    TEST(" 4KiB batch:", performance_batch<65536, 4096, 64, true>());
+
     TEST("1KiB realloc:", performance_realloc<65536,1024>());
     TEST("1MiB realloc:", performance_realloc<128,1024*1024>());
     TEST("32MiB realloc:", performance_realloc<16,32*1024*1024>());
 
+    TEST("128KiB lgfree:", performance_large_free<16384,128*1024>());
+    TEST("  2MiB lgfree:", performance_large_free<1024,2*1024*1024>());
+
     TEST("\"Real\" 128", performance_real<128>());
     TEST("\"Real\" 1024", performance_real<1024>());
     TEST("\"Real\" 2048", performance_real<2048>());
     TEST("\"Real\" 4096", performance_real<4096>());
     TEST("\"Real\" 8192", performance_real<8192>());
+
+    TEST(" 1T 256B thrd:", performance_threads<1, 1024, 256>());
+    TEST(" 4T 256B thrd:", performance_threads<4, 1024, 256>());
+    TEST("16T 256B thrd:", performance_threads<16, 1024, 256>());
+    TEST("64T 256B thrd:", performance_threads<64, 1024, 256>());
+    TEST(" 256B prodcon:", performance_producer_consumer<8192, 256, 256>());
+    TEST(" 1KiB prodcon:", performance_producer_consumer<8192, 256, 1024>());
   }
 
   struct rusage ru;